@@ -0,0 +1,340 @@
+#include "esparrag_cbor.h"
+#include <cmath>
+#include <cstring>
+
+//================================== WRITER =====================================================
+
+bool CborWriter::byte(uint8_t value)
+{
+    return raw(&value, 1);
+}
+
+bool CborWriter::raw(const void *data, size_t len)
+{
+    if (m_overflow || len > m_size - m_pos)
+    {
+        m_overflow = true;
+        return false;
+    }
+
+    memcpy(m_buffer + m_pos, data, len);
+    m_pos += len;
+    return true;
+}
+
+bool CborWriter::head(uint8_t major, uint64_t value)
+{
+    uint8_t bytes[9];
+    uint8_t type = major << 5;
+    size_t len = 0;
+
+    if (value < 24)
+    {
+        bytes[len++] = type | value;
+    }
+    else if (value <= UINT8_MAX)
+    {
+        bytes[len++] = type | 24;
+        bytes[len++] = value;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        bytes[len++] = type | 25;
+        bytes[len++] = value >> 8;
+        bytes[len++] = value;
+    }
+    else if (value <= UINT32_MAX)
+    {
+        bytes[len++] = type | 26;
+        for (int shift = 24; shift >= 0; shift -= 8)
+            bytes[len++] = value >> shift;
+    }
+    else
+    {
+        bytes[len++] = type | 27;
+        for (int shift = 56; shift >= 0; shift -= 8)
+            bytes[len++] = value >> shift;
+    }
+
+    return raw(bytes, len);
+}
+
+bool CborWriter::Int(int64_t value)
+{
+    if (value >= 0)
+        return head(MAJOR_UINT, value);
+
+    // -1 - n encoding
+    return head(MAJOR_NINT, static_cast<uint64_t>(-(value + 1)));
+}
+
+bool CborWriter::Double(double value)
+{
+    // single precision when nothing is lost, telemetry values mostly fit
+    float single = static_cast<float>(value);
+    if (static_cast<double>(single) == value || std::isnan(value))
+    {
+        uint32_t bits;
+        memcpy(&bits, &single, sizeof(bits));
+        uint8_t bytes[5] = {FLOAT_32, uint8_t(bits >> 24), uint8_t(bits >> 16), uint8_t(bits >> 8), uint8_t(bits)};
+        return raw(bytes, sizeof(bytes));
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t bytes[9] = {FLOAT_64};
+    for (int i = 0; i < 8; i++)
+        bytes[1 + i] = bits >> (56 - 8 * i);
+
+    return raw(bytes, sizeof(bytes));
+}
+
+bool CborWriter::String(const char *value)
+{
+    return String(value, value ? strlen(value) : 0);
+}
+
+bool CborWriter::String(const char *value, size_t len)
+{
+    return head(MAJOR_TEXT, len) && raw(value, len);
+}
+
+bool CborWriter::Bytes(const uint8_t *value, size_t len)
+{
+    return head(MAJOR_BYTES, len) && raw(value, len);
+}
+
+bool CborWriter::Write(const cJSON *json)
+{
+    return write(json, 0);
+}
+
+bool CborWriter::write(const cJSON *json, int depth)
+{
+    if (!json || depth > MAX_DEPTH)
+    {
+        m_overflow = true;
+        return false;
+    }
+
+    switch (json->type & 0xff)
+    {
+    case cJSON_False:
+        return Bool(false);
+    case cJSON_True:
+        return Bool(true);
+    case cJSON_NULL:
+        return Null();
+    case cJSON_String:
+    case cJSON_Raw:
+        return String(json->valuestring);
+    case cJSON_Number:
+    {
+        double value = json->valuedouble;
+        bool integral = std::trunc(value) == value && std::fabs(value) < 9007199254740992.0; // 2^53
+        return integral ? Int(static_cast<int64_t>(value)) : Double(value);
+    }
+    case cJSON_Array:
+    case cJSON_Object:
+    {
+        bool isObject = (json->type & 0xff) == cJSON_Object;
+        size_t count = cJSON_GetArraySize(json);
+        if (!(isObject ? Map(count) : Array(count)))
+            return false;
+
+        for (const cJSON *child = json->child; child; child = child->next)
+        {
+            if (isObject && !String(child->string))
+                return false;
+            if (!write(child, depth + 1))
+                return false;
+        }
+
+        return true;
+    }
+    default:
+        m_overflow = true;
+        return false;
+    }
+}
+
+//================================== READER =====================================================
+
+bool CborReader::head(uint8_t &major, uint8_t &info, uint64_t &value)
+{
+    if (m_pos >= m_len)
+        return false;
+
+    uint8_t initial = m_data[m_pos++];
+    major = initial >> 5;
+    info = initial & 0x1f;
+
+    if (info < 24)
+    {
+        value = info;
+        return true;
+    }
+
+    // 24..27 are followed by 1, 2, 4 or 8 bytes, indefinite lengths (31) are not supported
+    if (info > 27)
+        return false;
+
+    size_t bytes = 1 << (info - 24);
+    if (bytes > m_len - m_pos)
+        return false;
+
+    value = 0;
+    for (size_t i = 0; i < bytes; i++)
+        value = (value << 8) | m_data[m_pos++];
+
+    return true;
+}
+
+static double halfToDouble(uint16_t half)
+{
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0)
+        value = std::ldexp(mantissa, -24);
+    else if (exponent != 31)
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    else
+        value = mantissa == 0 ? INFINITY : NAN;
+
+    return (half & 0x8000) ? -value : value;
+}
+
+cJSON *CborReader::ToJson()
+{
+    m_pos = 0;
+    cJSON *json = read(0);
+    if (json && m_pos != m_len)
+    {
+        cJSON_Delete(json);
+        return nullptr;
+    }
+
+    return json;
+}
+
+cJSON *CborReader::read(int depth)
+{
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t value = 0;
+    if (depth > CborWriter::MAX_DEPTH || !head(major, info, value))
+        return nullptr;
+
+    switch (major)
+    {
+    case CborWriter::MAJOR_UINT:
+        return cJSON_CreateNumber(static_cast<double>(value));
+    case CborWriter::MAJOR_NINT:
+        return cJSON_CreateNumber(-1.0 - static_cast<double>(value));
+    case CborWriter::MAJOR_BYTES:
+    case CborWriter::MAJOR_TEXT:
+    {
+        if (value > m_len - m_pos)
+            return nullptr;
+
+        // cJSON needs a terminated copy, it allocates anyway
+        cJSON *string = cJSON_CreateString("");
+        if (!string)
+            return nullptr;
+
+        char *copy = static_cast<char *>(cJSON_malloc(value + 1));
+        if (!copy)
+        {
+            cJSON_Delete(string);
+            return nullptr;
+        }
+
+        memcpy(copy, m_data + m_pos, value);
+        copy[value] = '\0';
+        cJSON_free(string->valuestring);
+        string->valuestring = copy;
+        m_pos += value;
+        return string;
+    }
+    case CborWriter::MAJOR_ARRAY:
+    case CborWriter::MAJOR_MAP:
+    {
+        bool isMap = major == CborWriter::MAJOR_MAP;
+        // every item takes at least a byte, rejects absurd lengths before allocating
+        if (value > m_len - m_pos)
+            return nullptr;
+
+        cJSON *container = isMap ? cJSON_CreateObject() : cJSON_CreateArray();
+        if (!container)
+            return nullptr;
+
+        for (uint64_t i = 0; i < value; i++)
+        {
+            cJSON *key = nullptr;
+            if (isMap)
+            {
+                key = read(depth + 1);
+                if (!key || !cJSON_IsString(key))
+                {
+                    cJSON_Delete(key);
+                    cJSON_Delete(container);
+                    return nullptr;
+                }
+            }
+
+            cJSON *item = read(depth + 1);
+            if (!item)
+            {
+                cJSON_Delete(key);
+                cJSON_Delete(container);
+                return nullptr;
+            }
+
+            if (isMap)
+                cJSON_AddItemToObject(container, key->valuestring, item);
+            else
+                cJSON_AddItemToArray(container, item);
+
+            cJSON_Delete(key);
+        }
+
+        return container;
+    }
+    case CborWriter::MAJOR_TAG:
+        // tags carry semantics the json model can't hold, use the tagged item as is
+        return read(depth + 1);
+    case CborWriter::MAJOR_SIMPLE:
+    {
+        switch (info)
+        {
+        case 20:
+            return cJSON_CreateFalse();
+        case 21:
+            return cJSON_CreateTrue();
+        case 22:
+        case 23:
+            return cJSON_CreateNull();
+        case 25:
+            return cJSON_CreateNumber(halfToDouble(value));
+        case 26:
+        {
+            uint32_t bits = value;
+            float single;
+            memcpy(&single, &bits, sizeof(single));
+            return cJSON_CreateNumber(single);
+        }
+        case 27:
+        {
+            double dbl;
+            memcpy(&dbl, &value, sizeof(dbl));
+            return cJSON_CreateNumber(dbl);
+        }
+        default:
+            return nullptr;
+        }
+    }
+    default:
+        return nullptr;
+    }
+}
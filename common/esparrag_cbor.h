@@ -0,0 +1,95 @@
+#ifndef ESPARRAG_CBOR_H__
+#define ESPARRAG_CBOR_H__
+
+#include "cJSON.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Minimal CBOR (RFC 8949) encoder and decoder over caller owned buffers.
+    Neither side allocates, except CborReader::ToJson which builds a cJSON tree
+    for the existing Request/handler path.
+    Only definite lengths are produced and accepted.
+
+    uint8_t buffer[256];
+    CborWriter writer(buffer, sizeof(buffer));
+    writer.Map(1);
+    writer.String("temp");
+    writer.Int(23);
+    if (writer.Ok())
+        send(buffer, writer.Size());
+*/
+
+class CborWriter
+{
+public:
+    CborWriter(uint8_t *buffer, size_t size) : m_buffer(buffer), m_size(size) {}
+
+    bool Map(size_t pairs) { return head(MAJOR_MAP, pairs); }
+    bool Array(size_t items) { return head(MAJOR_ARRAY, items); }
+    bool Int(int64_t value);
+    bool Double(double value);
+    bool Bool(bool value) { return byte(value ? SIMPLE_TRUE : SIMPLE_FALSE); }
+    bool Null() { return byte(SIMPLE_NULL); }
+    bool String(const char *value);
+    bool String(const char *value, size_t len);
+    bool Bytes(const uint8_t *value, size_t len);
+    // encodes a whole cJSON tree, integral numbers as integers
+    bool Write(const cJSON *json);
+
+    bool Ok() const { return !m_overflow; }
+    size_t Size() const { return m_pos; }
+
+private:
+    friend class CborReader;
+
+    static constexpr uint8_t MAJOR_UINT = 0;
+    static constexpr uint8_t MAJOR_NINT = 1;
+    static constexpr uint8_t MAJOR_BYTES = 2;
+    static constexpr uint8_t MAJOR_TEXT = 3;
+    static constexpr uint8_t MAJOR_ARRAY = 4;
+    static constexpr uint8_t MAJOR_MAP = 5;
+    static constexpr uint8_t MAJOR_TAG = 6;
+    static constexpr uint8_t MAJOR_SIMPLE = 7;
+    static constexpr uint8_t SIMPLE_FALSE = 0xf4;
+    static constexpr uint8_t SIMPLE_TRUE = 0xf5;
+    static constexpr uint8_t SIMPLE_NULL = 0xf6;
+    static constexpr uint8_t FLOAT_16 = 0xf9;
+    static constexpr uint8_t FLOAT_32 = 0xfa;
+    static constexpr uint8_t FLOAT_64 = 0xfb;
+    static constexpr int MAX_DEPTH = 16;
+
+    bool head(uint8_t major, uint64_t value);
+    bool byte(uint8_t value);
+    bool raw(const void *data, size_t len);
+    bool write(const cJSON *json, int depth);
+
+    uint8_t *m_buffer;
+    size_t m_size;
+    size_t m_pos = 0;
+    bool m_overflow = false;
+};
+
+class CborReader
+{
+public:
+    CborReader(const uint8_t *data, size_t len) : m_data(data), m_len(len) {}
+
+    // nullptr if the data is not a single valid CBOR item
+    cJSON *ToJson();
+
+    /*  whether the payload starts with a CBOR map or array head (0x80 - 0xbf).
+        those bytes are utf-8 continuation bytes, no text starts with one, but a utf-8 BOM or
+        any other non ascii first byte is text. ToJson still has to accept the whole payload */
+    static bool IsCbor(const uint8_t *data, size_t len) { return len > 0 && data[0] >= 0x80 && data[0] <= 0xbf; }
+
+private:
+    bool head(uint8_t &major, uint8_t &info, uint64_t &value);
+    cJSON *read(int depth);
+
+    const uint8_t *m_data;
+    size_t m_len;
+    size_t m_pos = 0;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef ESPARRAG_LATENCY_HISTOGRAM_H__
+#define ESPARRAG_LATENCY_HISTOGRAM_H__
+
+#include "esparrag_time_units.h"
+#include "etl/algorithm.h"
+#include <stdint.h>
+
+/*
+    Fixed bucket latency histogram, no allocations and O(buckets) percentile lookup.
+    Percentiles are reported as the upper bound of the bucket they fall in.
+*/
+class LatencyHistogram
+{
+public:
+    static constexpr uint32_t BOUNDS_US[] = {100, 200, 500,
+                                             1000, 2000, 5000,
+                                             10000, 20000, 50000,
+                                             100000, 200000, 500000,
+                                             1000000, UINT32_MAX};
+    static constexpr int BUCKETS_NUM = sizeof(BOUNDS_US) / sizeof(BOUNDS_US[0]);
+
+    void Add(MicroSeconds latency)
+    {
+        uint32_t us = etl::min<uint64_t>(latency.value(), UINT32_MAX);
+        int i = 0;
+        while (us > BOUNDS_US[i])
+            i++;
+
+        m_buckets[i]++;
+        m_count++;
+        m_sumUs += us;
+        m_maxUs = etl::max(m_maxUs, us);
+    }
+
+    // percent in [0, 100]
+    MicroSeconds Percentile(uint8_t percent) const
+    {
+        if (m_count == 0)
+            return 0;
+
+        uint32_t target = (static_cast<uint64_t>(m_count) * percent + 99) / 100;
+        uint32_t accumulated = 0;
+        for (int i = 0; i < BUCKETS_NUM; i++)
+        {
+            accumulated += m_buckets[i];
+            if (accumulated >= target && accumulated > 0)
+                return etl::min(BOUNDS_US[i], m_maxUs);
+        }
+
+        return m_maxUs;
+    }
+
+    MicroSeconds Average() const { return m_count ? m_sumUs / m_count : 0; }
+    MicroSeconds Max() const { return m_maxUs; }
+    uint32_t Count() const { return m_count; }
+    void Reset() { *this = LatencyHistogram{}; }
+
+private:
+    uint32_t m_buckets[BUCKETS_NUM]{};
+    uint32_t m_count = 0;
+    uint64_t m_sumUs = 0;
+    uint32_t m_maxUs = 0;
+};
+
+#endif
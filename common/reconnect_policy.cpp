@@ -0,0 +1,71 @@
+#include "reconnect_policy.h"
+#include "esp_random.h"
+#include "etl/algorithm.h"
+
+MilliSeconds ReconnectPolicy::OnFailure()
+{
+    m_stats.failures++;
+    m_stats.consecutiveFailures++;
+
+    // a failed probe reopens, crossing the threshold opens
+    bool open = m_stats.state == eState::HALF_OPEN ||
+                (m_stats.state == eState::CLOSED && m_stats.consecutiveFailures >= m_config.failuresToOpen);
+    if (open)
+    {
+        if (m_stats.state != eState::OPEN)
+            m_stats.opened++;
+
+        m_stats.state = eState::OPEN;
+    }
+
+    if (m_stats.state == eState::OPEN)
+    {
+        m_stats.lastDelay = jitter(m_config.openDuration);
+        return m_stats.lastDelay;
+    }
+
+    uint64_t delay = m_config.initialDelay.value();
+    for (uint32_t i = 1; i < m_stats.consecutiveFailures && delay < m_config.maxDelay.value(); i++)
+        delay *= etl::max<uint8_t>(m_config.multiplier, 1);
+
+    m_stats.lastDelay = jitter(etl::min<uint64_t>(delay, m_config.maxDelay.value()));
+    return m_stats.lastDelay;
+}
+
+void ReconnectPolicy::OnAttempt()
+{
+    m_stats.attempts++;
+    if (m_stats.state == eState::OPEN)
+        m_stats.state = eState::HALF_OPEN;
+}
+
+void ReconnectPolicy::OnSuccess()
+{
+    m_stats.successes++;
+    m_stats.consecutiveFailures = 0;
+    m_stats.state = eState::CLOSED;
+}
+
+MilliSeconds ReconnectPolicy::jitter(MilliSeconds delay) const
+{
+    uint32_t spread = static_cast<uint64_t>(delay.value()) * etl::min<uint8_t>(m_config.jitterPercent, 100) / 100;
+    if (spread == 0)
+        return delay;
+
+    return delay.value() - esp_random() % (spread + 1);
+}
+
+const char *ReconnectPolicy::StateName(eState state)
+{
+    switch (state)
+    {
+    case eState::CLOSED:
+        return "closed";
+    case eState::OPEN:
+        return "open";
+    case eState::HALF_OPEN:
+        return "half open";
+    }
+
+    return "";
+}
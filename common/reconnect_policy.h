@@ -0,0 +1,71 @@
+#ifndef ESPARRAG_RECONNECT_POLICY_H__
+#define ESPARRAG_RECONNECT_POLICY_H__
+
+#include "esparrag_time_units.h"
+#include <stdint.h>
+
+/*
+    Reconnect pacing shared by the network FSMs.
+    Delays grow exponentially from initialDelay up to maxDelay and are jittered down by up to
+    jitterPercent, so devices that lost the same AP or broker don't come back in lockstep.
+    After failuresToOpen consecutive failures the breaker opens and attempts are spaced by openDuration.
+    The first attempt after that is a half open probe, a failure reopens the breaker, a success closes it.
+    The policy holds no timer, the owner schedules the returned delay.
+
+    MilliSeconds delay = policy.OnFailure();
+    xTimerChangePeriod(timer, delay.toTicks(), 0);
+    ...
+    policy.OnAttempt();
+    connect();
+*/
+struct reconnect_config_t
+{
+    MilliSeconds initialDelay = 1000;
+    MilliSeconds maxDelay = 60000;
+    uint8_t multiplier = 2;
+    uint8_t jitterPercent = 50;
+    uint16_t failuresToOpen = 10;
+    MilliSeconds openDuration = 300000;
+};
+
+class ReconnectPolicy
+{
+public:
+    enum class eState
+    {
+        CLOSED,
+        OPEN,
+        HALF_OPEN,
+    };
+
+    struct reconnect_stats_t
+    {
+        eState state;
+        uint32_t attempts;
+        uint32_t failures;
+        uint32_t successes;
+        uint32_t opened;
+        uint32_t consecutiveFailures;
+        MilliSeconds lastDelay;
+    };
+
+    ReconnectPolicy(const reconnect_config_t &config = {}) : m_config(config) {}
+
+    // delay before the next attempt
+    MilliSeconds OnFailure();
+    void OnAttempt();
+    void OnSuccess();
+    void Configure(const reconnect_config_t &config) { m_config = config; }
+
+    eState State() const { return m_stats.state; }
+    const reconnect_stats_t &Stats() const { return m_stats; }
+    static const char *StateName(eState state);
+
+private:
+    MilliSeconds jitter(MilliSeconds delay) const;
+
+    reconnect_config_t m_config;
+    reconnect_stats_t m_stats{};
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef ESPARRAG_TOKEN_BUCKET_H__
+#define ESPARRAG_TOKEN_BUCKET_H__
+
+#include "esparrag_time_units.h"
+#include <stdint.h>
+
+/*
+    Token bucket rate limiter.
+    Refills `rate` tokens per second up to `burst` tokens, kept in thousandths of a token
+    so low rates still refill smoothly. The caller supplies the time, no timers involved.
+*/
+class TokenBucket
+{
+    static constexpr uint32_t SCALE = 1000;
+
+public:
+    TokenBucket(uint32_t rate = 0, uint32_t burst = 0) : m_rate(rate),
+                                                         m_capacity(burst * SCALE),
+                                                         m_tokens(burst * SCALE) {}
+
+    bool TryConsume(MicroSeconds now, uint32_t tokens = 1)
+    {
+        refill(now);
+        if (m_tokens < tokens * SCALE)
+            return false;
+
+        m_tokens -= tokens * SCALE;
+        return true;
+    }
+
+    // fill up, e.g. when the bucket is reassigned to a new client
+    void Reset(MicroSeconds now)
+    {
+        m_tokens = m_capacity;
+        m_lastRefill = now;
+    }
+
+private:
+    void refill(MicroSeconds now)
+    {
+        if (now <= m_lastRefill)
+            return;
+
+        // rate tokens per second == rate * SCALE per 1000000 us
+        uint64_t added = (now - m_lastRefill).value() * m_rate * SCALE / 1000000;
+        if (added == 0)
+            return;
+
+        m_tokens = added >= m_capacity - m_tokens ? m_capacity : m_tokens + added;
+        m_lastRefill = now;
+    }
+
+    uint32_t m_rate;
+    uint32_t m_capacity;
+    uint32_t m_tokens;
+    MicroSeconds m_lastRefill{};
+};
+
+#endif
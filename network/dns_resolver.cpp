@@ -1,37 +1,297 @@
 #include "dns_resolver.h"
 #include "lwip/dns.h"
+#include "lwip/tcpip.h"
 #include "lwip/sockets.h"
 #include "esparrag_log.h"
+#include "lock.h"
+#include "esp_timer.h"
 #include <netdb.h>
 
-eResult DnsResolver::operator()(const char *uri, char *resultIP)
+eResult DnsResolver::operator()(const char *host, char *resultIP)
+{
+    ip4_addr_t address;
+    eResult res = (*this)(host, address);
+    if (res == eResult::SUCCESS)
+        ip4addr_ntoa_r(&address, resultIP, IP_STR_SIZE);
+
+    return res;
+}
+
+eResult DnsResolver::operator()(const char *host, ip4_addr_t &result)
+{
+    if (!host || strlen(host) == 0 || strlen(host) > HOST_MAX_LEN)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    // a literal address needs no lookup
+    if (ip4addr_aton(host, &result))
+        return eResult::SUCCESS;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool waited = false;
+    entry_t *entry = nullptr;
+    for (;;)
+    {
+        entry = find(host);
+        if (!entry || entry->state != RESOLVING)
+            break;
+
+        if (!waited)
+            m_stats.coalesced++;
+        waited = true;
+        m_resolved.wait(lock);
+    }
+
+    eResult res = eResult::SUCCESS;
+    if (cached(host, result, res))
+        return res;
+
+    m_stats.misses++;
+    entry = reserve(host, entry);
+    lock.unlock();
+
+    ip4_addr_t address{};
+    res = resolve(host, address);
+    if (entry)
+    {
+        lock.lock();
+        store(entry, res, address);
+        lock.unlock();
+        m_resolved.notify_all();
+    }
+
+    result = address;
+    return res;
+}
+
+void DnsResolver::Invalidate(const char *host)
+{
+    Lock lock(m_mutex);
+    entry_t *entry = find(host);
+    // a lookup in progress fills it again anyway
+    if (entry && entry->state != RESOLVING)
+        entry->state = EMPTY;
+}
+
+void DnsResolver::Clear()
+{
+    Lock lock(m_mutex);
+    for (entry_t &entry : m_entries)
+    {
+        if (entry.state != RESOLVING)
+            entry.state = EMPTY;
+    }
+}
+
+DnsResolver::dns_stats_t DnsResolver::Stats()
+{
+    Lock lock(m_mutex);
+    return m_stats;
+}
+
+DnsResolver::entry_t *DnsResolver::find(const char *host)
+{
+    for (entry_t &entry : m_entries)
+    {
+        if (entry.state != EMPTY && entry.host == host)
+            return &entry;
+    }
+
+    return nullptr;
+}
+
+bool DnsResolver::cached(const char *host, ip4_addr_t &result, eResult &res)
+{
+    entry_t *entry = find(host);
+    if (!entry || entry->state == RESOLVING || entry->expiresUs <= esp_timer_get_time())
+        return false;
+
+    entry->lastUsed = ++m_useCounter;
+    if (entry->state == FAILED)
+    {
+        m_stats.negativeHits++;
+        res = eResult::ERROR_NOT_FOUND;
+        return true;
+    }
+
+    m_stats.hits++;
+    result = entry->address;
+    res = eResult::SUCCESS;
+    return true;
+}
+
+// marks an entry for host as being resolved, nullptr when every entry is (the lookup isn't cached then)
+DnsResolver::entry_t *DnsResolver::reserve(const char *host, entry_t *entry)
+{
+    if (!entry)
+        entry = victim();
+    if (!entry)
+        return nullptr;
+
+    entry->host = host;
+    entry->state = RESOLVING;
+    entry->lastUsed = ++m_useCounter;
+    return entry;
+}
+
+void DnsResolver::store(entry_t *entry, eResult res, const ip4_addr_t &address)
+{
+    Seconds ttl = res == eResult::SUCCESS ? m_config.ttl : m_config.negativeTtl;
+    entry->address = address;
+    entry->state = res == eResult::SUCCESS ? RESOLVED : FAILED;
+    entry->expiresUs = esp_timer_get_time() + static_cast<int64_t>(ttl.value()) * 1000000;
+    if (res != eResult::SUCCESS)
+        m_stats.failures++;
+}
+
+// an empty entry, else the least recently used one that isn't being resolved
+DnsResolver::entry_t *DnsResolver::victim()
+{
+    entry_t *oldest = nullptr;
+    for (entry_t &entry : m_entries)
+    {
+        if (entry.state == EMPTY)
+            return &entry;
+
+        if (entry.state != RESOLVING && (!oldest || entry.lastUsed < oldest->lastUsed))
+            oldest = &entry;
+    }
+
+    return oldest;
+}
+
+eResult DnsResolver::resolve(const char *host, ip4_addr_t &result)
 {
-    ip_addr_t target_addr;
-    memset(&target_addr, 0, sizeof(target_addr));
     struct addrinfo hint;
     memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_INET;
     struct addrinfo *res = NULL;
-    int getaddrErr = getaddrinfo(uri, NULL, &hint, &res);
+    int getaddrErr = getaddrinfo(host, NULL, &hint, &res);
     if (getaddrErr != 0 || res == NULL)
     {
-        ESPARRAG_LOG_ERROR("DNS lookup failed err=%d res=%p", getaddrErr, res);
+        ESPARRAG_LOG_ERROR("DNS lookup of %s failed err=%d", host, getaddrErr);
         return eResult::ERROR_NOT_FOUND;
     }
-    else
-    {
-        ESPARRAG_LOG_INFO("DNS lookup success");
-    }
 
     if (res->ai_family != AF_INET)
     {
         ESPARRAG_LOG_ERROR("Dns lookup, address aint ipv4");
+        freeaddrinfo(res);
         return eResult::ERROR_NOT_FOUND;
     }
 
     struct in_addr addr4 = ((struct sockaddr_in *)(res->ai_addr))->sin_addr;
-    inet_addr_to_ip4addr(ip_2_ip4(&target_addr), &addr4);
+    inet_addr_to_ip4addr(&result, &addr4);
     freeaddrinfo(res);
 
-    strcpy(resultIP, inet_ntoa(target_addr.u_addr.ip4));
+    ESPARRAG_LOG_INFO("DNS lookup of %s success", host);
     return eResult::SUCCESS;
 }
+
+//================================ ASYNC ========================================================
+
+eResult DnsResolver::resolveAsync(const char *host, void *task, uint32_t token, dispatch_fn dispatch)
+{
+    if (!host || strlen(host) == 0 || strlen(host) > HOST_MAX_LEN)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    EVENT_DNS_RESOLVED event{.token = token, .found = false, .address = {}};
+    async_t *request = nullptr;
+    if (ip4addr_aton(host, &event.address))
+    {
+        event.found = true;
+    }
+    else
+    {
+        Lock lock(m_mutex);
+        eResult res = eResult::SUCCESS;
+        if (cached(host, event.address, res))
+        {
+            event.found = res == eResult::SUCCESS;
+        }
+        else
+        {
+            for (async_t &async : m_async)
+            {
+                if (!async.inUse)
+                {
+                    request = &async;
+                    break;
+                }
+            }
+
+            if (!request)
+            {
+                ESPARRAG_LOG_WARNING("%d dns lookups running, %s not resolved", ASYNC_MAX_NUM, host);
+                return eResult::ERROR_MEMORY;
+            }
+
+            m_stats.misses++;
+            entry_t *entry = find(host);
+            entry_t *owned = nullptr;
+            // a lookup already fills the entry, this one only answers its caller
+            if (entry && entry->state == RESOLVING)
+                m_stats.coalesced++;
+            else
+                owned = reserve(host, entry);
+
+            *request = async_t{.resolver = this,
+                               .entry = owned,
+                               .host = host,
+                               .task = task,
+                               .dispatch = dispatch,
+                               .token = token,
+                               .inUse = true};
+        }
+    }
+
+    if (!request)
+        return dispatch(task, event) ? eResult::SUCCESS : eResult::ERROR_MEMORY;
+
+    if (tcpip_callback(startLookup, request) != ERR_OK)
+        complete(*request, nullptr);
+
+    return eResult::SUCCESS;
+}
+
+// runs on the lwip task
+void DnsResolver::startLookup(void *arg)
+{
+    async_t *request = static_cast<async_t *>(arg);
+    ip_addr_t address;
+#if LWIP_IPV6
+    err_t err = dns_gethostbyname_addrtype(request->host.c_str(), &address, lookupDone, request, LWIP_DNS_ADDRTYPE_IPV4);
+#else
+    err_t err = dns_gethostbyname(request->host.c_str(), &address, lookupDone, request);
+#endif
+    // lookupDone is only called for a lookup that went to the network
+    if (err != ERR_INPROGRESS)
+        request->resolver->complete(*request, err == ERR_OK ? &address : nullptr);
+}
+
+void DnsResolver::lookupDone(const char *name, const ip_addr_t *address, void *arg)
+{
+    async_t *request = static_cast<async_t *>(arg);
+    request->resolver->complete(*request, address);
+}
+
+void DnsResolver::complete(async_t &request, const ip_addr_t *address)
+{
+    EVENT_DNS_RESOLVED event{.token = request.token, .found = address && IP_IS_V4(address), .address = {}};
+    if (event.found)
+        ip4_addr_copy(event.address, *ip_2_ip4(address));
+    else
+        ESPARRAG_LOG_ERROR("DNS lookup of %s failed", request.host.c_str());
+
+    void *task = request.task;
+    dispatch_fn dispatch = request.dispatch;
+    {
+        Lock lock(m_mutex);
+        if (request.entry)
+            store(request.entry, event.found ? eResult::SUCCESS : eResult::ERROR_NOT_FOUND, event.address);
+        request.inUse = false;
+    }
+    m_resolved.notify_all();
+
+    if (!dispatch(task, event))
+        ESPARRAG_LOG_WARNING("dns result %d not dispatched, task queue full", event.token);
+}
@@ -2,14 +2,140 @@
 #define DNS_RESOLVER_H__
 
 #include "esparrag_common.h"
+#include "esparrag_time_units.h"
+#include "lwip/ip_addr.h"
+#include "etl/array.h"
+#include "etl/string.h"
+#include <condition_variable>
+#include <mutex>
 
+// posted into the FsmTask that called ResolveAsync, add it to the task's Events variant
+struct EVENT_DNS_RESOLVED
+{
+    static constexpr const char *NAME = "EVENT_DNS_RESOLVED";
+    // whatever the caller passed, to tell its lookups apart
+    uint32_t token;
+    bool found;
+    ip4_addr_t address;
+};
+
+/*
+    Blocking ipv4 lookups behind a small LRU cache.
+    Failures are cached too, for a shorter time, so an unreachable host doesn't cost a lookup per retry.
+    Tasks asking for a name that is being resolved wait for that lookup instead of starting their own.
+    getaddrinfo doesn't report record ttls, entries live for config.ttl. lwip's own table honors the
+    record ttl, so keep config.ttl short for hosts that move.
+    Share one resolver, e.g. between the mqtt broker names (MqttClient::SetResolver) and the ota host lookups.
+    ResolveAsync doesn't block, the result is dispatched into the caller's FsmTask as EVENT_DNS_RESOLVED.
+
+    DnsResolver dns;
+    ip4_addr_t broker;
+    if (dns("broker.local", broker) == eResult::SUCCESS)
+        ...
+    dns.ResolveAsync("ota.example.com", *this, OTA_HOST_TOKEN); // from an FsmTask
+*/
 class DnsResolver
 {
 public:
-    eResult operator()(const char *uri, char *resultIP);
-    //eResult operator()(const char *address, in_addr &res);
+    static constexpr int CACHE_SIZE = 8;
+    static constexpr int HOST_MAX_LEN = 63;
+    // "255.255.255.255"
+    static constexpr int IP_STR_SIZE = IP4ADDR_STRLEN_MAX;
+    static constexpr int ASYNC_MAX_NUM = 4;
+
+    struct dns_config_t
+    {
+        Seconds ttl = 60;
+        Seconds negativeTtl = 10;
+    };
+
+    struct dns_stats_t
+    {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t negativeHits;
+        uint32_t coalesced;
+        uint32_t failures;
+    };
+
+    // a nested struct's member initializers can't be used in a default argument of its class
+    DnsResolver() : DnsResolver(dns_config_t{}) {}
+    DnsResolver(const dns_config_t &config) : m_config(config) {}
+
+    // resultIP holds at least IP_STR_SIZE chars
+    eResult operator()(const char *host, char *resultIP);
+    eResult operator()(const char *host, ip4_addr_t &result);
+
+    /*  returns at once, task gets EVENT_DNS_RESOLVED from the lwip task when the lookup ends
+        (from the calling task on a cache hit). ERROR_MEMORY when ASYNC_MAX_NUM lookups are running */
+    template <class Task>
+    eResult ResolveAsync(const char *host, Task &task, uint32_t token = 0)
+    {
+        return resolveAsync(host, &task, token, [](void *task, const EVENT_DNS_RESOLVED &event)
+                            { return static_cast<Task *>(task)->Dispatch(EVENT_DNS_RESOLVED(event)); });
+    }
+
+    // forget a host, e.g. when connecting to its address failed
+    void Invalidate(const char *host);
+    void Clear();
+    dns_stats_t Stats();
+
+private:
+    enum eState : uint8_t
+    {
+        EMPTY,
+        RESOLVING,
+        RESOLVED,
+        FAILED,
+    };
+
+    struct entry_t
+    {
+        etl::string<HOST_MAX_LEN> host;
+        ip4_addr_t address;
+        int64_t expiresUs;
+        uint32_t lastUsed;
+        eState state;
+    };
+
+    using dispatch_fn = bool (*)(void *task, const EVENT_DNS_RESOLVED &event);
+
+    struct async_t
+    {
+        DnsResolver *resolver;
+        // the cache entry this lookup fills, nullptr when another lookup of the name fills it
+        entry_t *entry;
+        etl::string<HOST_MAX_LEN> host;
+        void *task;
+        dispatch_fn dispatch;
+        uint32_t token;
+        bool inUse;
+    };
+
+    dns_config_t m_config;
+    etl::array<entry_t, CACHE_SIZE> m_entries{};
+    uint32_t m_useCounter = 0;
+    dns_stats_t m_stats{};
+    std::mutex m_mutex;
+    // signaled whenever a lookup finishes
+    std::condition_variable m_resolved;
+    etl::array<async_t, ASYNC_MAX_NUM> m_async{};
+
+    entry_t *find(const char *host);
+    entry_t *victim();
+    // under the lock, false when the host isn't cached. fills result on a positive hit
+    bool cached(const char *host, ip4_addr_t &result, eResult &res);
+    entry_t *reserve(const char *host, entry_t *entry);
+    void store(entry_t *entry, eResult res, const ip4_addr_t &address);
+    static eResult resolve(const char *host, ip4_addr_t &result);
+
+    eResult resolveAsync(const char *host, void *task, uint32_t token, dispatch_fn dispatch);
+    void complete(async_t &request, const ip_addr_t *address);
+    static void startLookup(void *arg);
+    static void lookupDone(const char *name, const ip_addr_t *address, void *arg);
 
-    //TODO add cache!
+    DnsResolver(const DnsResolver &) = delete;
+    DnsResolver &operator=(const DnsResolver &) = delete;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,600 @@
+#include "esparrag_espnow.h"
+#include "esparrag_log.h"
+#include "esparrag_cbor.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include <cstring>
+
+using namespace EspNowFSM;
+
+EspNow *EspNow::s_instance = nullptr;
+
+static void writeLe16(uint8_t *out, uint16_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static uint16_t readLe16(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+//===============================CALLBACKS =======================================================
+
+// runs on the wifi task
+void EspNow::sendCB(const uint8_t *mac, esp_now_send_status_t status)
+{
+    if (!s_instance->Dispatch(EVENT_SENT{.success = status == ESP_NOW_SEND_SUCCESS}))
+        ESPARRAG_LOG_ERROR("espnow queue full, send status lost");
+}
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+void EspNow::receiveCB(const esp_now_recv_info_t *info, const uint8_t *data, int len)
+{
+    s_instance->receive(info->src_addr, data, len);
+}
+#else
+void EspNow::receiveCB(const uint8_t *mac, const uint8_t *data, int len)
+{
+    s_instance->receive(mac, data, len);
+}
+#endif
+
+// runs on the wifi task, copies the frame into a free slot for the espnow task
+void EspNow::receive(const uint8_t *mac, const uint8_t *data, int len)
+{
+    if (len < HEADER_SIZE || len > FRAME_MAX_SIZE || data[0] != VERSION)
+        return;
+
+    uint8_t slot;
+    if (xQueueReceive(m_inboundFree, &slot, 0) != pdTRUE)
+    {
+        m_stats.dropped++;
+        return;
+    }
+
+    inbound_t &inbound = m_inbound[slot];
+    memcpy(inbound.mac, mac, MAC_LEN);
+    memcpy(inbound.data, data, len);
+    inbound.len = len;
+    if (!Dispatch(EVENT_RECEIVED{.slot = slot}))
+    {
+        xQueueSend(m_inboundFree, &slot, 0);
+        m_stats.dropped++;
+    }
+}
+
+void EspNow::sweepTimerCB(TimerHandle_t timer)
+{
+    EspNow *espnow = reinterpret_cast<EspNow *>(pvTimerGetTimerID(timer));
+    espnow->Dispatch(EVENT_SWEEP{});
+}
+
+//===============================================================================================
+//===============================PUBLIC METHODS ==================================================
+//===============================================================================================
+
+EspNow::EspNow() : FsmTask(ESPNOW_TASK_STACK_SIZE, ESPNOW_TASK_PRIORITY, ESPNOW_TASK_NAME, ESPNOW_TASK_QUEUE_LENGTH) {}
+
+eResult EspNow::On(Router &router)
+{
+    if (s_instance == this || m_routes.Size() > 0)
+        return eResult::ERROR_INVALID_STATE;
+
+    m_router = &router;
+    return eResult::SUCCESS;
+}
+
+eResult EspNow::Init(const espnow_config_t &config)
+{
+    ESPARRAG_ASSERT(config.maxAttempts > 0);
+    if (s_instance)
+        return eResult::ERROR_INVALID_STATE;
+
+    m_config = config;
+    // a rebooted peer starting from the seq we saw last would lose its first frame
+    m_nextSeq = esp_random();
+
+    wifi_mode_t mode = WIFI_MODE_NULL;
+    if (esp_wifi_get_mode(&mode) != ESP_OK || mode == WIFI_MODE_NULL)
+    {
+        ESPARRAG_LOG_ERROR("espnow needs wifi started");
+        return eResult::ERROR_WIFI;
+    }
+    m_interface = mode == WIFI_MODE_AP ? WIFI_IF_AP : WIFI_IF_STA;
+    esp_wifi_get_mac(m_interface, m_mac);
+
+    m_inboundFree = xQueueCreate(INBOUND_SLOTS_NUM, sizeof(uint8_t));
+    m_sweepTimer = xTimerCreate("espnow_sweep", pdMS_TO_TICKS(SWEEP_PERIOD_MS), pdTRUE, this, sweepTimerCB);
+    ESPARRAG_ASSERT(m_inboundFree && m_sweepTimer);
+    for (uint8_t i = 0; i < INBOUND_SLOTS_NUM; i++)
+        xQueueSend(m_inboundFree, &i, 0);
+
+    esp_err_t err = esp_now_init();
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("espnow init failed. err %d", err);
+        return eResult::ERROR_WIFI;
+    }
+
+    if (config.pmk && esp_now_set_pmk(reinterpret_cast<const uint8_t *>(config.pmk)) != ESP_OK)
+        ESPARRAG_LOG_WARNING("espnow pmk not set");
+
+    s_instance = this;
+    esp_now_register_send_cb(sendCB);
+    esp_now_register_recv_cb(receiveCB);
+
+    // broadcast needs a peer entry of its own, it is never acked
+    esp_now_peer_info_t broadcast{};
+    memcpy(broadcast.peer_addr, BROADCAST, MAC_LEN);
+    broadcast.channel = m_config.channel;
+    broadcast.ifidx = m_interface;
+    err = esp_now_add_peer(&broadcast);
+    if (err != ESP_OK)
+        ESPARRAG_LOG_WARNING("espnow broadcast peer not added. err %d", err);
+
+    Start(STATE_IDLE{});
+    return eResult::SUCCESS;
+}
+
+eResult EspNow::AddPeer(const uint8_t *mac, const char *lmk)
+{
+    if (!mac || memcmp(mac, BROADCAST, MAC_LEN) == 0)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    if (HasPeer(mac))
+        return eResult::SUCCESS;
+
+    esp_now_peer_info_t info{};
+    memcpy(info.peer_addr, mac, MAC_LEN);
+    info.channel = m_config.channel;
+    info.ifidx = m_interface;
+    if (lmk)
+    {
+        memcpy(info.lmk, lmk, ESP_NOW_KEY_LEN);
+        info.encrypt = true;
+    }
+
+    peer_t peer{.mac = {}, .lastSeq = 0, .hasSeq = false};
+    memcpy(peer.mac, mac, MAC_LEN);
+    bool added = false;
+    portENTER_CRITICAL(&m_peersLock);
+    if (!m_peers.full())
+    {
+        m_peers.push_back(peer);
+        added = true;
+    }
+    portEXIT_CRITICAL(&m_peersLock);
+
+    if (!added)
+        return eResult::ERROR_CONFIG_LIMITS;
+
+    esp_err_t err = esp_now_add_peer(&info);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("espnow add peer failed. err %d", err);
+        RemovePeer(mac);
+        return eResult::ERROR_WIFI;
+    }
+
+    return eResult::SUCCESS;
+}
+
+eResult EspNow::RemovePeer(const uint8_t *mac)
+{
+    bool removed = false;
+    portENTER_CRITICAL(&m_peersLock);
+    for (size_t i = 0; i < m_peers.size(); i++)
+    {
+        if (memcmp(m_peers[i].mac, mac, MAC_LEN) == 0)
+        {
+            m_peers.erase(m_peers.begin() + i);
+            removed = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&m_peersLock);
+
+    if (!removed)
+        return eResult::ERROR_NOT_FOUND;
+
+    esp_now_del_peer(mac);
+    return eResult::SUCCESS;
+}
+
+bool EspNow::HasPeer(const uint8_t *mac) const
+{
+    bool found = false;
+    portENTER_CRITICAL(&m_peersLock);
+    for (const peer_t &peer : m_peers)
+    {
+        if (memcmp(peer.mac, mac, MAC_LEN) == 0)
+        {
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&m_peersLock);
+
+    return found;
+}
+
+eResult EspNow::Send(const uint8_t *mac, const void *data, size_t len)
+{
+    if (!mac || !data || len == 0 || len > PAYLOAD_MAX_SIZE)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    return push(mac, FRAME_DATA, static_cast<const uint8_t *>(data), len);
+}
+
+eResult EspNow::Call(const uint8_t *mac, const char *uri, eMethod method, const cJSON *body, espnow_reply_callback callback)
+{
+    size_t uriLen = uri ? strlen(uri) : 0;
+    if (!mac || uriLen == 0 || uriLen > Router::URI_MAX_LEN || !callback.is_valid())
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    uint8_t payload[PAYLOAD_MAX_SIZE];
+    payload[0] = method.get_value();
+    payload[1] = uriLen;
+    memcpy(payload + 2, uri, uriLen);
+    size_t len = 2 + uriLen;
+
+    if (body)
+    {
+        CborWriter writer(payload + len, sizeof(payload) - len);
+        if (!writer.Write(body))
+        {
+            ESPARRAG_LOG_WARNING("espnow call %s body doesn't fit a frame", uri);
+            return eResult::ERROR_INVALID_PARAMETER;
+        }
+        len += writer.Size();
+    }
+
+    return push(mac, FRAME_REQUEST, payload, len, callback);
+}
+
+eResult EspNow::SendMesh(const void *data, size_t len)
+{
+    if (!data || len == 0 || len > PAYLOAD_MAX_SIZE)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    return push(BROADCAST, FRAME_MESH, static_cast<const uint8_t *>(data), len);
+}
+
+//===============================================================================================
+//================================ STATE MACHINE ================================================
+//===============================================================================================
+
+using return_state_t = EspNow::return_state_t;
+
+// STATE_IDLE
+
+return_state_t EspNow::on_event(STATE_IDLE &state, EVENT_SEND &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    m_sendPending = false;
+    return sendNext() ? return_state_t{STATE_SENDING{}} : std::nullopt;
+}
+
+return_state_t EspNow::on_event(STATE_IDLE &state, EVENT_RECEIVED &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // a request queues its reply
+    handleReceived(event.slot);
+    return sendNext() ? return_state_t{STATE_SENDING{}} : std::nullopt;
+}
+
+return_state_t EspNow::on_event(STATE_IDLE &state, EVENT_SWEEP &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    expire();
+    return std::nullopt;
+}
+
+// STATE_SENDING
+
+return_state_t EspNow::on_event(STATE_SENDING &state, EVENT_SEND &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // picked up after the frame on air completes
+    m_sendPending = false;
+    return std::nullopt;
+}
+
+return_state_t EspNow::on_event(STATE_SENDING &state, EVENT_SENT &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    outbound_t &frame = head();
+    if (!event.success && frame.attempts < m_config.maxAttempts)
+    {
+        frame.attempts++;
+        m_stats.retries++;
+        if (esp_now_send(frame.mac, frame.data, frame.len) == ESP_OK)
+            return std::nullopt;
+    }
+
+    complete(event.success);
+    return sendNext() ? std::nullopt : return_state_t{STATE_IDLE{}};
+}
+
+return_state_t EspNow::on_event(STATE_SENDING &state, EVENT_RECEIVED &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    handleReceived(event.slot);
+    return std::nullopt;
+}
+
+return_state_t EspNow::on_event(STATE_SENDING &state, EVENT_SWEEP &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    expire();
+    return std::nullopt;
+}
+
+//===============================================================================================
+//================================ PRIVATE METHODS ==============================================
+//===============================================================================================
+
+eResult EspNow::push(const uint8_t *mac, eFrame type, const uint8_t *payload, size_t len, espnow_reply_callback callback)
+{
+    bool pushed = false;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&m_outboundLock);
+    if (m_outboundCount < SEND_QUEUE_SIZE)
+    {
+        // the slot is free, the espnow task only reads slots between head and count
+        outbound_t &frame = m_outbound[(m_outboundHead + m_outboundCount) % SEND_QUEUE_SIZE];
+        memcpy(frame.mac, mac, MAC_LEN);
+        frame.data[0] = VERSION;
+        frame.data[1] = type;
+        writeLe16(frame.data + 2, m_nextSeq++);
+        memcpy(frame.data + HEADER_SIZE, payload, len);
+        frame.len = HEADER_SIZE + len;
+        frame.attempts = 1;
+        frame.queuedUs = now;
+        frame.callback = callback;
+        m_outboundCount++;
+        pushed = true;
+    }
+    portEXIT_CRITICAL(&m_outboundLock);
+
+    if (!pushed)
+    {
+        ESPARRAG_LOG_WARNING("espnow send queue full");
+        return eResult::ERROR_MEMORY;
+    }
+
+    if (!m_sendPending.exchange(true) && !Dispatch(EVENT_SEND{}))
+        m_sendPending = false;
+
+    return eResult::SUCCESS;
+}
+
+void EspNow::pop()
+{
+    portENTER_CRITICAL(&m_outboundLock);
+    m_outboundHead = (m_outboundHead + 1) % SEND_QUEUE_SIZE;
+    m_outboundCount--;
+    portEXIT_CRITICAL(&m_outboundLock);
+}
+
+// puts the head frame on air, frames esp-now refuses outright are completed as failed
+bool EspNow::sendNext()
+{
+    for (;;)
+    {
+        portENTER_CRITICAL(&m_outboundLock);
+        size_t count = m_outboundCount;
+        portEXIT_CRITICAL(&m_outboundLock);
+        if (count == 0)
+            return false;
+
+        outbound_t &frame = head();
+        esp_err_t err = esp_now_send(frame.mac, frame.data, frame.len);
+        if (err == ESP_OK)
+            return true;
+
+        ESPARRAG_LOG_WARNING("espnow send failed. err %d", err);
+        complete(false);
+    }
+}
+
+void EspNow::complete(bool delivered)
+{
+    outbound_t &frame = head();
+    if (delivered)
+        m_stats.sent++;
+    else
+        m_stats.failed++;
+
+    if (frame.callback.is_valid())
+    {
+        if (!delivered || m_pending.full())
+        {
+            answer(frame.mac, frame.callback, Response::CODE::HTTP_CODE_SERVICE_UNAVAILABLE);
+        }
+        else
+        {
+            pending_t pending{.mac = {},
+                              .seq = readLe16(frame.data + 2),
+                              .queuedUs = frame.queuedUs,
+                              .deadlineUs = esp_timer_get_time() + static_cast<int64_t>(m_config.replyTimeout.value()) * 1000,
+                              .callback = frame.callback};
+            memcpy(pending.mac, frame.mac, MAC_LEN);
+            m_pending.push_back(pending);
+            if (xTimerIsTimerActive(m_sweepTimer) == pdFALSE)
+                xTimerStart(m_sweepTimer, 0);
+        }
+    }
+
+    pop();
+}
+
+void EspNow::handleReceived(uint8_t slot)
+{
+    inbound_t &inbound = m_inbound[slot];
+    uint16_t seq = readLe16(inbound.data + 2);
+    const uint8_t *payload = inbound.data + HEADER_SIZE;
+    size_t len = inbound.len - HEADER_SIZE;
+
+    if (isDuplicate(inbound.mac, seq))
+    {
+        m_stats.duplicates++;
+    }
+    else
+    {
+        m_stats.received++;
+        switch (inbound.data[1])
+        {
+        case FRAME_DATA:
+            if (m_onData.is_valid())
+                m_onData(inbound.mac, payload, len);
+            break;
+        case FRAME_REQUEST:
+            handleRequest(inbound.mac, seq, payload, len);
+            break;
+        case FRAME_REPLY:
+            handleReply(inbound.mac, seq, payload, len);
+            break;
+        case FRAME_MESH:
+            if (m_onMesh.is_valid())
+                m_onMesh(inbound.mac, payload, len);
+            break;
+        default:
+            ESPARRAG_LOG_WARNING("espnow unknown frame type %d", inbound.data[1]);
+            break;
+        }
+    }
+
+    xQueueSend(m_inboundFree, &slot, 0);
+}
+
+void EspNow::handleRequest(const uint8_t *mac, uint16_t seq, const uint8_t *payload, size_t len)
+{
+    Response::CODE code = Response::CODE::HTTP_CODE_BAD_REQUEST;
+    Response response;
+    if (len >= 2 && payload[1] > 0 && len >= 2u + payload[1])
+    {
+        size_t uriLen = payload[1];
+        char uri[Router::URI_MAX_LEN + 1];
+        if (uriLen > Router::URI_MAX_LEN)
+        {
+            code = Response::CODE::HTTP_CODE_URI_TOO_LONG;
+        }
+        else
+        {
+            memcpy(uri, payload + 2, uriLen);
+            uri[uriLen] = '\0';
+
+            cJSON *body = nullptr;
+            size_t bodyLen = len - 2 - uriLen;
+            if (bodyLen > 0)
+                body = CborReader(payload + 2 + uriLen, bodyLen).ToJson();
+
+            if (bodyLen == 0 || body)
+            {
+                Request request(body, uri, eMethod(payload[0]));
+                m_router->Dispatch(request, response);
+                code = response.m_code;
+            }
+        }
+    }
+
+    uint8_t reply[PAYLOAD_MAX_SIZE];
+    writeLe16(reply, seq);
+    writeLe16(reply + 2, code.get_value());
+    size_t replyLen = 4;
+
+    CborWriter writer(reply + replyLen, sizeof(reply) - replyLen);
+    bool encoded = response.m_string ? writer.String(response.m_string) : writer.Write(response.m_json);
+    if (encoded)
+        replyLen += writer.Size();
+    else
+        ESPARRAG_LOG_WARNING("espnow reply body doesn't fit a frame, sent without it");
+
+    push(mac, FRAME_REPLY, reply, replyLen);
+}
+
+void EspNow::handleReply(const uint8_t *mac, uint16_t, const uint8_t *payload, size_t len)
+{
+    if (len < 4)
+        return;
+
+    uint16_t requestSeq = readLe16(payload);
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        pending_t &pending = m_pending[i];
+        if (pending.seq != requestSeq || memcmp(pending.mac, mac, MAC_LEN) != 0)
+            continue;
+
+        espnow_reply_callback callback = pending.callback;
+        m_callLatency.Add(esp_timer_get_time() - pending.queuedUs);
+        m_pending.erase(m_pending.begin() + i);
+
+        Response response;
+        response.m_code = Response::CODE(readLe16(payload + 2));
+        if (len > 4)
+        {
+            cJSON *body = CborReader(payload + 4, len - 4).ToJson();
+            if (body)
+            {
+                cJSON_Delete(response.m_json);
+                response.m_json = body;
+            }
+        }
+
+        callback(mac, response);
+        return;
+    }
+
+    ESPARRAG_LOG_WARNING("espnow reply for an unknown or expired call");
+}
+
+// only the last seq of each peer is kept, that's what a retransmission after a lost ack repeats
+bool EspNow::isDuplicate(const uint8_t *mac, uint16_t seq)
+{
+    bool duplicate = false;
+    portENTER_CRITICAL(&m_peersLock);
+    for (peer_t &peer : m_peers)
+    {
+        if (memcmp(peer.mac, mac, MAC_LEN) == 0)
+        {
+            duplicate = peer.hasSeq && peer.lastSeq == seq;
+            peer.lastSeq = seq;
+            peer.hasSeq = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&m_peersLock);
+
+    return duplicate;
+}
+
+void EspNow::answer(const uint8_t *mac, espnow_reply_callback &callback, Response::CODE code)
+{
+    Response response;
+    response.m_code = code;
+    callback(mac, response);
+}
+
+void EspNow::expire()
+{
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < m_pending.size();)
+    {
+        if (m_pending[i].deadlineUs > now)
+        {
+            i++;
+            continue;
+        }
+
+        pending_t pending = m_pending[i];
+        m_pending.erase(m_pending.begin() + i);
+        m_stats.timeouts++;
+        answer(pending.mac, pending.callback, Response::CODE::HTTP_CODE_GATEWAY_TIMEOUT);
+    }
+
+    if (m_pending.empty())
+        xTimerStop(m_sweepTimer, 0);
+}
@@ -2,29 +2,267 @@
 #define ESPARRAG_ESPNOW_H__
 
 #include "esp_now.h"
+#include "esp_wifi.h"
+#include "esp_idf_version.h"
+#include "esparrag_common.h"
+#include "esparrag_router.h"
+#include "esparrag_time_units.h"
+#include "latency_histogram.h"
+#include "fsm_task.h"
+#include "etl/delegate.h"
+#include "etl/vector.h"
+#include "cJSON.h"
+#include "freertos/timers.h"
+#include <atomic>
 
+namespace EspNowFSM {
 
+struct STATE_IDLE{
+    static constexpr const char* NAME = "STATE_IDLE";
+};
+// a frame is on air, waiting for the send callback
+struct STATE_SENDING{
+    static constexpr const char* NAME = "STATE_SENDING";
+};
 
+using States = std::variant<STATE_IDLE,
+                            STATE_SENDING>;
 
+struct EVENT_SEND{
+    static constexpr const char* NAME = "EVENT_SEND";
+};
+struct EVENT_SENT{
+    static constexpr const char* NAME = "EVENT_SENT";
+    bool success;
+};
+struct EVENT_RECEIVED{
+    static constexpr const char* NAME = "EVENT_RECEIVED";
+    uint8_t slot;
+};
+struct EVENT_SWEEP{
+    static constexpr const char* NAME = "EVENT_SWEEP";
+};
 
+using Events = std::variant<EVENT_SEND,
+                            EVENT_SENT,
+                            EVENT_RECEIVED,
+                            EVENT_SWEEP>;
 
+} // namespace EspNowFSM
 
+/*
+    Device to device messaging over ESP-NOW, no access point or broker on the way.
+    Wifi must be started (any mode) before Init, peers share its channel.
 
+    Frames start with {version, type, seq(le16)}:
+        DATA     raw payload, passed to the OnData callback
+        REQUEST  method, uri length, uri, cbor body. dispatched into a Router like HttpServer's
+        REPLY    request seq(le16), code(le16), cbor body. matched to the pending Call
+        MESH     broadcast, passed to the OnMesh callback (EspNowMesh)
+    One frame is on air at a time, a frame the peer didn't ack is sent again up to maxAttempts.
+    Unicast frames retransmitted after a lost ack are dropped by seq on the receiving side.
+    tools/espnow_sim.py simulates this protocol over a shared radio medium on the host.
 
+    EspNow espnow;
+    espnow.On(router);
+    espnow.Init();
+    espnow.AddPeer(mac);
+    espnow.Call(mac, "/relay", eMethod::POST, body, EspNow::espnow_reply_callback::create<Device, &Device::onReply>(device));
+*/
+class EspNow : public FsmTask<EspNow, EspNowFSM::States, EspNowFSM::Events>
+{
+public:
+    using espnow_receive_callback = etl::delegate<void(const uint8_t *mac, const uint8_t *data, size_t len)>;
+    // called once with the reply, 503 when the request couldn't be delivered or 504 when no reply came in time
+    using espnow_reply_callback = etl::delegate<void(const uint8_t *mac, Response &)>;
 
+    static constexpr uint8_t VERSION = 1;
+    static constexpr int MAC_LEN = ESP_NOW_ETH_ALEN;
+    static constexpr int FRAME_MAX_SIZE = ESP_NOW_MAX_DATA_LEN;
+    static constexpr int HEADER_SIZE = 4;
+    static constexpr int PAYLOAD_MAX_SIZE = FRAME_MAX_SIZE - HEADER_SIZE;
+    static constexpr int PEERS_MAX_NUM = ESP_NOW_MAX_TOTAL_PEER_NUM - 1; // one is taken by broadcast
+    static constexpr int SEND_QUEUE_SIZE = 8;
+    static constexpr int INBOUND_SLOTS_NUM = 4;
+    static constexpr int PENDING_MAX_NUM = 4;
+    static constexpr int SWEEP_PERIOD_MS = 10;
+    // control traffic should not wait behind the network stack
+    static constexpr int ESPNOW_TASK_PRIORITY = 5;
+    static constexpr int ESPNOW_TASK_STACK_SIZE = 4096;
+    static constexpr const char *ESPNOW_TASK_NAME = "espnowTask@esparrag";
+    static constexpr int ESPNOW_TASK_QUEUE_LENGTH = 16;
+    static constexpr uint8_t BROADCAST[MAC_LEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
+    enum eFrame : uint8_t
+    {
+        FRAME_DATA = 1,
+        FRAME_REQUEST,
+        FRAME_REPLY,
+        FRAME_MESH,
+    };
 
+    struct espnow_config_t
+    {
+        // 0 uses the current wifi channel
+        uint8_t channel = 0;
+        // sends per frame, the radio already retries every send a few times
+        uint8_t maxAttempts = 3;
+        MilliSeconds replyTimeout = 100;
+        // 16 bytes, encrypts the local keys of peers added with one
+        const char *pmk = nullptr;
+    };
 
+    struct espnow_stats_t
+    {
+        uint32_t sent;
+        uint32_t failed;
+        uint32_t retries;
+        uint32_t received;
+        uint32_t duplicates;
+        uint32_t dropped;
+        uint32_t timeouts;
+    };
 
+    EspNow();
+    // before Init
+    eResult On(Router &router);
+    void OnData(espnow_receive_callback callback) { m_onData = callback; }
+    // the relay layer, see EspNowMesh
+    void OnMesh(espnow_receive_callback callback) { m_onMesh = callback; }
+    // a nested struct's member initializers can't be used in a default argument of its class
+    eResult Init() { return Init(espnow_config_t{}); }
+    eResult Init(const espnow_config_t &config);
 
+    // lmk is a 16 byte local key, nullptr for an unencrypted peer
+    eResult AddPeer(const uint8_t *mac, const char *lmk = nullptr);
+    eResult RemovePeer(const uint8_t *mac);
+    bool HasPeer(const uint8_t *mac) const;
 
+    // any task, copies data into the send queue. ERROR_MEMORY when the queue is full
+    eResult Send(const uint8_t *mac, const void *data, size_t len);
+    /*  any task, body (may be nullptr) is encoded as cbor and stays owned by the caller.
+        the callback runs on the espnow task */
+    eResult Call(const uint8_t *mac, const char *uri, eMethod method, const cJSON *body, espnow_reply_callback callback);
+    // any task, broadcasts a MESH frame
+    eResult SendMesh(const void *data, size_t len);
 
+    // of the wifi interface esp-now sends from, valid after Init
+    const uint8_t *Mac() const { return m_mac; }
 
+    const espnow_stats_t &Stats() const { return m_stats; }
+    // Call round trips, from queueing the request to handling its reply
+    const LatencyHistogram &CallLatency() const { return m_callLatency; }
 
+    using return_state_t = std::optional<EspNowFSM::States>;
 
+    return_state_t on_event(EspNowFSM::STATE_IDLE &, EspNowFSM::EVENT_SEND &);
+    return_state_t on_event(EspNowFSM::STATE_IDLE &, EspNowFSM::EVENT_RECEIVED &);
+    return_state_t on_event(EspNowFSM::STATE_IDLE &, EspNowFSM::EVENT_SWEEP &);
 
+    return_state_t on_event(EspNowFSM::STATE_SENDING &, EspNowFSM::EVENT_SEND &);
+    return_state_t on_event(EspNowFSM::STATE_SENDING &, EspNowFSM::EVENT_SENT &);
+    return_state_t on_event(EspNowFSM::STATE_SENDING &, EspNowFSM::EVENT_RECEIVED &);
+    return_state_t on_event(EspNowFSM::STATE_SENDING &, EspNowFSM::EVENT_SWEEP &);
 
+    template <typename State, typename Event>
+    auto on_event(State &state, Event &event) {
+        printf("unhandled event!: %s got %s\n", state.NAME, event.NAME);
+        return std::nullopt;
+    }
 
+    template <class State>
+    void on_entry(State &) {}
 
+private:
+    struct peer_t
+    {
+        uint8_t mac[MAC_LEN];
+        uint16_t lastSeq;
+        bool hasSeq;
+    };
 
-#endif
\ No newline at end of file
+    struct outbound_t
+    {
+        uint8_t mac[MAC_LEN];
+        uint8_t attempts;
+        uint8_t len;
+        uint8_t data[FRAME_MAX_SIZE];
+        int64_t queuedUs;
+        espnow_reply_callback callback;
+    };
+
+    struct inbound_t
+    {
+        uint8_t mac[MAC_LEN];
+        uint8_t len;
+        uint8_t data[FRAME_MAX_SIZE];
+    };
+
+    struct pending_t
+    {
+        uint8_t mac[MAC_LEN];
+        uint16_t seq;
+        int64_t queuedUs;
+        int64_t deadlineUs;
+        espnow_reply_callback callback;
+    };
+
+    espnow_config_t m_config;
+    wifi_interface_t m_interface = WIFI_IF_STA;
+    uint8_t m_mac[MAC_LEN]{};
+    Router m_routes;
+    Router *m_router = &m_routes;
+    espnow_receive_callback m_onData;
+    espnow_receive_callback m_onMesh;
+
+    etl::vector<peer_t, PEERS_MAX_NUM> m_peers;
+    mutable portMUX_TYPE m_peersLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // ring filled by any task, only the espnow task takes from its head
+    outbound_t m_outbound[SEND_QUEUE_SIZE]{};
+    size_t m_outboundHead = 0;
+    size_t m_outboundCount = 0;
+    uint16_t m_nextSeq = 0;
+    portMUX_TYPE m_outboundLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // one EVENT_SEND waits in the fsm queue at most
+    std::atomic<bool> m_sendPending{false};
+
+    inbound_t m_inbound[INBOUND_SLOTS_NUM]{};
+    QueueHandle_t m_inboundFree = nullptr;
+
+    // only touched by the espnow task
+    etl::vector<pending_t, PENDING_MAX_NUM> m_pending;
+    TimerHandle_t m_sweepTimer = nullptr;
+    espnow_stats_t m_stats{};
+    LatencyHistogram m_callLatency;
+
+    eResult push(const uint8_t *mac, eFrame type, const uint8_t *payload, size_t len, espnow_reply_callback callback = {});
+    outbound_t &head() { return m_outbound[m_outboundHead]; }
+    void pop();
+    bool sendNext();
+    void complete(bool delivered);
+    void handleReceived(uint8_t slot);
+    void handleRequest(const uint8_t *mac, uint16_t seq, const uint8_t *payload, size_t len);
+    void handleReply(const uint8_t *mac, uint16_t seq, const uint8_t *payload, size_t len);
+    bool isDuplicate(const uint8_t *mac, uint16_t seq);
+    void answer(const uint8_t *mac, espnow_reply_callback &callback, Response::CODE code);
+    void expire();
+
+    void receive(const uint8_t *mac, const uint8_t *data, int len);
+
+    // esp-now takes plain function callbacks, there is a single instance
+    static EspNow *s_instance;
+    static void sendCB(const uint8_t *mac, esp_now_send_status_t status);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    static void receiveCB(const esp_now_recv_info_t *info, const uint8_t *data, int len);
+#else
+    static void receiveCB(const uint8_t *mac, const uint8_t *data, int len);
+#endif
+    static void sweepTimerCB(TimerHandle_t timer);
+
+    EspNow(const EspNow &) = delete;
+    EspNow &operator=(const EspNow &) = delete;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include "esparrag_espnow_mesh.h"
+#include "esparrag_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include <cstring>
+
+static constexpr size_t ID_OFFSET = EspNow::MAC_LEN;
+static constexpr size_t TTL_OFFSET = ID_OFFSET + 2;
+static constexpr size_t HOPS_OFFSET = TTL_OFFSET + 1;
+
+eResult EspNowMesh::Init(const mesh_config_t &config)
+{
+    if (config.ttl == 0)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    m_config = config;
+    m_nextId = esp_random();
+    m_relayBucket = TokenBucket(config.relayRate, config.relayBurst);
+    m_relayBucket.Reset(esp_timer_get_time());
+    m_espnow.OnMesh(EspNow::espnow_receive_callback::create<EspNowMesh, &EspNowMesh::onFrame>(*this));
+    return eResult::SUCCESS;
+}
+
+eResult EspNowMesh::Publish(const void *data, size_t len, uint8_t ttl)
+{
+    if (!data || len == 0 || len > PAYLOAD_MAX_SIZE)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    portENTER_CRITICAL(&m_seenLock);
+    uint16_t id = m_nextId++;
+    portEXIT_CRITICAL(&m_seenLock);
+
+    uint8_t frame[EspNow::PAYLOAD_MAX_SIZE];
+    memcpy(frame, m_espnow.Mac(), EspNow::MAC_LEN);
+    frame[ID_OFFSET] = id;
+    frame[ID_OFFSET + 1] = id >> 8;
+    frame[TTL_OFFSET] = ttl ? ttl : m_config.ttl;
+    frame[HOPS_OFFSET] = 0;
+    memcpy(frame + HEADER_SIZE, data, len);
+
+    // our own message coming back from a neighbour is a duplicate
+    remember(m_espnow.Mac(), id);
+    eResult res = m_espnow.SendMesh(frame, HEADER_SIZE + len);
+    if (res == eResult::SUCCESS)
+        m_stats.published++;
+
+    return res;
+}
+
+bool EspNowMesh::remember(const uint8_t *origin, uint16_t id)
+{
+    bool known = false;
+    portENTER_CRITICAL(&m_seenLock);
+    for (size_t i = 0; i < m_seenNum; i++)
+    {
+        if (m_seen[i].id == id && memcmp(m_seen[i].origin, origin, EspNow::MAC_LEN) == 0)
+        {
+            known = true;
+            break;
+        }
+    }
+
+    if (!known)
+    {
+        seen_t &seen = m_seen[m_seenNext];
+        memcpy(seen.origin, origin, EspNow::MAC_LEN);
+        seen.id = id;
+        m_seenNext = (m_seenNext + 1) % SEEN_NUM;
+        if (m_seenNum < SEEN_NUM)
+            m_seenNum++;
+    }
+    portEXIT_CRITICAL(&m_seenLock);
+
+    return !known;
+}
+
+// runs on the espnow task
+void EspNowMesh::onFrame(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+    if (len <= HEADER_SIZE)
+        return;
+
+    const uint8_t *origin = data;
+    uint16_t id = data[ID_OFFSET] | (data[ID_OFFSET + 1] << 8);
+    uint8_t ttl = data[TTL_OFFSET];
+    uint8_t hops = data[HOPS_OFFSET];
+    if (memcmp(origin, m_espnow.Mac(), EspNow::MAC_LEN) == 0 || !remember(origin, id))
+    {
+        m_stats.duplicates++;
+        return;
+    }
+
+    m_stats.delivered++;
+    if (m_onMessage.is_valid())
+        m_onMessage(origin, data + HEADER_SIZE, len - HEADER_SIZE, hops);
+
+    if (!m_config.relay || ttl <= 1)
+        return;
+
+    if (!m_relayBucket.TryConsume(esp_timer_get_time()))
+    {
+        m_stats.limited++;
+        return;
+    }
+
+    uint8_t frame[EspNow::PAYLOAD_MAX_SIZE];
+    memcpy(frame, data, len);
+    frame[TTL_OFFSET] = ttl - 1;
+    frame[HOPS_OFFSET] = hops + 1;
+    if (m_espnow.SendMesh(frame, len) == eResult::SUCCESS)
+        m_stats.relayed++;
+    else
+        m_stats.dropped++;
+}
@@ -0,0 +1,94 @@
+#ifndef ESPARRAG_ESPNOW_MESH_H__
+#define ESPARRAG_ESPNOW_MESH_H__
+
+#include "esparrag_espnow.h"
+#include "token_bucket.h"
+#include "etl/delegate.h"
+
+/*
+    Multi-hop flooding of small control messages over EspNow broadcasts.
+    Every node delivers a message once and broadcasts it again while its ttl lasts,
+    so devices out of range of each other are reached through the ones in between.
+    Mesh header {origin mac, id(le16), ttl, hops} precedes the payload.
+    Messages are recognized by origin and id in a ring of the last SEEN_NUM,
+    rebroadcasts are paced by a token bucket so a burst can't take the whole channel.
+    tools/espnow_sim.py --mesh measures reach, latency and airtime of a flood.
+
+    EspNowMesh mesh(espnow);
+    mesh.OnMessage(EspNowMesh::mesh_receive_callback::create<Device, &Device::onMesh>(device));
+    mesh.Init();
+    mesh.Publish(data, len);
+*/
+class EspNowMesh
+{
+public:
+    // origin is the mac of the node that published, hops is 0 when it is a neighbour
+    using mesh_receive_callback = etl::delegate<void(const uint8_t *origin, const uint8_t *data, size_t len, uint8_t hops)>;
+
+    static constexpr int HEADER_SIZE = EspNow::MAC_LEN + 4;
+    static constexpr int PAYLOAD_MAX_SIZE = EspNow::PAYLOAD_MAX_SIZE - HEADER_SIZE;
+    static constexpr int SEEN_NUM = 32;
+
+    struct mesh_config_t
+    {
+        // hops a message travels, 1 reaches neighbours only
+        uint8_t ttl = 4;
+        // a leaf device can receive without relaying
+        bool relay = true;
+        // rebroadcasts per second and in a burst, own messages are not limited
+        uint32_t relayRate = 20;
+        uint32_t relayBurst = 8;
+    };
+
+    struct mesh_stats_t
+    {
+        uint32_t published;
+        uint32_t delivered;
+        uint32_t relayed;
+        uint32_t duplicates;
+        uint32_t limited;
+        uint32_t dropped;
+    };
+
+    EspNowMesh(EspNow &espnow) : m_espnow(espnow) {}
+
+    // before Init
+    void OnMessage(mesh_receive_callback callback) { m_onMessage = callback; }
+    // after EspNow::Init
+    eResult Init() { return Init(mesh_config_t{}); }
+    eResult Init(const mesh_config_t &config);
+
+    // any task, ttl 0 uses the configured one
+    eResult Publish(const void *data, size_t len, uint8_t ttl = 0);
+
+    const mesh_stats_t &Stats() const { return m_stats; }
+
+private:
+    EspNow &m_espnow;
+    mesh_config_t m_config;
+    mesh_receive_callback m_onMessage;
+    TokenBucket m_relayBucket;
+    mesh_stats_t m_stats{};
+    // seeded in Init, a rebooted node must not reuse the ids its neighbours still remember
+    uint16_t m_nextId = 0;
+
+    // origin and id themselves, so a new message is never taken for a seen one. oldest overwritten first
+    struct seen_t
+    {
+        uint8_t origin[EspNow::MAC_LEN];
+        uint16_t id;
+    };
+    seen_t m_seen[SEEN_NUM]{};
+    size_t m_seenNum = 0;
+    size_t m_seenNext = 0;
+    portMUX_TYPE m_seenLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // true if the message was new
+    bool remember(const uint8_t *origin, uint16_t id);
+    void onFrame(const uint8_t *mac, const uint8_t *data, size_t len);
+
+    EspNowMesh(const EspNowMesh &) = delete;
+    EspNowMesh &operator=(const EspNowMesh &) = delete;
+};
+
+#endif
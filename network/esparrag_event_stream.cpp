@@ -0,0 +1,226 @@
+#include "esparrag_event_stream.h"
+#include "esparrag_log.h"
+#include "lwip/sockets.h"
+#include <cstring>
+#include <cstdlib>
+
+EventStream *EventStream::s_logStream = nullptr;
+vprintf_like_t EventStream::s_originalVprintf = nullptr;
+
+static constexpr char STREAM_RESPONSE_HEADER[] = "HTTP/1.1 200 OK\r\n"
+                                                 "Content-Type: text/event-stream\r\n"
+                                                 "Cache-Control: no-cache\r\n"
+                                                 "Transfer-Encoding: chunked\r\n";
+
+EventStream::EventStream(const char *uri) : m_uri(uri)
+{
+    ESPARRAG_ASSERT(uri && uri[0] == '/');
+}
+
+void EventStream::Push(const char *event, const char *data)
+{
+    if (!event || !data)
+        return;
+
+    push(event, data);
+    requestFlush();
+}
+
+void EventStream::push(const char *event, const char *data)
+{
+    portENTER_CRITICAL(&m_spinlock);
+    event_t &slot = m_events[m_nextId % EVENTS_NUM];
+    slot.id = m_nextId++;
+    strlcpy(slot.name, event, sizeof(slot.name));
+    strlcpy(slot.data, data, sizeof(slot.data));
+    portEXIT_CRITICAL(&m_spinlock);
+}
+
+void EventStream::requestFlush()
+{
+    if (!m_server || m_clients.empty())
+        return;
+
+    // a single flush drains everything pushed until it runs
+    if (m_flushPending.exchange(true))
+        return;
+
+    if (httpd_queue_work(m_server, flushWork, this) != ESP_OK)
+        m_flushPending = false;
+}
+
+void EventStream::CaptureLogs()
+{
+    ESPARRAG_ASSERT(s_logStream == nullptr);
+    m_logFlushTimer = xTimerCreate("sse_log", pdMS_TO_TICKS(LOG_FLUSH_DELAY_MS), pdFALSE, this, logFlushTimerCB);
+    ESPARRAG_ASSERT(m_logFlushTimer);
+
+    s_logStream = this;
+    s_originalVprintf = esp_log_set_vprintf(logVprintf);
+}
+
+int EventStream::logVprintf(const char *format, va_list args)
+{
+    char line[EVENT_DATA_MAX_LEN + 1];
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(line, sizeof(line), format, copy);
+    va_end(copy);
+
+    /*  logs may come from any context, including the tcpip task which can't queue http server work.
+        the flush is deferred to the timer task, which also batches bursts of log lines */
+    if (len > 0)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        s_logStream->push("log", line);
+        if (xTimerIsTimerActive(s_logStream->m_logFlushTimer) == pdFALSE)
+            xTimerStart(s_logStream->m_logFlushTimer, 0);
+    }
+
+    return s_originalVprintf(format, args);
+}
+
+void EventStream::logFlushTimerCB(TimerHandle_t timer)
+{
+    EventStream *stream = reinterpret_cast<EventStream *>(pvTimerGetTimerID(timer));
+    stream->requestFlush();
+}
+
+// runs on the http server task
+void EventStream::flushWork(void *arg)
+{
+    EventStream *stream = reinterpret_cast<EventStream *>(arg);
+    stream->m_flushPending = false;
+    stream->flush();
+}
+
+void EventStream::flush()
+{
+    event_t event{};
+
+    for (size_t i = 0; i < m_clients.size();)
+    {
+        client_t &client = m_clients[i];
+        bool alive = true;
+
+        for (;;)
+        {
+            portENTER_CRITICAL(&m_spinlock);
+            uint32_t nextId = m_nextId;
+            uint32_t oldestId = nextId > EVENTS_NUM ? nextId - EVENTS_NUM : 1;
+            if (client.nextId < oldestId)
+                client.nextId = oldestId;
+            bool pending = client.nextId < nextId;
+            if (pending)
+                event = m_events[client.nextId % EVENTS_NUM];
+            portEXIT_CRITICAL(&m_spinlock);
+
+            if (!pending)
+                break;
+
+            alive = sendEvent(client, event);
+            if (!alive)
+                break;
+
+            client.nextId = event.id + 1;
+        }
+
+        if (!alive)
+        {
+            ESPARRAG_LOG_INFO("event stream client %d removed", client.fd);
+            httpd_sess_trigger_close(m_server, client.fd);
+            m_clients.erase(m_clients.begin() + i);
+            continue;
+        }
+
+        i++;
+    }
+}
+
+bool EventStream::sendEvent(client_t &client, const event_t &event)
+{
+    static constexpr int CHUNK_HEADER_SIZE = 10;
+    static char buffer[CHUNK_HEADER_SIZE + EVENT_NAME_MAX_LEN + EVENT_DATA_MAX_LEN + 48];
+
+    // leave room for the chunk size, which is known only after formatting
+    char *body = buffer + CHUNK_HEADER_SIZE;
+    int bodyLen = snprintf(body, sizeof(buffer) - CHUNK_HEADER_SIZE - 2,
+                           "id: %u\nevent: %s\ndata: %s\n\n", event.id, event.name, event.data);
+
+    char chunkHeader[CHUNK_HEADER_SIZE + 1];
+    int headerLen = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", bodyLen);
+    char *chunk = body - headerLen;
+    memcpy(chunk, chunkHeader, headerLen);
+    memcpy(body + bodyLen, "\r\n", 2);
+    int chunkLen = headerLen + bodyLen + 2;
+
+    // a partial write would break the framing, so a client that can't take the whole chunk is dropped
+    int sent = httpd_socket_send(m_server, client.fd, chunk, chunkLen, MSG_DONTWAIT);
+    return sent == chunkLen;
+}
+
+// the same headers as every other response of the server, so its cors settings apply here too
+bool EventStream::sendHeader(httpd_req_t *esp_request)
+{
+    if (httpd_send(esp_request, STREAM_RESPONSE_HEADER, sizeof(STREAM_RESPONSE_HEADER) - 1) < 0)
+        return false;
+
+    if (m_headerKey)
+    {
+        if (httpd_send(esp_request, m_headerKey, strlen(m_headerKey)) < 0 ||
+            httpd_send(esp_request, ": ", 2) < 0 ||
+            httpd_send(esp_request, m_headerBlock, strlen(m_headerBlock)) < 0 ||
+            httpd_send(esp_request, "\r\n", 2) < 0)
+            return false;
+    }
+
+    return httpd_send(esp_request, "\r\n", 2) >= 0;
+}
+
+void EventStream::removeClient(int fd)
+{
+    for (size_t i = 0; i < m_clients.size(); i++)
+    {
+        if (m_clients[i].fd == fd)
+        {
+            ESPARRAG_LOG_INFO("event stream client %d closed", fd);
+            m_clients.erase(m_clients.begin() + i);
+            return;
+        }
+    }
+}
+
+esp_err_t EventStream::handler(httpd_req_t *esp_request)
+{
+    EventStream *stream = reinterpret_cast<EventStream *>(esp_request->user_ctx);
+    int fd = httpd_req_to_sockfd(esp_request);
+
+    if (stream->m_clients.full())
+    {
+        ESPARRAG_LOG_WARNING("event stream %s has maximum clients", stream->Uri());
+        httpd_resp_set_status(esp_request, "503 Service Unavailable");
+        httpd_resp_send(esp_request, nullptr, 0);
+        return ESP_OK;
+    }
+
+    // the response is written raw, it stays open until the client leaves
+    if (!stream->sendHeader(esp_request))
+        return ESP_FAIL;
+
+    // browsers reconnect with the last id they got, resume from there if it is still in the ring
+    client_t client{.fd = fd, .nextId = 0};
+    char lastEventId[12]{};
+    if (httpd_req_get_hdr_value_str(esp_request, "Last-Event-ID", lastEventId, sizeof(lastEventId)) == ESP_OK)
+        client.nextId = strtoul(lastEventId, nullptr, 10) + 1;
+
+    portENTER_CRITICAL(&stream->m_spinlock);
+    if (client.nextId == 0 || client.nextId > stream->m_nextId)
+        client.nextId = stream->m_nextId;
+    portEXIT_CRITICAL(&stream->m_spinlock);
+
+    stream->m_clients.push_back(client);
+    ESPARRAG_LOG_INFO("event stream %s client %d connected", stream->Uri(), fd);
+
+    stream->flush();
+    return ESP_OK;
+}
@@ -0,0 +1,99 @@
+#ifndef ESPARRAG_EVENT_STREAM_H__
+#define ESPARRAG_EVENT_STREAM_H__
+
+#include "esparrag_common.h"
+#include "esp_http_server.h"
+#include "etl/string.h"
+#include "etl/vector.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include <atomic>
+#include <cstdarg>
+
+/*
+    Server-Sent Events route of HttpServer.
+    Push copies an event into a fixed ring and returns, it never waits on a client.
+    The http server task drains the ring to each client over a chunked response that stays open.
+    A client that falls behind more than the ring size skips the events it missed,
+    a client whose socket can't take more data is dropped.
+
+    EventStream stream("/events");
+    server.On(stream);
+    stream.CaptureLogs();
+    ...
+    stream.Push("relay", "{\"on\":true}");
+*/
+class EventStream
+{
+public:
+    static constexpr int URI_MAX_LEN = 15;
+    static constexpr int CLIENTS_MAX_NUM = 4;
+    static constexpr int EVENTS_NUM = 16;
+    static constexpr int EVENT_NAME_MAX_LEN = 15;
+    static constexpr int EVENT_DATA_MAX_LEN = 128;
+    static constexpr int LOG_FLUSH_DELAY_MS = 50;
+
+    EventStream(const char *uri);
+
+    // truncates data longer than EVENT_DATA_MAX_LEN. data must not contain new lines
+    void Push(const char *event, const char *data);
+    // forward every log line as a "log" event, only one stream can capture the logs
+    void CaptureLogs();
+    size_t ClientsNum() const { return m_clients.size(); }
+    const char *Uri() const { return m_uri.c_str(); }
+
+private:
+    friend class HttpServer;
+
+    struct event_t
+    {
+        uint32_t id;
+        char name[EVENT_NAME_MAX_LEN + 1];
+        char data[EVENT_DATA_MAX_LEN + 1];
+    };
+
+    struct client_t
+    {
+        int fd;
+        uint32_t nextId;
+    };
+
+    etl::string<URI_MAX_LEN> m_uri;
+    httpd_handle_t m_server = nullptr;
+    // the server's formatted header block, "key: value\r\n..." without the first key
+    const char *m_headerKey = nullptr;
+    const char *m_headerBlock = nullptr;
+    etl::vector<client_t, CLIENTS_MAX_NUM> m_clients;
+    event_t m_events[EVENTS_NUM]{};
+    uint32_t m_nextId = 1;
+    portMUX_TYPE m_spinlock = portMUX_INITIALIZER_UNLOCKED;
+    std::atomic<bool> m_flushPending{false};
+    TimerHandle_t m_logFlushTimer = nullptr;
+
+    void attach(httpd_handle_t server, const char *headerKey = nullptr, const char *headerBlock = nullptr)
+    {
+        m_server = server;
+        m_headerKey = headerKey;
+        m_headerBlock = headerBlock;
+    }
+    // the session closed, httpd may hand its fd to the next connection
+    void removeClient(int fd);
+    void push(const char *event, const char *data);
+    void requestFlush();
+    void flush();
+    bool sendEvent(client_t &client, const event_t &event);
+    bool sendHeader(httpd_req_t *esp_request);
+
+    static esp_err_t handler(httpd_req_t *esp_request);
+    static void flushWork(void *arg);
+    static void logFlushTimerCB(TimerHandle_t timer);
+    static int logVprintf(const char *format, va_list args);
+
+    static EventStream *s_logStream;
+    static vprintf_like_t s_originalVprintf;
+
+    EventStream(const EventStream &) = delete;
+    EventStream &operator=(const EventStream &) = delete;
+};
+
+#endif
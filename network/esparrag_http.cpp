@@ -2,50 +2,73 @@
 #include "etl/mutex.h"
 #include "etl/string_view.h"
 #include "etl/string.h"
-#include "esparrag_wifi.h"
 #include "esparrag_log.h"
+#include "esparrag_cbor.h"
+#include "esparrag_http_body.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "lwip/sockets.h"
+#include <cstring>
 
 #define HTTP_REQUEST_CONTENT_MAX_SIZE 512
 #define DATA_FIELD "\"body\""
 
-cJSON *HttpServer::parseHtmlBody(const char *body)
-{
-    static char key_buffer[10] = {0};
-    static char val_buffer[24] = {0};
-    etl::string_view view(body);
-    if (view.find("=") == etl::string_view::npos)
-        return nullptr;
-    cJSON *content = cJSON_CreateObject();
-    ESPARRAG_ASSERT(content);
-
-    size_t end = view.find("=");
-    while (end != etl::string_view::npos)
-    {
-        strncpy(key_buffer, view.begin(), end);
-        ESPARRAG_LOG_INFO("key - %s", key_buffer);
+static constexpr char SERVICE_UNAVAILABLE_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                                       "Retry-After: 1\r\n"
+                                                       "Connection: close\r\n"
+                                                       "Content-Length: 0\r\n"
+                                                       "\r\n";
 
-        view.remove_prefix(end + 1);
-        end = view.find("&");
+static bool headerContains(httpd_req_t *esp_request, const char *field, const char *value)
+{
+    char header[64]{};
+    // a truncated header is still searched, the value is usually first
+    esp_err_t err = httpd_req_get_hdr_value_str(esp_request, field, header, sizeof(header));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC)
+        return false;
 
-        strncpy(val_buffer, view.begin(), etl::min(end, view.size()));
-        ESPARRAG_LOG_INFO("val - %s", val_buffer);
+    return strstr(header, value) != nullptr;
+}
 
-        view.remove_prefix(end + 1);
-        end = view.find("=");
+static uint32_t peerAddress(int sockfd)
+{
+    struct sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (getpeername(sockfd, reinterpret_cast<struct sockaddr *>(&addr), &len) != 0)
+        return 0;
 
-        if (strlen(key_buffer) > 0 && strlen(val_buffer) > 0)
-            cJSON_AddStringToObject(content, key_buffer, val_buffer);
+    if (addr.ss_family == AF_INET)
+        return reinterpret_cast<struct sockaddr_in *>(&addr)->sin_addr.s_addr;
 
-        memset(key_buffer, 0, sizeof(key_buffer));
-        memset(val_buffer, 0, sizeof(val_buffer));
-    }
+#if CONFIG_LWIP_IPV6
+    // ipv4 clients are mapped into the low word
+    if (addr.ss_family == AF_INET6)
+        return reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_addr.un.u32_addr[3];
+#endif
 
-    return content;
+    return 0;
 }
 
 esp_err_t HttpServer::requestHandler(httpd_req_t *esp_request)
 {
     HttpServer *server = reinterpret_cast<HttpServer *>(esp_request->user_ctx);
+    int64_t start = esp_timer_get_time();
+    server->m_requestHeapStart = esp_get_free_heap_size();
+    server->m_requestHeapLow = server->m_requestHeapStart;
+
+    if (!server->admit(esp_request))
+        return ESP_FAIL;
+
+    server->countConnection(esp_request);
+    esp_err_t err = server->handleRequest(esp_request);
+    server->finishRequest(esp_request);
+
+    server->recordRequest(start);
+    return err;
+}
+
+esp_err_t HttpServer::handleRequest(httpd_req_t *esp_request)
+{
     static char content[HTTP_REQUEST_CONTENT_MAX_SIZE];
     memset(content, 0, sizeof(content));
 
@@ -64,9 +87,12 @@ esp_err_t HttpServer::requestHandler(httpd_req_t *esp_request)
     }
 
     //find the handler for the request
-    http_event_handler_t *handler = server->findHandler(esp_request);
-    if (!handler || !handler->cb.is_valid())
+    const Router::route_t *route = m_router->Find(esp_request->uri, eMethod(esp_request->method));
+    if (!route)
     {
+        if (sendStaticFile(esp_request))
+            return ESP_OK;
+
         ESPARRAG_LOG_ERROR("no handler found for uri %s, method %d", esp_request->uri, esp_request->method);
         httpd_resp_send_404(esp_request);
         return ESP_OK;
@@ -74,47 +100,115 @@ esp_err_t HttpServer::requestHandler(httpd_req_t *esp_request)
 
     ESPARRAG_LOG_INFO("handling %s", esp_request->uri);
 
-    cJSON *json_body = cJSON_Parse(content);
-    if (json_body == nullptr)
-        json_body = server->parseHtmlBody(content);
+    bool cbor = headerContains(esp_request, "Content-Type", Response::FORMAT(Response::FORMAT::CBOR).c_str());
+    cJSON *json_body = HttpBody::Parse(content, ret, cbor);
 
     Request request(json_body, esp_request->uri, eMethod(esp_request->method));
     Response response;
-    handler->cb(request, response);
+    route->cb(request, response);
+    sampleHeap();
 
     //send the response aquired from the handler
-    server->sendResponse(esp_request, response);
+    bool acceptsCbor = headerContains(esp_request, "Accept", Response::FORMAT(Response::FORMAT::CBOR).c_str());
+    sendResponse(esp_request, response, acceptsCbor);
     return ESP_OK;
 }
 
-http_event_handler_t *HttpServer::findHandler(httpd_req_t *esp_request)
+esp_err_t HttpServer::optionsHandler(httpd_req_t *esp_request)
 {
-    for (size_t i = 0; i < m_handlers.size(); i++)
-    {
-        bool uriMatch = m_handlers[i].uri == esp_request->uri;
-        bool methodMatch = m_handlers[i].method == esp_request->method ||
-                           m_handlers[i].method == eMethod::GENERAL;
+    HttpServer *server = reinterpret_cast<HttpServer *>(esp_request->user_ctx);
+    if (!server->admit(esp_request))
+        return ESP_FAIL;
 
-        if (uriMatch && methodMatch)
-        {
-            return &m_handlers[i];
-        }
-    }
+    //preflight requests are answered here and never reach the user handlers
+    server->setHeaders(esp_request);
+    httpd_resp_set_status(esp_request, HTTPD_204);
+    httpd_resp_send(esp_request, nullptr, 0);
+    server->finishRequest(esp_request);
+    return ESP_OK;
+}
+
+//answers 503 without reading the body, returning ESP_FAIL after it closes the connection
+bool HttpServer::admit(httpd_req_t *esp_request)
+{
+    int sockfd = httpd_req_to_sockfd(esp_request);
+    bool overConnections = m_maxConnections != 0 && m_openConnections > m_maxConnections;
+    if (!overConnections && m_rateLimiter.Allow(peerAddress(sockfd), esp_timer_get_time()))
+        return true;
+
+    httpd_send(esp_request, SERVICE_UNAVAILABLE_RESPONSE, sizeof(SERVICE_UNAVAILABLE_RESPONSE) - 1);
+
+    portENTER_CRITICAL(&m_statsLock);
+    m_rejected++;
+    portEXIT_CRITICAL(&m_statsLock);
+    return false;
+}
+
+esp_err_t HttpServer::openConnection(httpd_handle_t handle, int sockfd)
+{
+    HttpServer *server = reinterpret_cast<HttpServer *>(httpd_get_global_user_ctx(handle));
+    server->m_openConnections++;
+    return ESP_OK;
+}
+
+//when set, the close callback owns closing the socket
+void HttpServer::closeConnection(httpd_handle_t handle, int sockfd)
+{
+    HttpServer *server = reinterpret_cast<HttpServer *>(httpd_get_global_user_ctx(handle));
+    server->m_openConnections--;
+
+    //the fd is reused by the next connection, streams must not write to it anymore
+    for (EventStream *stream : server->m_eventStreams)
+        stream->removeClient(sockfd);
+    for (WebSocket *websocket : server->m_websockets)
+        websocket->removeClient(sockfd);
 
-    return nullptr;
+    close(sockfd);
 }
 
-void HttpServer::sendResponse(httpd_req_t *esp_request, Response &response)
+void HttpServer::SetRateLimit(uint16_t requestsPerSecond, uint16_t burst)
 {
-    httpd_resp_set_hdr(esp_request, "Access-Control-Allow-Origin", "*");
-    httpd_resp_set_hdr(esp_request, "Access-Control-Max-Age", "10000");
-    httpd_resp_set_hdr(esp_request, "Access-Control-Allow-Methods", "POST,GET,DELETE,OPTIONS");
-    httpd_resp_set_hdr(esp_request, "Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
-    httpd_resp_set_type(esp_request, response.m_format.c_str());
+    m_rateLimiter.Configure(requestsPerSecond, burst ? burst : requestsPerSecond);
+}
+
+void HttpServer::SetMaxConnections(uint8_t maxConnections)
+{
+    m_maxConnections = maxConnections;
+}
+
+void HttpServer::sendResponse(httpd_req_t *esp_request, Response &response, bool acceptsCbor)
+{
+    static uint8_t cborBuffer[CBOR_RESPONSE_MAX_SIZE];
+
+    setHeaders(esp_request);
     httpd_resp_set_status(esp_request, response.m_code.c_str());
 
-    bool sendJson = response.m_format == Response::FORMAT::JSON;
+    //json responses are encoded as cbor when the client asks for it
+    bool sendCbor = response.m_format == Response::FORMAT::CBOR ||
+                    (response.m_format == Response::FORMAT::JSON && acceptsCbor);
+    if (sendCbor)
+    {
+        CborWriter writer(cborBuffer, sizeof(cborBuffer));
+        if (writer.Write(response.m_json))
+        {
+            httpd_resp_set_type(esp_request, Response::FORMAT(Response::FORMAT::CBOR).c_str());
+            sampleHeap();
+            esp_err_t err = httpd_resp_send(esp_request, reinterpret_cast<const char *>(cborBuffer), writer.Size());
+            if (err != ESP_OK)
+            {
+                ESPARRAG_LOG_ERROR("error sending response, err %d", err);
+            }
+
+            return;
+        }
+
+        ESPARRAG_LOG_WARNING("cbor response exceeds %d bytes, sending json", CBOR_RESPONSE_MAX_SIZE);
+    }
+
+    bool sendJson = response.m_format != Response::FORMAT::HTML;
+    httpd_resp_set_type(esp_request, Response::FORMAT(sendJson ? Response::FORMAT::JSON : Response::FORMAT::HTML).c_str());
     const char *responseString = sendJson == true ? cJSON_Print(response.m_json) : response.m_string;
+    sampleHeap();
     int bytes = httpd_resp_send(esp_request, responseString, HTTPD_RESP_USE_STRLEN);
     if (bytes < 0)
     {
@@ -125,10 +219,192 @@ void HttpServer::sendResponse(httpd_req_t *esp_request, Response &response)
         cJSON_free((void *)responseString);
 }
 
-eResult HttpServer::Init()
+void HttpServer::setHeaders(httpd_req_t *esp_request)
+{
+    if (m_headerBlockKey)
+        httpd_resp_set_hdr(esp_request, m_headerBlockKey, m_headerBlock);
+
+    if (!m_keepAlive)
+        httpd_resp_set_hdr(esp_request, "Connection", "close");
+}
+
+void HttpServer::finishRequest(httpd_req_t *esp_request)
+{
+    if (!m_keepAlive)
+        httpd_sess_trigger_close(m_handle, httpd_req_to_sockfd(esp_request));
+}
+
+/*  esp http server writes every header as "key: value\r\n".
+    The value of the first header is followed by the rest of the headers already formatted,
+    so the whole set goes out with a single httpd_resp_set_hdr call */
+eResult HttpServer::buildHeaderBlock(const http_header_t *headers, size_t headersNum)
+{
+    m_headerBlockKey = nullptr;
+    memset(m_headerBlock, 0, sizeof(m_headerBlock));
+    if (!headers || headersNum == 0)
+        return eResult::SUCCESS;
+
+    int len = snprintf(m_headerBlock, sizeof(m_headerBlock), "%s", headers[0].value);
+    for (size_t i = 1; i < headersNum && len < HEADER_BLOCK_SIZE; i++)
+    {
+        len += snprintf(m_headerBlock + len, sizeof(m_headerBlock) - len, "\r\n%s: %s", headers[i].key, headers[i].value);
+    }
+
+    if (len >= HEADER_BLOCK_SIZE)
+    {
+        ESPARRAG_LOG_ERROR("headers exceed %d bytes", HEADER_BLOCK_SIZE);
+        memset(m_headerBlock, 0, sizeof(m_headerBlock));
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
+
+    m_headerBlockKey = headers[0].key;
+    return eResult::SUCCESS;
+}
+
+bool HttpServer::sendStaticFile(httpd_req_t *esp_request)
+{
+    static char etag[12];
+
+    StaticFiles::file_t file{};
+    if (!m_staticFiles || esp_request->method != HTTP_GET || !m_staticFiles->Find(esp_request->uri, file))
+        return false;
+
+    snprintf(etag, sizeof(etag), "\"%08x\"", file.etag);
+    setHeaders(esp_request);
+    httpd_resp_set_hdr(esp_request, "ETag", etag);
+
+    char ifNoneMatch[sizeof(etag)]{};
+    esp_err_t err = httpd_req_get_hdr_value_str(esp_request, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch));
+    if (err == ESP_OK && strcmp(ifNoneMatch, etag) == 0)
+    {
+        httpd_resp_set_status(esp_request, "304 Not Modified");
+        httpd_resp_send(esp_request, nullptr, 0);
+        return true;
+    }
+
+    static char cacheControl[32];
+    snprintf(cacheControl, sizeof(cacheControl), "public, max-age=%d", STATIC_FILES_MAX_AGE);
+    httpd_resp_set_type(esp_request, file.mime);
+    httpd_resp_set_hdr(esp_request, "Content-Encoding", "gzip");
+    httpd_resp_set_hdr(esp_request, "Cache-Control", cacheControl);
+
+    //sent directly from the mapped flash, no intermediate copy
+    err = httpd_resp_send(esp_request, reinterpret_cast<const char *>(file.data), file.size);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("error sending static file %s, err %d", file.path, err);
+    }
+
+    return true;
+}
+
+void HttpServer::sampleHeap()
+{
+    m_requestHeapLow = etl::min<size_t>(m_requestHeapLow, esp_get_free_heap_size());
+}
+
+//the first request of a session marks it, so websocket and event stream sessions never count
+void HttpServer::countConnection(httpd_req_t *esp_request)
+{
+    if (esp_request->sess_ctx)
+        return;
+
+    esp_request->sess_ctx = this;
+    //httpd frees the session ctx unless told otherwise
+    esp_request->free_ctx = [](void *) {};
+
+    portENTER_CRITICAL(&m_statsLock);
+    m_connections++;
+    portEXIT_CRITICAL(&m_statsLock);
+}
+
+void HttpServer::recordRequest(int64_t start)
+{
+    MicroSeconds latency(esp_timer_get_time() - start);
+    size_t heapUsed = m_requestHeapStart > m_requestHeapLow ? m_requestHeapStart - m_requestHeapLow : 0;
+
+    portENTER_CRITICAL(&m_statsLock);
+    m_latency.Add(latency);
+    m_peakHeapPerRequest = etl::max(m_peakHeapPerRequest, heapUsed);
+    portEXIT_CRITICAL(&m_statsLock);
+}
+
+http_stats_t HttpServer::GetStats()
+{
+    portENTER_CRITICAL(&m_statsLock);
+    LatencyHistogram latency = m_latency;
+    uint32_t rejected = m_rejected;
+    uint32_t connections = m_connections;
+    size_t peakHeap = m_peakHeapPerRequest;
+    int64_t statsStart = m_statsStart;
+    portEXIT_CRITICAL(&m_statsLock);
+
+    int64_t elapsed = esp_timer_get_time() - statsStart;
+    uint32_t seconds = etl::max<int64_t>(elapsed / 1000000, 1);
+    uint32_t requests = latency.Count();
+    uint8_t reusePercent = requests > connections ? (requests - connections) * 100 / requests : 0;
+
+    return http_stats_t{.requests = requests,
+                        .rejected = rejected,
+                        .requestsPerSecond = requests / seconds,
+                        .latencyP50 = latency.Percentile(50),
+                        .latencyP90 = latency.Percentile(90),
+                        .latencyP99 = latency.Percentile(99),
+                        .latencyMax = latency.Max(),
+                        .peakHeapPerRequest = peakHeap,
+                        .connections = connections,
+                        .connectionReusePercent = reusePercent};
+}
+
+void HttpServer::ResetStats()
+{
+    portENTER_CRITICAL(&m_statsLock);
+    m_latency.Reset();
+    m_rejected = 0;
+    m_connections = 0;
+    m_peakHeapPerRequest = 0;
+    m_statsStart = esp_timer_get_time();
+    portEXIT_CRITICAL(&m_statsLock);
+}
+
+eResult HttpServer::ServeStatic(const StaticFiles &files)
+{
+    if (!files.IsInitialized())
+    {
+        ESPARRAG_LOG_ERROR("static files are not initialized");
+        return eResult::ERROR_NOT_INITIALIZED;
+    }
+
+    m_staticFiles = &files;
+    return eResult::SUCCESS;
+}
+
+eResult HttpServer::Init(const http_config_t &config)
 {
     m_config = HTTPD_DEFAULT_CONFIG();
+    m_config.server_port = config.port;
+    m_config.max_open_sockets = config.maxOpenSockets;
+    m_config.lru_purge_enable = config.keepAlive;
+    m_config.stack_size = config.stackSize;
+    m_config.task_priority = config.taskPriority;
+    m_config.core_id = config.coreId;
+    m_config.recv_wait_timeout = config.recvTimeout.value();
+    m_config.send_wait_timeout = config.sendTimeout.value();
+    m_config.max_uri_handlers = WILDCARD_HANDLERS_NUM + WEBSOCKETS_MAX_NUM + EVENT_STREAMS_MAX_NUM;
     m_config.uri_match_fn = httpd_uri_match_wildcard;
+    m_config.global_user_ctx = this;
+    //the server is not heap allocated, httpd must not free it on stop
+    m_config.global_user_ctx_free_fn = [](void *) {};
+    m_config.open_fn = openConnection;
+    m_config.close_fn = closeConnection;
+
+    m_keepAlive = config.keepAlive;
+
+    eResult res = buildHeaderBlock(config.headers, config.headersNum);
+    if (res != eResult::SUCCESS)
+        return res;
+
+    ResetStats();
 
     ESPARRAG_LOG_INFO("http server initialized");
 
@@ -152,42 +428,98 @@ eResult HttpServer::On(const char *uri,
         return eResult::ERROR_INVALID_PARAMETER;
     }
 
-    if (m_handlers.size() >= HANDLERS_MAX_NUM)
+    eResult res = m_router->On(uri, method, callback);
+    if (res != eResult::SUCCESS)
+        return res;
+
+    ESPARRAG_LOG_INFO("Request handler added!");
+    return eResult::SUCCESS;
+}
+
+eResult HttpServer::On(Router &router)
+{
+    if (m_isRunning || m_routes.Size() > 0)
+    {
+        ESPARRAG_LOG_ERROR("a router must be set before the server runs and before its own handlers");
+        return eResult::ERROR_INVALID_STATE;
+    }
+
+    m_router = &router;
+    return eResult::SUCCESS;
+}
+
+eResult HttpServer::On(WebSocket &websocket)
+{
+    if (m_isRunning)
+    {
+        ESPARRAG_LOG_ERROR("websockets must be registered before the server runs");
+        return eResult::ERROR_INVALID_STATE;
+    }
+
+    if (m_websockets.full())
     {
-        ESPARRAG_LOG_ERROR("maximum amount of handlers have been registered");
+        ESPARRAG_LOG_ERROR("maximum amount of websockets have been registered");
         return eResult::ERROR_INVALID_PARAMETER;
     }
 
-    for (size_t i = 0; i < m_handlers.size(); i++)
+    m_websockets.push_back(&websocket);
+    return eResult::SUCCESS;
+}
+
+eResult HttpServer::On(EventStream &stream)
+{
+    if (m_isRunning)
     {
-        bool uriMatch = httpd_uri_match_wildcard(m_handlers[i].uri.data(), uri, strlen(uri));
-        bool methodMatch = m_handlers[i].method == method ||
-                           m_handlers[i].method == eMethod::GENERAL;
-        if (uriMatch && methodMatch)
-        {
-            ESPARRAG_LOG_ERROR("Handler for this request already exists! uri %s", uri);
-            return eResult::ERROR_INVALID_PARAMETER;
-        }
+        ESPARRAG_LOG_ERROR("event streams must be registered before the server runs");
+        return eResult::ERROR_INVALID_STATE;
     }
 
-    http_event_handler_t handler = {.cb = callback,
-                                    .uri{uri},
-                                    .method = method};
-    m_handlers.push_back(handler);
+    if (m_eventStreams.full())
+    {
+        ESPARRAG_LOG_ERROR("maximum amount of event streams have been registered");
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
 
-    ESPARRAG_LOG_INFO("Request handler added!");
+    m_eventStreams.push_back(&stream);
     return eResult::SUCCESS;
 }
 
 eResult HttpServer::registerHandlers()
 {
+    esp_err_t err = ESP_OK;
+
+    //websockets and streams first, as the handlers are matched by registration order and "/*" matches everything
+    for (WebSocket *websocket : m_websockets)
+    {
+        httpd_uri_t wsParams = {
+            .uri = websocket->Uri(),
+            .method = HTTP_GET,
+            .handler = WebSocket::handler,
+            .user_ctx = websocket,
+            .is_websocket = true};
+
+        err |= httpd_register_uri_handler(m_handle, &wsParams);
+        websocket->attach(m_handle);
+    }
+
+    for (EventStream *stream : m_eventStreams)
+    {
+        httpd_uri_t streamParams = {
+            .uri = stream->Uri(),
+            .method = HTTP_GET,
+            .handler = EventStream::handler,
+            .user_ctx = stream};
+
+        err |= httpd_register_uri_handler(m_handle, &streamParams);
+        stream->attach(m_handle, m_headerBlockKey, m_headerBlock);
+    }
+
     httpd_uri_t uriParams = {
         .uri = "/*",
         .method = HTTP_POST,
         .handler = requestHandler,
         .user_ctx = this};
 
-    esp_err_t err = ESP_OK;
     err |= httpd_register_uri_handler(m_handle, &uriParams);
     uriParams.method = HTTP_GET;
     err |= httpd_register_uri_handler(m_handle, &uriParams);
@@ -195,6 +527,9 @@ eResult HttpServer::registerHandlers()
     err |= httpd_register_uri_handler(m_handle, &uriParams);
     uriParams.method = HTTP_PUT;
     err |= httpd_register_uri_handler(m_handle, &uriParams);
+    uriParams.method = HTTP_OPTIONS;
+    uriParams.handler = optionsHandler;
+    err |= httpd_register_uri_handler(m_handle, &uriParams);
     if (err != ESP_OK)
     {
         ESPARRAG_LOG_ERROR("couldnt register uri handlers. err %d", err);
@@ -214,6 +549,12 @@ eResult HttpServer::RunServer()
         return eResult::ERROR_INVALID_STATE;
     }
 
+    //lru purge would evict the long lived websocket and event stream sockets first
+    bool hasStreams = !m_websockets.empty() || !m_eventStreams.empty();
+    m_config.lru_purge_enable = m_keepAlive && !hasStreams;
+    if (m_keepAlive && hasStreams)
+        ESPARRAG_LOG_INFO("lru purge disabled, streams are registered");
+
     m_isRunning = true;
     esp_err_t err = httpd_start(&m_handle, &m_config);
     if (err != ESP_OK)
@@ -243,6 +584,18 @@ eResult HttpServer::stopServer()
         return eResult::ERROR_GENERAL;
     }
 
+    for (WebSocket *websocket : m_websockets)
+    {
+        httpd_unregister_uri(m_handle, websocket->Uri());
+        websocket->attach(nullptr);
+    }
+
+    for (EventStream *stream : m_eventStreams)
+    {
+        httpd_unregister_uri(m_handle, stream->Uri());
+        stream->attach(nullptr);
+    }
+
     err = httpd_stop(m_handle);
     if (err != ESP_OK)
     {
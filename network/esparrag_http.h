@@ -2,50 +2,162 @@
 #define EPARRAG_HTTP_SERVER__
 
 #include "esparrag_common.h"
+#include "esparrag_time_units.h"
 #include "esp_http_server.h"
 #include "esparrag_request.h"
 #include "esparrag_response.h"
+#include "esparrag_router.h"
+#include "esparrag_static_files.h"
+#include "esparrag_websocket.h"
+#include "esparrag_event_stream.h"
+#include "esparrag_rate_limiter.h"
+#include "latency_histogram.h"
+#include <atomic>
 #include "etl/delegate.h"
 #include "etl/string.h"
 #include "etl/vector.h"
 #include "cJSON.h"
 
-using http_handler_callback = etl::delegate<void(Request &, Response &)>;
+using http_handler_callback = request_handler_t;
 using promise_callback = etl::delegate<void(void *)>;
 
-struct http_event_handler_t
+struct http_header_t
 {
-    static constexpr int URI_MAX_LEN = 15;
-    http_handler_callback cb;
-    etl::string<URI_MAX_LEN> uri;
-    eMethod method;
+    const char *key;
+    const char *value;
+};
+
+/*  http server tuning, defaults match HTTPD_DEFAULT_CONFIG.
+    keepAlive - connections are reused for consecutive requests and the least recently used
+    connection is purged when a new one arrives over maxOpenSockets.
+    purging is off while websockets or event streams are registered, it would close their long lived
+    sockets first. a new connection over maxOpenSockets is refused then.
+    when off every response closes its connection */
+struct http_config_t
+{
+    static constexpr http_header_t DEFAULT_HEADERS[] = {
+        {"Access-Control-Allow-Origin", "*"},
+        {"Access-Control-Max-Age", "10000"},
+        {"Access-Control-Allow-Methods", "POST,GET,PUT,DELETE,OPTIONS"},
+        {"Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept"},
+    };
+
+    uint16_t port = 80;
+    uint8_t maxOpenSockets = 7;
+    bool keepAlive = true;
+    uint32_t stackSize = 4096;
+    uint8_t taskPriority = tskIDLE_PRIORITY + 5;
+    BaseType_t coreId = tskNO_AFFINITY;
+    Seconds recvTimeout = 5;
+    Seconds sendTimeout = 5;
+    // attached to every response (including OPTIONS preflights), must outlive the server
+    const http_header_t *headers = DEFAULT_HEADERS;
+    size_t headersNum = sizeof(DEFAULT_HEADERS) / sizeof(DEFAULT_HEADERS[0]);
+};
+
+struct http_stats_t
+{
+    uint32_t requests;
+    // rejected by rate limiting or admission control
+    uint32_t rejected;
+    uint32_t requestsPerSecond;
+    MicroSeconds latencyP50;
+    MicroSeconds latencyP90;
+    MicroSeconds latencyP99;
+    MicroSeconds latencyMax;
+    /*  largest drop of the global free heap sampled while handling a single request.
+        an approximation, other tasks allocating or freeing at the same time show up in it too */
+    size_t peakHeapPerRequest;
+    // connections that carried at least one request, websocket and event stream sessions aren't counted
+    uint32_t connections;
+    // share of requests served over an already open connection
+    uint8_t connectionReusePercent;
 };
 
 class HttpServer
 {
 public:
-    static constexpr uint8_t HANDLERS_MAX_NUM = 15;
+    static constexpr uint8_t WEBSOCKETS_MAX_NUM = 2;
+    static constexpr uint8_t EVENT_STREAMS_MAX_NUM = 2;
+    static constexpr int STATIC_FILES_MAX_AGE = 86400 * 30;
+    static constexpr int HEADER_BLOCK_SIZE = 256;
+    static constexpr int CBOR_RESPONSE_MAX_SIZE = 1024;
+    // "/*" for POST, GET, PUT, DELETE and OPTIONS
+    static constexpr int WILDCARD_HANDLERS_NUM = 5;
 
-    eResult Init();
+    // headers are formatted once here
+    eResult Init(const http_config_t &config = http_config_t{});
     eResult On(const char *uri,
                eMethod method,
                http_handler_callback callback);
+    /*  serve the routes of a router shared with other transports instead of the server's own table.
+        before the server runs and before any On(uri, ...), later On(uri, ...) calls add to the shared router */
+    eResult On(Router &router);
+    // register a websocket route, must be called before the server runs
+    eResult On(WebSocket &websocket);
+    // register a server-sent events route, must be called before the server runs
+    eResult On(EventStream &stream);
+    // serve GET requests without a registered handler from the packed static files
+    eResult ServeStatic(const StaticFiles &files);
+
+    /*  admission control, both are checked before the request body is read.
+        a client over its rate, or a connection over the limit, is answered with 503 and closed.
+        0 disables. both may change while the server runs */
+    void SetRateLimit(uint16_t requestsPerSecond, uint16_t burst);
+    void SetMaxConnections(uint8_t maxConnections);
+
+    // request handling metrics since the last reset (websockets and event streams excluded)
+    http_stats_t GetStats();
+    void ResetStats();
 
 private:
+    // tools/http_bench starts the server over a fake esp_http_server
+    friend class HttpBench;
+
     bool m_isRunning = false;
-    etl::vector<http_event_handler_t, HANDLERS_MAX_NUM> m_handlers;
+    Router m_routes;
+    Router *m_router = &m_routes;
+    etl::vector<WebSocket *, WEBSOCKETS_MAX_NUM> m_websockets;
+    etl::vector<EventStream *, EVENT_STREAMS_MAX_NUM> m_eventStreams;
 
     httpd_handle_t m_handle = nullptr;
     httpd_config_t m_config{};
+    const StaticFiles *m_staticFiles = nullptr;
+    const char *m_headerBlockKey = nullptr;
+    char m_headerBlock[HEADER_BLOCK_SIZE]{};
+
+    RateLimiter m_rateLimiter;
+    uint8_t m_maxConnections = 0;
+    std::atomic<uint8_t> m_openConnections{0};
+    bool m_keepAlive = true;
+
+    LatencyHistogram m_latency;
+    uint32_t m_rejected = 0;
+    uint32_t m_connections = 0;
+    int64_t m_statsStart = 0;
+    size_t m_peakHeapPerRequest = 0;
+    size_t m_requestHeapStart = 0;
+    size_t m_requestHeapLow = 0;
+    portMUX_TYPE m_statsLock = portMUX_INITIALIZER_UNLOCKED;
 
     eResult RunServer();
     eResult stopServer();
     eResult registerHandlers();
-    cJSON *parseHtmlBody(const char *body);
-    http_event_handler_t *findHandler(httpd_req_t *esp_request);
-    void sendResponse(httpd_req_t *esp_request, Response &response);
+    void sendResponse(httpd_req_t *esp_request, Response &response, bool acceptsCbor);
+    bool sendStaticFile(httpd_req_t *esp_request);
+    eResult buildHeaderBlock(const http_header_t *headers, size_t headersNum);
+    void setHeaders(httpd_req_t *esp_request);
+    void finishRequest(httpd_req_t *esp_request);
+    esp_err_t handleRequest(httpd_req_t *esp_request);
+    bool admit(httpd_req_t *esp_request);
+    void sampleHeap();
+    void recordRequest(int64_t start);
+    void countConnection(httpd_req_t *esp_request);
 
     static esp_err_t requestHandler(httpd_req_t *esp_request);
+    static esp_err_t optionsHandler(httpd_req_t *esp_request);
+    static esp_err_t openConnection(httpd_handle_t handle, int sockfd);
+    static void closeConnection(httpd_handle_t handle, int sockfd);
     static esp_err_t post_handler(httpd_req_t *req);
     static esp_err_t get_handler(httpd_req_t *req);
 };
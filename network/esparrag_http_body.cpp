@@ -0,0 +1,53 @@
+#include "esparrag_http_body.h"
+#include "esparrag_cbor.h"
+#include "esparrag_common.h"
+#include "esparrag_log.h"
+#include "etl/string_view.h"
+#include <cstring>
+
+cJSON *HttpBody::Parse(const char *content, size_t len, bool cbor)
+{
+    if (cbor)
+        return CborReader(reinterpret_cast<const uint8_t *>(content), len).ToJson();
+
+    cJSON *json = cJSON_Parse(content);
+    if (json == nullptr)
+        json = parseForm(content);
+
+    return json;
+}
+
+cJSON *HttpBody::parseForm(const char *body)
+{
+    static char key_buffer[10] = {0};
+    static char val_buffer[24] = {0};
+    etl::string_view view(body);
+    if (view.find("=") == etl::string_view::npos)
+        return nullptr;
+    cJSON *content = cJSON_CreateObject();
+    ESPARRAG_ASSERT(content);
+
+    size_t end = view.find("=");
+    while (end != etl::string_view::npos)
+    {
+        strncpy(key_buffer, view.begin(), end);
+        ESPARRAG_LOG_INFO("key - %s", key_buffer);
+
+        view.remove_prefix(end + 1);
+        end = view.find("&");
+
+        strncpy(val_buffer, view.begin(), etl::min(end, view.size()));
+        ESPARRAG_LOG_INFO("val - %s", val_buffer);
+
+        view.remove_prefix(end + 1);
+        end = view.find("=");
+
+        if (strlen(key_buffer) > 0 && strlen(val_buffer) > 0)
+            cJSON_AddStringToObject(content, key_buffer, val_buffer);
+
+        memset(key_buffer, 0, sizeof(key_buffer));
+        memset(val_buffer, 0, sizeof(val_buffer));
+    }
+
+    return content;
+}
@@ -0,0 +1,21 @@
+#ifndef ESPARRAG_HTTP_BODY_H__
+#define ESPARRAG_HTTP_BODY_H__
+
+#include "cJSON.h"
+#include <stddef.h>
+
+/*
+    Request body decoding of HttpServer, kept free of esp-idf so tools/http_bench runs it on the host.
+    cbor when the content type says so, otherwise json text, otherwise html form fields (key=value&...).
+    The caller owns the returned tree, nullptr when the body is none of these.
+*/
+class HttpBody
+{
+public:
+    static cJSON *Parse(const char *content, size_t len, bool cbor);
+
+private:
+    static cJSON *parseForm(const char *body);
+};
+
+#endif
@@ -2,6 +2,12 @@
 #include "mdns.h"
 #include "esparrag_log.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "lock.h"
+#include "etl/algorithm.h"
+#include <cstring>
+#include <cstdlib>
 
 #define MQTT_SRV "_mqtt"
 #define MQTT_PROTO "_tcp"
@@ -58,24 +64,200 @@ eResult Mdns::AdvertiseESPNOW() {
 }
 
 
-EsparragResult<const char*> Mdns::FindBroker()
+EsparragResult<mdns_broker_t> Mdns::FindBroker()
 {
+    brokers_t brokers;
+    if (QueryBrokers(brokers) != eResult::SUCCESS)
+        return eResult::ERROR_CONNECTION_FAILURE;
+
+    if (brokers.empty())
+    {
+        ESPARRAG_LOG_ERROR("couldn't find broker. no results");
+        return eResult::ERROR_NOT_FOUND;
+    }
+
+    ESPARRAG_LOG_INFO("broker %s at " IPSTR ":%d", brokers[0].instance, IP2STR(&brokers[0].address), brokers[0].port);
+    return brokers[0];
+}
+
+static uint8_t txtPriority(const mdns_result_t *result)
+{
+    for (size_t i = 0; i < result->txt_count; i++)
+    {
+        if (strcmp(result->txt[i].key, "priority") == 0 && result->txt[i].value)
+            return atoi(result->txt[i].value);
+    }
+
+    return 0;
+}
+
+eResult Mdns::QueryBrokers(brokers_t &brokers, MilliSeconds timeout)
+{
+    brokers.clear();
     mdns_result_t *results = nullptr;
-    esp_err_t err = mdns_query_ptr(MQTT_SRV, MQTT_PROTO, 1500, 1, &results);
+    esp_err_t err = mdns_query_ptr(MQTT_SRV, MQTT_PROTO, timeout.value(), BROKERS_MAX_NUM, &results);
     if (err != ESP_OK)
     {
-        ESPARRAG_LOG_ERROR("couldn't find broker. err %d", err);
+        ESPARRAG_LOG_ERROR("couldn't query brokers. err %d", err);
         return eResult::ERROR_CONNECTION_FAILURE;
     }
-    if (results == nullptr)
+
+    int64_t now = esp_timer_get_time();
+    for (const mdns_result_t *result = results; result && !brokers.full(); result = result->next)
     {
-        ESPARRAG_LOG_ERROR("couldn't find broker. no results");
-        return eResult::ERROR_NOT_FOUND;
+        const mdns_ip_addr_t *addr = result->addr;
+        while (addr && addr->addr.type != IPADDR_TYPE_V4)
+            addr = addr->next;
+        if (!addr)
+            continue;
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+        uint32_t ttl = result->ttl ? result->ttl : MdnsDiscovery::DEFAULT_TTL_SEC;
+#else
+        uint32_t ttl = MdnsDiscovery::DEFAULT_TTL_SEC;
+#endif
+        mdns_broker_t broker{};
+        strlcpy(broker.instance, result->instance_name ? result->instance_name : "", sizeof(broker.instance));
+        strlcpy(broker.hostname, result->hostname ? result->hostname : "", sizeof(broker.hostname));
+        broker.address = addr->addr.u_addr.ip4;
+        broker.port = result->port;
+        broker.priority = txtPriority(result);
+        broker.expiresUs = now + static_cast<int64_t>(ttl) * 1000000;
+        brokers.push_back(broker);
     }
 
-    static char address[20]{};
-    snprintf(address, 20, IPSTR, IP2STR(&(results->addr->addr.u_addr.ip4)));
-    ESPARRAG_LOG_INFO("broker ip %s", address);
+    mdns_query_results_free(results);
+    etl::stable_sort(brokers.begin(), brokers.end(), [](const mdns_broker_t &a, const mdns_broker_t &b)
+                     { return a.priority < b.priority; });
+    return eResult::SUCCESS;
+}
+
+//================================ DISCOVERY ====================================================
+
+void MdnsDiscovery::OnChange(broker_change_callback callback)
+{
+    ESPARRAG_ASSERT(!m_task && !m_listeners.full() && callback.is_valid());
+    m_listeners.push_back(callback);
+}
+
+eResult MdnsDiscovery::Start()
+{
+    if (m_task)
+        return eResult::ERROR_INVALID_STATE;
+
+    BaseType_t res = xTaskCreatePinnedToCore(discoveryTask, DISCOVERY_TASK_NAME, DISCOVERY_TASK_STACK_SIZE, this,
+                                             DISCOVERY_TASK_PRIORITY, &m_task, tskNO_AFFINITY);
+    return res == pdPASS ? eResult::SUCCESS : eResult::ERROR_MEMORY;
+}
+
+void MdnsDiscovery::Refresh()
+{
+    if (m_task)
+        xTaskNotifyGive(m_task);
+}
 
-    return address;
-}
\ No newline at end of file
+bool MdnsDiscovery::Best(mdns_broker_t &broker)
+{
+    Lock lock(m_mutex);
+    if (m_brokers.empty())
+        return false;
+
+    // kept sorted by update
+    broker = m_brokers[0];
+    return true;
+}
+
+Mdns::brokers_t MdnsDiscovery::Brokers()
+{
+    Lock lock(m_mutex);
+    return m_brokers;
+}
+
+bool MdnsDiscovery::Empty()
+{
+    Lock lock(m_mutex);
+    return m_brokers.empty();
+}
+
+void MdnsDiscovery::discoveryTask(void *arg)
+{
+    MdnsDiscovery *discovery = reinterpret_cast<MdnsDiscovery *>(arg);
+    for (;;)
+    {
+        if (Mdns::QueryBrokers(discovery->m_found) == eResult::SUCCESS)
+            discovery->update();
+
+        bool searching = discovery->Empty();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(searching ? SEARCH_PERIOD_MS : REFRESH_PERIOD_MS));
+    }
+}
+
+// runs on the discovery task, listeners are called outside the lock
+void MdnsDiscovery::update()
+{
+    // a removed broker by its index in m_removed, others by their index in m_found
+    struct change_t
+    {
+        uint8_t index;
+        eChange change;
+    };
+    const Mdns::brokers_t &found = m_found;
+    etl::vector<change_t, Mdns::BROKERS_MAX_NUM * 2> changes;
+    int64_t now = esp_timer_get_time();
+    m_removed.clear();
+
+    {
+        Lock lock(m_mutex);
+        // gone quiet past their ttl, a single missed query doesn't remove a broker
+        for (size_t i = 0; i < m_brokers.size();)
+        {
+            bool seen = etl::any_of(found.begin(), found.end(), [&](const mdns_broker_t &broker)
+                                    { return strcmp(broker.instance, m_brokers[i].instance) == 0; });
+            if (!seen && m_brokers[i].expiresUs <= now)
+            {
+                changes.push_back({static_cast<uint8_t>(m_removed.size()), BROKER_REMOVED});
+                m_removed.push_back(m_brokers[i]);
+                m_brokers.erase(m_brokers.begin() + i);
+                continue;
+            }
+            i++;
+        }
+
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            const mdns_broker_t &broker = found[i];
+            auto known = etl::find_if(m_brokers.begin(), m_brokers.end(), [&](const mdns_broker_t &cached)
+                                      { return strcmp(broker.instance, cached.instance) == 0; });
+            if (known == m_brokers.end())
+            {
+                if (m_brokers.full())
+                    continue;
+
+                m_brokers.push_back(broker);
+                changes.push_back({static_cast<uint8_t>(i), BROKER_ADDED});
+                continue;
+            }
+
+            bool changed = !ip4_addr_cmp(&known->address, &broker.address) ||
+                           known->port != broker.port ||
+                           known->priority != broker.priority;
+            *known = broker;
+            if (changed)
+                changes.push_back({static_cast<uint8_t>(i), BROKER_UPDATED});
+        }
+
+        etl::stable_sort(m_brokers.begin(), m_brokers.end(), [](const mdns_broker_t &a, const mdns_broker_t &b)
+                         { return a.priority < b.priority; });
+    }
+
+    for (const change_t &change : changes)
+        notify(change.change == BROKER_REMOVED ? m_removed[change.index] : found[change.index], change.change);
+}
+
+void MdnsDiscovery::notify(const mdns_broker_t &broker, eChange change)
+{
+    static constexpr const char *NAMES[] = {"added", "updated", "removed"};
+    ESPARRAG_LOG_INFO("broker %s " IPSTR ":%d %s", broker.instance, IP2STR(&broker.address), broker.port, NAMES[change]);
+    for (broker_change_callback &listener : m_listeners)
+        listener(broker, change);
+}
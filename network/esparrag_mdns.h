@@ -3,14 +3,100 @@
 
 #include "esparrag_common.h"
 #include "esparrag_result.h"
+#include "esparrag_time_units.h"
+#include "mdns.h"
+#include "lwip/ip4_addr.h"
+#include "etl/delegate.h"
+#include "etl/vector.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <mutex>
+
+struct mdns_broker_t
+{
+    char instance[MDNS_NAME_BUF_LEN];
+    char hostname[MDNS_NAME_BUF_LEN];
+    ip4_addr_t address;
+    uint16_t port;
+    // from the broker's "priority" txt item, lower is preferred like dns SRV records
+    uint8_t priority;
+    int64_t expiresUs;
+};
 
 class Mdns
 {
 public:
+    static constexpr int BROKERS_MAX_NUM = 4;
+    static constexpr int QUERY_TIMEOUT_MS = 1500;
+    using brokers_t = etl::vector<mdns_broker_t, BROKERS_MAX_NUM>;
+
     static bool Init();
     static eResult AdvertiseMqtt();
     static eResult AdvertiseESPNOW();
-    static EsparragResult<const char*> FindBroker();
+    // blocks for a whole query, MdnsDiscovery keeps the answer without waiting
+    static EsparragResult<mdns_broker_t> FindBroker();
+    // every _mqtt._tcp instance with an ipv4 address, sorted by priority
+    static eResult QueryBrokers(brokers_t &brokers, MilliSeconds timeout = QUERY_TIMEOUT_MS);
+};
+
+/*
+    Keeps the _mqtt._tcp brokers on the network, queried by a background task,
+    so lookups are served from memory. Brokers are kept until their ttl passes without
+    being seen again. Listeners hear about added, changed and removed brokers on the
+    discovery task, e.g. to fail over as soon as a broker goes away.
+
+    MdnsDiscovery discovery;
+    discovery.OnChange(MdnsDiscovery::broker_change_callback::create<App, &App::onBroker>(app));
+    discovery.Start(); // after Mdns::Init
+    mdns_broker_t broker;
+    if (discovery.Best(broker))
+        ...
+*/
+class MdnsDiscovery
+{
+public:
+    enum eChange : uint8_t
+    {
+        BROKER_ADDED,
+        BROKER_UPDATED,
+        BROKER_REMOVED,
+    };
+
+    using broker_change_callback = etl::delegate<void(const mdns_broker_t &broker, eChange change)>;
+
+    static constexpr int LISTENERS_MAX_NUM = 4;
+    // queries come often until a broker is found
+    static constexpr int SEARCH_PERIOD_MS = 5000;
+    static constexpr int REFRESH_PERIOD_MS = 30000;
+    // mdns_result_t has no ttl before idf 5.0, 120 s is the mdns default for service records
+    static constexpr int DEFAULT_TTL_SEC = 120;
+    static constexpr int DISCOVERY_TASK_PRIORITY = 1;
+    static constexpr int DISCOVERY_TASK_STACK_SIZE = 4096;
+    static constexpr const char *DISCOVERY_TASK_NAME = "mdnsTask@esparrag";
+
+    // before Start
+    void OnChange(broker_change_callback callback);
+    eResult Start();
+    // query now instead of waiting for the period, e.g. after a broker stopped answering
+    void Refresh();
+
+    // lowest priority value, then the one seen first
+    bool Best(mdns_broker_t &broker);
+    Mdns::brokers_t Brokers();
+    bool Empty();
+
+private:
+    Mdns::brokers_t m_brokers;
+    std::mutex m_mutex;
+    etl::vector<broker_change_callback, LISTENERS_MAX_NUM> m_listeners;
+    TaskHandle_t m_task = nullptr;
+    // only touched by the discovery task, a few hundred bytes each kept off its stack
+    Mdns::brokers_t m_found;
+    Mdns::brokers_t m_removed;
+
+    void update();
+    void notify(const mdns_broker_t &broker, eChange change);
+    static void discoveryTask(void *arg);
 };
 
 #endif
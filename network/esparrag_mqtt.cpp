@@ -1,13 +1,23 @@
 #include "esparrag_mqtt.h"
 #include "esparrag_log.h"
 #include "esparrag_mdns.h"
-#include "lock.h"
+#include "esparrag_cbor.h"
+#include "esp_timer.h"
+#include "etl/algorithm.h"
 
 using namespace MqttFSM;
 
-char MqttClient::m_payload[PAYLOAD_BUFFER_SIZE]{};
-char MqttClient::m_topic[TOPIC_BUFFER_SIZE]{};
-char EVENT_CONNECT::m_brokerIp[EVENT_CONNECT::MQTT_BROKER_IP_SIZE]{};
+static int lowestBit(uint32_t mask)
+{
+    return __builtin_ctz(mask);
+}
+
+static bool isCborTopic(const char *topic)
+{
+    size_t len = strlen(topic);
+    size_t suffixLen = strlen(MqttClient::CBOR_TOPIC_SUFFIX);
+    return len >= suffixLen && strcmp(topic + len - suffixLen, MqttClient::CBOR_TOPIC_SUFFIX) == 0;
+}
 
 //===============================EVENT HANDLER ==================================================
 
@@ -28,25 +38,22 @@ void MqttClient::mqttEventHandler(void *arg, esp_event_base_t event_base, int32_
         client->Dispatch(EVENT_DISCONNECTED{});
         break;
     case MQTT_EVENT_SUBSCRIBED:
+    {
         ESPARRAG_LOG_INFO("MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-        client->Dispatch(EVENT_SUBSCRIBED{});
+        /*  each subscribe carries one topic, so its SUBACK has a single return code. 0x80 is a rejection.
+            esp-mqtt versions that don't pass the codes on report only granted subscribes as SUBSCRIBED */
+        uint8_t code = event->data_len > 0 ? static_cast<uint8_t>(event->data[0]) : 0;
+        client->Dispatch(EVENT_SUBSCRIBED{.msgId = event->msg_id, .returnCode = code});
         break;
+    }
     case MQTT_EVENT_UNSUBSCRIBED:
         ESPARRAG_LOG_INFO("MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        client->Dispatch(EVENT_PUBLISHED{});
+        client->Dispatch(EVENT_PUBLISHED{.msgId = event->msg_id});
         break;
     case MQTT_EVENT_DATA:
-        {
-            Lock lock(client->m_dataMutex);
-            memset(m_topic, 0, sizeof(m_topic));
-            memset(m_payload, 0, sizeof(m_payload));
-            strlcpy(m_topic, event->topic, event->topic_len + 1);
-            strlcpy(m_payload, event->data, event->data_len + 1);
-        } 
-
-        client->Dispatch(EVENT_INCOMING_DATA{});
+        client->receiveData(event);
         break;
     case MQTT_EVENT_ERROR:
         client->Dispatch(EVENT_ERROR{});
@@ -61,39 +68,182 @@ void MqttClient::mqttEventHandler(void *arg, esp_event_base_t event_base, int32_
 //===============================PUBLIC METHODS ==================================================
 //===============================================================================================
 
-MqttClient::MqttClient() : FsmTask(MQTT_TASK_STACK_SIZE, MQTT_TASK_PRIORITY, MQTT_TASK_NAME, MQTT_TASK_QUEUE_LENGTH) {}
+MqttClient::MqttClient() : FsmTask(MQTT_TASK_STACK_SIZE, MQTT_TASK_PRIORITY, MQTT_TASK_NAME, MQTT_TASK_QUEUE_LENGTH)
+{
+    for (auto &topic : m_cborTopics)
+        topic = MqttTopics::INVALID_TOPIC;
+}
 
 void MqttClient::Init()
 {
-    m_dataMutex = xSemaphoreCreateMutex();
+    m_inboundFree = xQueueCreate(INBOUND_SLOTS_NUM, sizeof(uint8_t));
+    ESPARRAG_ASSERT(m_inboundFree);
+    for (uint8_t i = 0; i < INBOUND_SLOTS_NUM; i++)
+        xQueueSend(m_inboundFree, &i, 0);
+
+    m_publishQueue.Init(m_topicNames);
+    if (m_spool.Init() != eResult::SUCCESS)
+        ESPARRAG_LOG_WARNING("mqtt spool unavailable, messages are kept in ram only");
+
+    m_replayTimer = xTimerCreate("mqtt_replay", pdMS_TO_TICKS(SPOOL_REPLAY_PERIOD_MS), pdTRUE, this, replayTimerCB);
+    m_sweepTimer = xTimerCreate("mqtt_sweep", pdMS_TO_TICKS(INFLIGHT_SWEEP_PERIOD_MS), pdTRUE, this, sweepTimerCB);
+    m_reconnectTimer = xTimerCreate("mqtt_reconnect", 1, pdFALSE, this, reconnectTimerCB);
+    m_publishRetryTimer = xTimerCreate("mqtt_pub_retry", pdMS_TO_TICKS(PUBLISH_RETRY_MS), pdFALSE, this, publishRetryTimerCB);
+    ESPARRAG_ASSERT(m_replayTimer && m_sweepTimer && m_reconnectTimer && m_publishRetryTimer);
     Start(STATE_DISABLED{});
 }
 
-void MqttClient::On(const char *topic, mqtt_handler_callback callback)
+eResult MqttClient::On(const char *topic, mqtt_handler_callback callback, uint8_t qos)
 {
-    ESPARRAG_ASSERT(m_handlers.size() != m_handlers.capacity());
-    ESPARRAG_ASSERT(callback);
-    mqtt_event_handler_t handler{.cb = callback, .topic = constructFullTopic(topic), .isSubscribed = false};
+    if (!topic || !callback.is_valid() || qos > 2)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    if (handlersNum() == HANDLERS_MAX_NUM)
+    {
+        ESPARRAG_LOG_ERROR("mqtt handlers full, %s not subscribed", topic);
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
+
+    mqtt_event_handler_t handler{.cb = callback, .topic = m_topicNames.Intern(topic), .isSubscribed = false, .qos = qos};
+    if (handler.topic == MqttTopics::INVALID_TOPIC)
+    {
+        ESPARRAG_LOG_ERROR("mqtt topic %s is too long or the topic table is full", topic);
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
+
+    // the mqtt task matches and subscribes while other tasks register
+    bool full = false;
+    bool inserted = false;
+    portENTER_CRITICAL(&m_handlersLock);
+    full = m_handlers.full();
+    // nodes added before a failing level stay in the trie without ids, they never match
+    inserted = !full && m_topics.Insert(m_topicNames.Get(handler.topic), m_handlers.size());
+    if (inserted)
+    {
+        m_handlers.push_back(handler);
+        m_handlersNum.store(m_handlers.size(), std::memory_order_release);
+    }
+    portEXIT_CRITICAL(&m_handlersLock);
+
+    if (full)
+    {
+        ESPARRAG_LOG_ERROR("mqtt handlers full, %s not subscribed", topic);
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
+
+    if (!inserted)
+    {
+        ESPARRAG_LOG_ERROR("mqtt topic %s has a level over %d chars, a misplaced wildcard or the trie is full",
+                           m_topicNames.Get(handler.topic), TopicTrie::LEVEL_MAX_LEN);
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
 
+    // subscribed from the mqtt task, together with any other new handler
     if (IsInState<STATE_CONNECTED>())
+        Dispatch(EVENT_SUBSCRIBE{});
+
+    return eResult::SUCCESS;
+}
+
+bool MqttClient::Defer(deferred_callback callback)
+{
+    if (!callback.is_valid())
+        return false;
+
+    return Dispatch(EVENT_DEFERRED{.callback = callback});
+}
+
+ePublishResult MqttClient::Publish(topic_handle_t topic, cJSON *msg, const publish_options_t &options)
+{
+    // an unknown handle is dropped by the queue
+    if (!m_topicNames.IsValid(topic))
+        topic = MqttTopics::INVALID_TOPIC;
+    else if (options.cbor)
+        topic = cborTopic(topic);
+
+    ePublishResult result = m_publishQueue.Push(topic, msg, options);
+    if (result != ePublishResult::QUEUED)
+        return result;
+
+    // one wakeup drains whatever was queued until it runs
+    if (!m_publishPending.exchange(true) && !Dispatch(EVENT_PUBLISH{}))
+        m_publishPending = false;
+
+    return result;
+}
+
+void MqttClient::ConfigureQos(const qos_config_t &config)
+{
+    // the window leaves slots for qos 0 traffic
+    ESPARRAG_ASSERT(config.window > 0 && config.window < PublishQueue::SLOTS_NUM);
+    m_qosConfig = config;
+}
+
+eResult MqttClient::AddBroker(const char *host, uint16_t port, MqttBrokers::eSource source, uint8_t priority)
+{
+    if (!host || strlen(host) == 0 || strlen(host) > MqttBrokers::HOST_MAX_LEN)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    if (m_brokers.Add(host, port, source, priority) == MqttBrokers::INVALID_BROKER)
     {
-        if (subscribe(constructFullTopic(topic)))
-        {
-            handler.isSubscribed = true;
-        }
+        ESPARRAG_LOG_ERROR("no room for mqtt broker %s", host);
+        return eResult::ERROR_CONFIG_LIMITS;
     }
 
-    m_handlers.push_back(handler);
+    // a new candidate may end a reconnect backoff
+    if (IsInState<STATE_CONNECTING>())
+        Dispatch(EVENT_BROKERS_CHANGED{});
+
+    return eResult::SUCCESS;
 }
 
-eResult MqttClient::Publish(const char *topic, cJSON *msg)
+eResult MqttClient::RemoveBroker(const char *host, MqttBrokers::eSource source)
 {
-    Dispatch(EVENT_PUBLISH{.topic = topic, .payload = msg});
+    if (!m_brokers.Remove(host, source))
+        return eResult::ERROR_NOT_FOUND;
+
+    if (IsInState<STATE_CONNECTING>())
+        Dispatch(EVENT_BROKERS_CHANGED{});
+
     return eResult::SUCCESS;
 }
 
+// runs on the discovery task
+void MqttClient::OnBrokerChange(const mdns_broker_t &broker, MdnsDiscovery::eChange change)
+{
+    if (change == MdnsDiscovery::BROKER_REMOVED)
+    {
+        m_brokers.Remove(broker.instance, MqttBrokers::SOURCE_MDNS);
+    }
+    else
+    {
+        char ip[IP4ADDR_STRLEN_MAX];
+        ip4addr_ntoa_r(&broker.address, ip, sizeof(ip));
+        if (m_brokers.Add(ip, broker.port, MqttBrokers::SOURCE_MDNS, broker.priority, broker.instance) == MqttBrokers::INVALID_BROKER)
+            ESPARRAG_LOG_WARNING("no room for mdns broker %s", broker.instance);
+    }
+
+    if (IsInState<STATE_CONNECTING>())
+        Dispatch(EVENT_BROKERS_CHANGED{});
+}
+
 eResult MqttClient::TryConnect(const char* brokerIp) {
 
+    if (!brokerIp || strlen(brokerIp) == 0)
+    {
+        ESPARRAG_LOG_ERROR("mqtt ip not set");
+        return eResult::ERROR_INVALID_STATE;
+    }
+
+    eResult res = AddBroker(brokerIp);
+    if (res != eResult::SUCCESS)
+        return res;
+
+    return Connect();
+}
+
+eResult MqttClient::Connect() {
+
     if (IsInState<STATE_CONNECTING>())
     {
         ESPARRAG_LOG_INFO("mqtt already connecting");
@@ -106,14 +256,14 @@ eResult MqttClient::TryConnect(const char* brokerIp) {
         return eResult::SUCCESS;
     }
 
-    if (!brokerIp || strlen(brokerIp) == 0)
+    uint8_t broker = m_brokers.Best();
+    if (broker == MqttBrokers::INVALID_BROKER)
     {
-        ESPARRAG_LOG_ERROR("mqtt ip not set");
+        ESPARRAG_LOG_ERROR("no mqtt broker to connect to");
         return eResult::ERROR_INVALID_STATE;
     }
 
-
-    Dispatch(EVENT_CONNECT(brokerIp));
+    Dispatch(EVENT_CONNECT{.broker = broker});
     return eResult::SUCCESS;
 }
 
@@ -123,15 +273,36 @@ eResult MqttClient::TryConnect(const char* brokerIp) {
 void MqttClient::on_entry(STATE_DISABLED& state) {
     ESPARRAG_LOG_INFO("entered %s", state.NAME);
 
+    xTimerStop(m_replayTimer, 0);
+    xTimerStop(m_sweepTimer, 0);
+    xTimerStop(m_reconnectTimer, 0);
+    xTimerStop(m_publishRetryTimer, 0);
+    m_resolving = NOT_RESOLVING;
 }
 void MqttClient::on_entry(STATE_CONNECTING& state) {
     ESPARRAG_LOG_INFO("entered %s", state.NAME);
 
+    xTimerStop(m_replayTimer, 0);
+    xTimerStop(m_sweepTimer, 0);
+    xTimerStop(m_publishRetryTimer, 0);
 }
 void MqttClient::on_entry(STATE_CONNECTED& state) {
     ESPARRAG_LOG_INFO("entered %s", state.NAME);
 
+    xTimerStop(m_reconnectTimer, 0);
+    m_reconnect.OnSuccess();
+    m_brokers.OnConnected(m_broker, m_brokerGeneration, MilliSeconds((esp_timer_get_time() - m_attemptStartUs) / 1000));
+    m_attemptStartUs = 0;
     reSubscribe();
+    // unacked messages are sent again by esp-mqtt from its outbox, under their msg ids
+    xTimerStart(m_sweepTimer, 0);
+    if (m_spool.Pending() > 0)
+    {
+        ESPARRAG_LOG_INFO("replaying %d spooled messages", m_spool.Pending());
+        xTimerStart(m_replayTimer, 0);
+    }
+
+    flushPublishQueue();
 }
 
 
@@ -146,7 +317,7 @@ using return_state_t = MqttClient::return_state_t;
 return_state_t MqttClient::on_event(STATE_DISABLED &state, EVENT_CONNECT &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
-    return connect(EVENT_CONNECT::m_brokerIp) == true ? return_state_t {STATE_CONNECTING{}} : std::nullopt;
+    return connect(event.broker) == true ? return_state_t {STATE_CONNECTING{}} : std::nullopt;
 }
 
 return_state_t MqttClient::on_event(STATE_DISABLED &state, EVENT_BEFORE_CONNECT &event) {
@@ -154,8 +325,25 @@ return_state_t MqttClient::on_event(STATE_DISABLED &state, EVENT_BEFORE_CONNECT
 
     return STATE_CONNECTING{};
 }
+
+return_state_t MqttClient::on_event(STATE_DISABLED &state, EVENT_INCOMING_DATA &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // received just before the connection dropped, still deliver it and free its slot
+    handleData(event.slot);
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_DISABLED &state, EVENT_PUBLISH &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // kept in the flash spool while disconnected, ram slots stay free for new messages
+    m_publishPending = false;
+    spillPublishQueue();
+    return std::nullopt;
+}
     
-// STATE_DISABLED
+// STATE_CONNECTING
 
 return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_CONNECTED &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
@@ -166,6 +354,12 @@ return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_CONNECTED &ev
 return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_DISCONNECTED &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    // no attempt running when a dropped connection reports its disconnect
+    if (m_attemptStartUs != 0)
+        m_brokers.OnFailure(m_broker, m_brokerGeneration);
+
+    m_attemptStartUs = 0;
+    scheduleReconnect();
     return std::nullopt;
 }
 
@@ -175,58 +369,175 @@ return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_ERROR &event)
     return std::nullopt;
 }
 
+return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_RECONNECT &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    reconnect();
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_BROKERS_CHANGED &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // a healthy new candidate cuts the backoff short, an attempt in progress is left to finish
+    uint8_t best = m_brokers.Best();
+    bool backingOff = xTimerIsTimerActive(m_reconnectTimer) == pdTRUE;
+    if (m_awaitingBroker || (backingOff && best != m_broker && m_brokers.IsHealthy(best)))
+    {
+        xTimerStop(m_reconnectTimer, 0);
+        reconnect();
+    }
+
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_DNS_RESOLVED &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // the token names the candidate and its generation, anything else is stale
+    if (event.token != m_resolving)
+        return std::nullopt;
+
+    m_resolving = NOT_RESOLVING;
+    xTimerStop(m_reconnectTimer, 0);
+    MqttBrokers::broker_t candidate;
+    if (!m_brokers.Get(m_broker, candidate) || candidate.generation != m_brokerGeneration)
+    {
+        // removed or replaced while resolving
+        reconnect();
+        return std::nullopt;
+    }
+
+    if (!event.found)
+    {
+        ESPARRAG_LOG_WARNING("mqtt broker %s not resolved", candidate.host);
+        m_reconnect.OnAttempt();
+        m_brokers.OnFailure(m_broker, m_brokerGeneration);
+        scheduleReconnect();
+        return std::nullopt;
+    }
+
+    char ip[IP4ADDR_STRLEN_MAX];
+    char uri[URI_MAX_LEN];
+    ip4addr_ntoa_r(&event.address, ip, sizeof(ip));
+    snprintf(uri, sizeof(uri), "mqtt://%s:%u", ip, candidate.port);
+    ESPARRAG_LOG_INFO("mqtt broker %s resolved to %s", candidate.host, ip);
+    attempt(uri);
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_INCOMING_DATA &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // received just before the connection dropped, still deliver it and free its slot
+    handleData(event.slot);
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_CONNECTING &state, EVENT_PUBLISH &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    // kept in the flash spool while disconnected, ram slots stay free for new messages
+    m_publishPending = false;
+    spillPublishQueue();
+    return std::nullopt;
+}
+
 // STATE_CONNECTED
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_SUBSCRIBE &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    subscribePending();
     return std::nullopt;
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_SUBSCRIBED &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    auto pending = etl::find_if(m_pendingSubscribes.begin(), m_pendingSubscribes.end(),
+                                [&](const pending_subscribe_t &p) { return p.msgId == event.msgId; });
+    if (pending == m_pendingSubscribes.end())
+        return std::nullopt;
+
+    for (size_t i = 0; i < handlersNum(); i++)
+    {
+        if (pending->handlers & (1u << i))
+        {
+            // a rejected topic is retried after the next reconnect
+            bool failed = event.returnCode & SUBACK_FAILURE;
+            m_handlers[i].isSubscribed = !failed;
+            if (failed)
+                ESPARRAG_LOG_ERROR("broker rejected subscription to %s", m_topicNames.Get(m_handlers[i].topic));
+        }
+    }
+
+    m_pendingSubscribes.erase(pending);
+    if (m_pendingSubscribes.empty())
+        ESPARRAG_LOG_INFO("subscriptions ready after %lld ms", (esp_timer_get_time() - m_subscribeStartUs) / 1000);
+
     return std::nullopt;
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_PUBLISH &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
-    memset(m_payload, 0, sizeof(m_payload));
-    bool printed = cJSON_PrintPreallocated(event.payload, m_payload, PAYLOAD_BUFFER_SIZE, false);
-    if (!printed)
-    {
-        ESPARRAG_LOG_ERROR("mqtt publish buffer too small");
-    } else {
-        publish(constructFullTopic(event.topic), m_payload);
-    }
+    flushPublishQueue();
+    return std::nullopt;
+}
 
+return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_SPOOL_REPLAY &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
-    cJSON_Delete(event.payload);
+    replaySpool();
     return std::nullopt;
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_PUBLISHED &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    for (size_t i = 0; i < m_inflight.size(); i++)
+    {
+        if (m_inflight[i].msgId == event.msgId)
+        {
+            completeInflight(i, eDelivery::DELIVERED);
+            // the window has room again
+            flushPublishQueue();
+            break;
+        }
+    }
+
+    return std::nullopt;
+}
+
+return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_INFLIGHT_SWEEP &event) {
+    ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
+
+    expireInflight(static_cast<int64_t>(m_qosConfig.ackTimeout.value()) * 1000);
+    if (m_inflight.size() < m_qosConfig.window)
+        flushPublishQueue();
+
     return std::nullopt;
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_ERROR &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    m_brokers.OnDrop(m_broker, m_brokerGeneration);
     return STATE_CONNECTING{};
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_DISCONNECTED &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
 
+    m_brokers.OnDrop(m_broker, m_brokerGeneration);
+    scheduleReconnect();
     return STATE_CONNECTING{};
 }
 
 return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_INCOMING_DATA &event) {
     ESPARRAG_LOG_DEBUG("%s got %s", state.NAME, event.NAME);
-    handleData();
+    handleData(event.slot);
 
     return std::nullopt;
 }
@@ -234,74 +545,398 @@ return_state_t MqttClient::on_event(STATE_CONNECTED &state, EVENT_INCOMING_DATA
 
 //===============================================================================================
 
-void MqttClient::handleData()
+// runs on the esp-mqtt task. a message larger than the client buffer comes in several events,
+// the first one carries the topic and every one its offset in the whole payload
+void MqttClient::receiveData(esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset == 0)
+    {
+        // a message still assembling here lost its tail
+        if (m_inboundAssembling >= 0)
+        {
+            uint8_t slot = m_inboundAssembling;
+            xQueueSend(m_inboundFree, &slot, 0);
+            m_inboundDropped++;
+        }
+
+        m_inboundAssembling = -1;
+        uint8_t slot = 0;
+        if (event->total_data_len > INBOUND_PAYLOAD_MAX_SIZE || event->topic_len >= TOPIC_BUFFER_SIZE)
+        {
+            ESPARRAG_LOG_ERROR("mqtt message of %d bytes is too large, dropped", event->total_data_len);
+            m_inboundDropped++;
+            return;
+        }
+
+        if (xQueueReceive(m_inboundFree, &slot, 0) != pdTRUE)
+        {
+            ESPARRAG_LOG_WARNING("mqtt inbound buffers full, message dropped (%d so far)", ++m_inboundDropped);
+            return;
+        }
+
+        inbound_message_t &message = m_inbound[slot];
+        memcpy(message.topic, event->topic, event->topic_len);
+        message.topic[event->topic_len] = '\0';
+        message.len = event->total_data_len;
+        m_inboundAssembling = slot;
+    }
+
+    // fragments of a dropped message are skipped
+    if (m_inboundAssembling < 0)
+        return;
+
+    uint8_t slot = m_inboundAssembling;
+    inbound_message_t &message = m_inbound[slot];
+    if (event->current_data_offset + event->data_len > message.len)
+    {
+        ESPARRAG_LOG_ERROR("mqtt fragment out of bounds, message dropped");
+        xQueueSend(m_inboundFree, &slot, 0);
+        m_inboundAssembling = -1;
+        m_inboundDropped++;
+        return;
+    }
+
+    memcpy(message.payload + event->current_data_offset, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len < message.len)
+        return;
+
+    // payloads may be binary cbor, the terminator is only for json text
+    message.payload[message.len] = '\0';
+    m_inboundAssembling = -1;
+    if (!Dispatch(EVENT_INCOMING_DATA{.slot = slot}))
+    {
+        ESPARRAG_LOG_WARNING("mqtt event queue full, message dropped");
+        xQueueSend(m_inboundFree, &slot, 0);
+        m_inboundDropped++;
+    }
+}
+
+void MqttClient::handleData(uint8_t slot)
 {
-    Lock lock(m_dataMutex);
-    mqtt_event_handler_t *handler = findHandler(m_topic);
-    if (!handler)
+    inbound_message_t &message = m_inbound[slot];
+    ESPARRAG_LOG_INFO("recieved topic: %s", message.topic);
+    portENTER_CRITICAL(&m_handlersLock);
+    uint32_t handlerIds = m_topics.Match(message.topic);
+    portEXIT_CRITICAL(&m_handlersLock);
+    if (handlerIds == 0)
     {
-        ESPARRAG_LOG_ERROR("no handler for topic %s", m_topic);
+        ESPARRAG_LOG_ERROR("no handler for topic %s", message.topic);
+        xQueueSend(m_inboundFree, &slot, 0);
         return;
     }
 
-    // --handle request
-    cJSON *jsonPayload = cJSON_Parse(m_payload);
+    // --handle request, cbor comes on a CBOR_TOPIC_SUFFIX topic or starts with a map or array head.
+    // a payload that doesn't decode as a whole is parsed as json text
+    cJSON *jsonPayload = nullptr;
+    const uint8_t *payload = reinterpret_cast<const uint8_t *>(message.payload);
+    if (isCborTopic(message.topic) || CborReader::IsCbor(payload, message.len))
+        jsonPayload = CborReader(payload, message.len).ToJson();
+    if (jsonPayload == nullptr)
+        jsonPayload = cJSON_Parse(message.payload);
+
     if (jsonPayload == nullptr)
     {
         ESPARRAG_LOG_WARNING("mqtt payload is not a valid json, reformatting");
         jsonPayload = cJSON_CreateObject();
-        cJSON_AddStringToObject(jsonPayload, "payload", m_payload);
+        cJSON_AddStringToObject(jsonPayload, "payload", message.payload);
     }
 
+    // every matched id was published with its handler
+    for (uint32_t ids = handlerIds; ids; ids &= ids - 1)
+        m_handlers[lowestBit(ids)].cb(message.topic, jsonPayload);
 
-    handler->cb(m_topic, jsonPayload);
+    cJSON_Delete(jsonPayload);
+    xQueueSend(m_inboundFree, &slot, 0);
 }
 
-eResult MqttClient::publish(const char *topic, const char *payload)
+int MqttClient::publish(const char *topic, const char *payload, size_t len, uint8_t qos)
 {
-    int err = esp_mqtt_client_publish(m_client, topic, payload, strlen(payload), 0, false);
-    if (err == -1)
+    int msgId = esp_mqtt_client_publish(m_client, topic, payload, len, qos, false);
+    if (msgId == -1)
     {
         ESPARRAG_LOG_ERROR("mqtt publish failed");
-        return eResult::ERROR_GENERAL;
     }
 
-    return eResult::SUCCESS;
+    return msgId;
 }
 
-MqttClient::mqtt_event_handler_t *MqttClient::findHandler(const char *topic)
+void MqttClient::flushPublishQueue()
 {
-    ESPARRAG_LOG_INFO("recieved topic: %s", topic);
-    for (size_t i = 0; i < m_handlers.size(); i++)
+    m_publishPending = false;
+
+    // newer messages wait behind the spooled ones to keep the order
+    if (m_spool.Pending() > 0)
     {
-        if (m_handlers[i].topic == topic)
+        spillPublishQueue();
+        return;
+    }
+
+    for (int i = 0; i < PUBLISH_BATCH_MAX; i++)
+    {
+        PublishQueue::message_t *message = m_publishQueue.Front();
+        if (!message)
+            return;
+
+        // keeps the order, the rest waits for an ack to free the window
+        if (message->qos > 0 && m_inflight.size() >= m_qosConfig.window)
+            return;
+
+        // a failed message stays at the front, it is retried shortly
+        int msgId = publish(m_topicNames.Get(message->topic), reinterpret_cast<const char *>(message->payload), message->len, message->qos);
+        if (msgId < 0)
         {
-            return &m_handlers[i];
+            xTimerStart(m_publishRetryTimer, 0);
+            return;
         }
+
+        if (message->qos == 0)
+        {
+            m_publishQueue.Pop();
+            continue;
+        }
+
+        m_inflight.push_back({.msgId = msgId, .slot = m_publishQueue.Detach(), .sentUs = esp_timer_get_time()});
     }
 
-    return nullptr;
+    // more left, let other events in before the next batch
+    if (m_publishQueue.Size() > 0 && !m_publishPending.exchange(true) && !Dispatch(EVENT_PUBLISH{}))
+        m_publishPending = false;
 }
 
-bool MqttClient::connect(const char* brokerIP)
+void MqttClient::spillPublishQueue()
 {
-    constexpr int MQTT_PORT = 1883;
-    esp_mqtt_client_config_t config{};
-    char mqttHost[50]{};
+    if (!m_spool.IsInitialized())
+        return;
+
+    for (PublishQueue::message_t *message = m_publishQueue.Front(); message; message = m_publishQueue.Front())
+    {
+        if (m_spool.Append(m_topicNames.Get(message->topic), *message) != eResult::SUCCESS)
+            return;
+
+        if (message->onComplete.is_valid())
+            message->onComplete(m_topicNames.Get(message->topic), eDelivery::SPOOLED);
+
+        m_publishQueue.Pop();
+    }
+}
+
+void MqttClient::replaySpool()
+{
+    static MqttSpool::spooled_message_t message;
+
+    for (int i = 0; i < SPOOL_REPLAY_BATCH; i++)
+    {
+        if (m_spool.Peek(message) != eResult::SUCCESS)
+            break;
+
+        if (publish(message.topic, reinterpret_cast<const char *>(message.payload), message.len, message.qos) < 0)
+            return;
+
+        m_spool.Pop();
+    }
+
+    if (m_spool.Pending() == 0)
+    {
+        ESPARRAG_LOG_INFO("mqtt spool replayed, %d messages lost", m_spool.Lost());
+        xTimerStop(m_replayTimer, 0);
+        flushPublishQueue();
+    }
+}
+
+// resending is left to esp-mqtt, a new publish would get a new msg id and its PUBACK would never match
+void MqttClient::expireInflight(int64_t olderThanUs)
+{
+    int64_t now = esp_timer_get_time();
+    for (size_t i = 0; i < m_inflight.size();)
+    {
+        if (now - m_inflight[i].sentUs >= olderThanUs)
+            completeInflight(i, eDelivery::TIMEOUT);
+        else
+            i++;
+    }
+}
+
+void MqttClient::completeInflight(size_t index, eDelivery delivery)
+{
+    uint8_t slot = m_inflight[index].slot;
+    PublishQueue::message_t &message = m_publishQueue.Slot(slot);
+    if (delivery == eDelivery::TIMEOUT)
+        ESPARRAG_LOG_WARNING("mqtt message to %s not acknowledged in %u ms", m_topicNames.Get(message.topic), m_qosConfig.ackTimeout.value());
+
+    if (message.onComplete.is_valid())
+        message.onComplete(m_topicNames.Get(message.topic), delivery);
+
+    m_publishQueue.Release(slot);
+    m_inflight.erase(m_inflight.begin() + index);
+}
+
+void MqttClient::sweepTimerCB(TimerHandle_t timer)
+{
+    MqttClient *client = reinterpret_cast<MqttClient *>(pvTimerGetTimerID(timer));
+    client->Dispatch(EVENT_INFLIGHT_SWEEP{});
+}
+
+void MqttClient::scheduleReconnect()
+{
+    // a failure already waiting for its retry is not counted twice
+    if (xTimerIsTimerActive(m_reconnectTimer) == pdTRUE)
+        return;
+
+    MilliSeconds delay = m_reconnect.OnFailure();
+    // a candidate that hasn't failed is tried right away, the backoff is for when they all did
+    uint8_t best = m_brokers.Best();
+    if (best != m_broker && m_brokers.IsHealthy(best))
+        delay = MilliSeconds(FAILOVER_DELAY_MS);
+
+    const ReconnectPolicy::reconnect_stats_t &stats = m_reconnect.Stats();
+    ESPARRAG_LOG_INFO("mqtt reconnect in %u ms, %u failures in a row, breaker %s",
+                      delay.value(), stats.consecutiveFailures, ReconnectPolicy::StateName(stats.state));
+
+    xTimerChangePeriod(m_reconnectTimer, etl::max<TickType_t>(delay.toTicks(), 1), 0);
+}
+
+// the best candidate may differ from the last one, esp-mqtt keeps the session state across a new uri
+void MqttClient::reconnect()
+{
+    uint8_t best = m_brokers.Best();
+    uint8_t previous = m_broker;
+    MqttBrokers::broker_t candidate;
+    if (!selectBroker(best, candidate))
+    {
+        ESPARRAG_LOG_WARNING("no mqtt broker to reconnect to");
+        m_awaitingBroker = true;
+        return;
+    }
+
+    m_awaitingBroker = false;
+
+    char uri[URI_MAX_LEN];
+    brokerUri(candidate, uri, sizeof(uri));
+    if (best != previous)
+        ESPARRAG_LOG_INFO("mqtt failing over to %s, score %u", uri, m_brokers.Score(best));
+
+    if (!resolveBroker(candidate))
+        attempt(uri);
+}
+
+// the first attempt may still need its client, when it waited for a name to resolve
+void MqttClient::attempt(const char *uri)
+{
+    m_reconnect.OnAttempt();
+    esp_err_t err = ESP_FAIL;
+    if (!m_client)
+    {
+        err = createClient(uri) ? ESP_OK : ESP_FAIL;
+    }
+    else
+    {
+        m_attemptStartUs = esp_timer_get_time();
+        err = esp_mqtt_client_set_uri(m_client, uri);
+        if (err == ESP_OK)
+            err = esp_mqtt_client_reconnect(m_client);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("mqtt reconnect failed %d", err);
+        m_brokers.OnFailure(m_broker, m_brokerGeneration);
+        m_attemptStartUs = 0;
+        scheduleReconnect();
+    }
+}
+
+void MqttClient::reconnectTimerCB(TimerHandle_t timer)
+{
+    MqttClient *client = reinterpret_cast<MqttClient *>(pvTimerGetTimerID(timer));
+    client->Dispatch(EVENT_RECONNECT{});
+}
+
+void MqttClient::publishRetryTimerCB(TimerHandle_t timer)
+{
+    MqttClient *client = reinterpret_cast<MqttClient *>(pvTimerGetTimerID(timer));
+    if (!client->m_publishPending.exchange(true) && !client->Dispatch(EVENT_PUBLISH{}))
+        client->m_publishPending = false;
+}
+
+void MqttClient::replayTimerCB(TimerHandle_t timer)
+{
+    MqttClient *client = reinterpret_cast<MqttClient *>(pvTimerGetTimerID(timer));
+    client->Dispatch(EVENT_SPOOL_REPLAY{});
+}
+
+bool MqttClient::selectBroker(uint8_t broker, MqttBrokers::broker_t &candidate)
+{
+    if (!m_brokers.Get(broker, candidate))
+        return false;
+
+    m_broker = broker;
+    m_brokerGeneration = candidate.generation;
+    return true;
+}
+
+void MqttClient::brokerUri(const MqttBrokers::broker_t &candidate, char *uri, size_t size)
+{
+    snprintf(uri, size, "mqtt://%s:%u", candidate.host, candidate.port);
+}
+
+bool MqttClient::resolveBroker(const MqttBrokers::broker_t &candidate)
+{
+    // a result still on its way for an earlier pick is stale from now on
+    m_resolving = NOT_RESOLVING;
+    if (!m_resolver || candidate.source != MqttBrokers::SOURCE_DNS)
+        return false;
+
+    // the token brings the candidate and its generation back with the result
+    m_resolving = static_cast<uint32_t>(candidate.generation) << 8 | m_broker;
+    if (m_resolver->ResolveAsync(candidate.host, *this, m_resolving) != eResult::SUCCESS)
+    {
+        ESPARRAG_LOG_WARNING("mqtt broker %s not queued for resolving, esp-mqtt resolves it", candidate.host);
+        m_resolving = NOT_RESOLVING;
+        return false;
+    }
+
+    // a result lost to a full event queue would stall the attempt, the reconnect timer starts over then
+    xTimerChangePeriod(m_reconnectTimer, pdMS_TO_TICKS(RESOLVE_TIMEOUT_MS), 0);
+    return true;
+}
+
+bool MqttClient::connect(uint8_t broker)
+{
+    char mqttHost[URI_MAX_LEN]{};
 
     if (m_client != nullptr)
     {
         return false;
     }
 
-    snprintf(mqttHost, sizeof(mqttHost), "mqtt://%s:%d", brokerIP, MQTT_PORT);
-    ESPARRAG_LOG_INFO("trying to connect to %s", mqttHost);
+    MqttBrokers::broker_t candidate;
+    if (!selectBroker(broker, candidate))
+    {
+        ESPARRAG_LOG_ERROR("mqtt broker %d was removed", broker);
+        return false;
+    }
+
+    brokerUri(candidate, mqttHost, sizeof(mqttHost));
+    // a host name is resolved first, the client is created once its address is known
+    if (resolveBroker(candidate))
+        return true;
+
+    return createClient(mqttHost);
+}
+
+bool MqttClient::createClient(const char *uri)
+{
+    esp_mqtt_client_config_t config{};
+
+    ESPARRAG_LOG_INFO("trying to connect to %s", uri);
+    m_attemptStartUs = esp_timer_get_time();
 
-    config.port = MQTT_PORT;
-    config.uri = mqttHost;
-    config.host = mqttHost;
+    // the uri carries host and port
+    config.uri = uri;
     config.client_id = DEVICE_NAME;
     config.username = DEVICE_NAME;
+    // reconnects are paced by m_reconnect instead of the fixed esp-mqtt timeout
+    config.disable_auto_reconnect = true;
 
     m_client = esp_mqtt_client_init(&config);
     if (!m_client)
@@ -328,27 +963,86 @@ bool MqttClient::connect(const char* brokerIP)
     return true;
 }
 
-const char *MqttClient::constructFullTopic(const char *topic)
+topic_handle_t MqttClient::cborTopic(topic_handle_t topic)
+{
+    topic_handle_t cbor = m_cborTopics[topic].load();
+    if (cbor != MqttTopics::INVALID_TOPIC)
+        return cbor;
+
+    const char *relative = m_topicNames.Get(topic) + sizeof(MqttTopics::PREFIX) - 1;
+    cbor = m_topicNames.Intern(relative, CBOR_TOPIC_SUFFIX);
+    m_cborTopics[topic] = cbor;
+    return cbor;
+}
+
+void MqttClient::subscribePending()
 {
-    static char buffer[TOPIC_BUFFER_SIZE];
+    ESPARRAG_ASSERT(IsInState<STATE_CONNECTED>());
+
+    uint32_t pending = 0;
+    for (const auto &p : m_pendingSubscribes)
+        pending |= p.handlers;
 
-    ESPARRAG_ASSERT(topic && strlen(topic) > 0);
-    ESPARRAG_ASSERT(topic[0] == '/');
+    // handlers sharing a topic are grouped under one subscription
+    uint32_t groups[SUBSCRIBE_BATCH_MAX];
+    size_t count = 0;
+    uint32_t grouped = 0;
+    for (size_t i = 0; i < handlersNum(); i++)
+    {
+        uint32_t bit = 1u << i;
+        if (m_handlers[i].isSubscribed || ((pending | grouped) & bit))
+            continue;
 
-    memset(buffer, 0, TOPIC_BUFFER_SIZE);
-    snprintf(buffer, TOPIC_BUFFER_SIZE, "/%s%s", DEVICE_NAME, topic);
+        uint32_t group = bit;
+        for (size_t j = i + 1; j < handlersNum(); j++)
+        {
+            if (!m_handlers[j].isSubscribed && !(pending & (1u << j)) && m_handlers[j].topic == m_handlers[i].topic)
+                group |= 1u << j;
+        }
 
-    return buffer;
+        grouped |= group;
+        groups[count++] = group;
+        if (count == SUBSCRIBE_BATCH_MAX)
+        {
+            if (!subscribe(groups, count))
+                return;
+
+            count = 0;
+        }
+    }
+
+    if (count > 0)
+        subscribe(groups, count);
 }
 
-bool MqttClient::subscribe(const char *topic)
+// handlers sharing a topic get the highest qos any of them asked for
+uint8_t MqttClient::groupQos(uint32_t group) const
 {
-    ESPARRAG_ASSERT(IsInState<STATE_CONNECTED>());
-    esp_err_t err = esp_mqtt_client_subscribe(m_client, topic, 0);
-    if (err == -1)
+    uint8_t qos = 0;
+    for (size_t i = 0; i < handlersNum(); i++)
     {
-        ESPARRAG_LOG_ERROR("subscribe failed, err %d", err);
-        return false;
+        if (group & (1u << i))
+            qos = etl::max(qos, m_handlers[i].qos);
+    }
+
+    return qos;
+}
+
+bool MqttClient::subscribe(const uint32_t *groups, size_t count)
+{
+    /*  SUBACKs are not waited for, each one is matched to its subscribe by msg id.
+        this client has no multi topic subscribe, one SUBSCRIBE per topic keeps every return code
+        mapped to its handler group and the subscribes are still pipelined */
+    for (size_t i = 0; i < count; i++)
+    {
+        int msgId = esp_mqtt_client_subscribe(m_client, m_topicNames.Get(m_handlers[lowestBit(groups[i])].topic), groupQos(groups[i]));
+        if (msgId < 0)
+        {
+            ESPARRAG_LOG_ERROR("subscribe failed, err %d", msgId);
+            return false;
+        }
+
+        m_pendingSubscribes.push_back({.msgId = msgId, .handlers = groups[i]});
     }
 
     return true;
@@ -358,9 +1052,11 @@ void MqttClient::reSubscribe()
 {
     ESPARRAG_ASSERT(IsInState<STATE_CONNECTED>());
 
-    for (size_t i = 0; i < m_handlers.size(); i++)
-    {
-        m_handlers[i].isSubscribed =
-            subscribe(m_handlers[i].topic.data());
-    }
+    // a new session, acks of the previous one will never come
+    m_pendingSubscribes.clear();
+    for (size_t i = 0; i < handlersNum(); i++)
+        m_handlers[i].isSubscribed = false;
+
+    m_subscribeStartUs = esp_timer_get_time();
+    subscribePending();
 }
@@ -3,11 +3,20 @@
 
 #include "etl/string.h"
 #include "mqtt_client.h"
-#include <functional>
+#include "etl/delegate.h"
 #include "etl/vector.h"
 #include "esparrag_request.h"
 #include "cJSON.h"
 #include "fsm_task.h"
+#include "esparrag_publish_queue.h"
+#include "esparrag_mqtt_spool.h"
+#include "esparrag_topic_trie.h"
+#include "esparrag_mqtt_brokers.h"
+#include "esparrag_mdns.h"
+#include "dns_resolver.h"
+#include "reconnect_policy.h"
+#include "freertos/timers.h"
+#include <atomic>
 
 namespace MqttFSM {
 
@@ -27,14 +36,12 @@ using States = std::variant<STATE_DISABLED,
 
 
 struct EVENT_CONNECT{
-    static constexpr int MQTT_BROKER_IP_SIZE = 20;
     static constexpr const char* NAME = "EVENT_CONNECT";
-
-    EVENT_CONNECT(const char* brokerIP) {
-        strlcpy(m_brokerIp, brokerIP, MQTT_BROKER_IP_SIZE);
-    }
-
-    static char m_brokerIp[MQTT_BROKER_IP_SIZE];
+    // index in MqttBrokers
+    uint8_t broker;
+};
+struct EVENT_BROKERS_CHANGED{
+    static constexpr const char* NAME = "EVENT_BROKERS_CHANGED";
 };
 
 struct EVENT_BEFORE_CONNECT{
@@ -51,32 +58,54 @@ struct EVENT_SUBSCRIBE{
 };
 struct EVENT_SUBSCRIBED{
     static constexpr const char* NAME = "EVENT_SUBSCRIBED";
+    int msgId;
+    // the SUBACK return code, granted qos or SUBACK_FAILURE
+    uint8_t returnCode;
 };
 struct EVENT_PUBLISH{
     static constexpr const char* NAME = "EVENT_PUBLISH";
-    const char* topic;
-    cJSON* payload;
+};
+struct EVENT_SPOOL_REPLAY{
+    static constexpr const char* NAME = "EVENT_SPOOL_REPLAY";
 };
 struct EVENT_PUBLISHED{
     static constexpr const char* NAME = "EVENT_PUBLISHED";
+    int msgId;
+};
+struct EVENT_INFLIGHT_SWEEP{
+    static constexpr const char* NAME = "EVENT_INFLIGHT_SWEEP";
+};
+struct EVENT_RECONNECT{
+    static constexpr const char* NAME = "EVENT_RECONNECT";
 };
 struct EVENT_ERROR{
     static constexpr const char* NAME = "EVENT_ERROR";
 };
 struct EVENT_INCOMING_DATA{
     static constexpr const char* NAME = "EVENT_INCOMING_DATA";
+    uint8_t slot;
+};
+struct EVENT_DEFERRED{
+    static constexpr const char* NAME = "EVENT_DEFERRED";
+    etl::delegate<void()> callback;
 };
 
 using Events = std::variant<EVENT_BEFORE_CONNECT,
                                EVENT_CONNECTED,
                                EVENT_CONNECT,
+                               EVENT_BROKERS_CHANGED,
                                EVENT_DISCONNECTED,
                                EVENT_SUBSCRIBE,
                                EVENT_SUBSCRIBED,
                                EVENT_PUBLISH,
+                               EVENT_SPOOL_REPLAY,
                                EVENT_PUBLISHED,
+                               EVENT_INFLIGHT_SWEEP,
+                               EVENT_RECONNECT,
                                EVENT_ERROR,
-                               EVENT_INCOMING_DATA>;
+                               EVENT_INCOMING_DATA,
+                               EVENT_DEFERRED,
+                               EVENT_DNS_RESOLVED>;
 
 
 } // namespace MqttFSM
@@ -85,26 +114,100 @@ using Events = std::variant<EVENT_BEFORE_CONNECT,
 class MqttClient : public FsmTask<MqttClient, MqttFSM::States, MqttFSM::Events>
 {
 public:
-    using mqtt_handler_callback = std::function<void(const char* topic, cJSON* payload)>;
+    using mqtt_handler_callback = etl::delegate<void(const char* topic, cJSON* payload)>;
+    using deferred_callback = etl::delegate<void()>;
 
     static constexpr int TOPIC_BUFFER_SIZE = 100;
-    static constexpr int PAYLOAD_BUFFER_SIZE = 4096;
+    // "mqtt://" + host + ":" + port
+    static constexpr int URI_MAX_LEN = MqttBrokers::HOST_MAX_LEN + 16;
+    // incoming messages wait for the fsm in one of these, fragments are reassembled in place
+    static constexpr int INBOUND_SLOTS_NUM = 4;
+    static constexpr int INBOUND_PAYLOAD_MAX_SIZE = 2048;
     static constexpr int MQTT_TASK_PRIORITY = 3;
     static constexpr int MQTT_TASK_STACK_SIZE = 4096;
     static constexpr const char * MQTT_TASK_NAME = "mqttTask@esparrag";
     static constexpr int MQTT_TASK_QUEUE_LENGTH = 80;
+    // mqtt 3.1.1 has no content type property, cbor payloads are published under this sub topic
+    static constexpr const char *CBOR_TOPIC_SUFFIX = "/cbor";
+    // messages sent per wakeup before yielding to other events
+    static constexpr int PUBLISH_BATCH_MAX = 4;
+    // spooled messages are replayed at up to SPOOL_REPLAY_BATCH per period after reconnecting
+    static constexpr int SPOOL_REPLAY_BATCH = 4;
+    static constexpr int SPOOL_REPLAY_PERIOD_MS = 200;
+    static constexpr int INFLIGHT_SWEEP_PERIOD_MS = 1000;
+    // a publish esp-mqtt refused is tried again after this
+    static constexpr int PUBLISH_RETRY_MS = 100;
+    // longer than an lwip lookup with its retries, a broker name still unresolved after it is tried again
+    static constexpr int RESOLVE_TIMEOUT_MS = 15000;
+    // m_resolving while no broker name is being resolved, never a token
+    static constexpr uint32_t NOT_RESOLVING = UINT32_MAX;
+    // a failed broker is left for a healthy candidate after this, instead of the reconnect backoff
+    static constexpr int FAILOVER_DELAY_MS = 100;
     struct mqtt_event_handler_t
     {
         mqtt_handler_callback cb;
-        etl::string<TOPIC_BUFFER_SIZE> topic;
+        topic_handle_t topic;
         bool isSubscribed{};
+        uint8_t qos{};
+    };
+
+    /*  qos 1/2 delivery. each in flight message holds a publish queue slot until acknowledged.
+        esp-mqtt retransmits from its outbox with the same msg id, a message still without an ack
+        after ackTimeout is reported as eDelivery::TIMEOUT and its slot freed */
+    struct qos_config_t
+    {
+        uint8_t window = 4;
+        MilliSeconds ackTimeout = 15000;
     };
-    using handlers_t = etl::vector<mqtt_event_handler_t, 30>;
+    static constexpr int HANDLERS_MAX_NUM = 30;
+    // subscribes sent per round before the next one is collected, one topic each
+    static constexpr int SUBSCRIBE_BATCH_MAX = 8;
+    static constexpr uint8_t SUBACK_FAILURE = 0x80;
+    static_assert(HANDLERS_MAX_NUM <= TopicTrie::IDS_MAX_NUM, "handler ids must fit the topic trie");
+    using handlers_t = etl::vector<mqtt_event_handler_t, HANDLERS_MAX_NUM>;
 
     MqttClient();
     void Init();
-    void On(const char *topic, mqtt_handler_callback callback);
-    eResult Publish(const char *topic, cJSON *msg);
+    /*  any task. topic may use the mqtt wildcards, "/+/set" or "/config/#".
+        a message is passed to every matching handler, the payload is deleted after they return.
+        a topic the handler table or topic trie can't hold (a level over TopicTrie::LEVEL_MAX_LEN chars)
+        is rejected with ERROR_CONFIG_LIMITS */
+    eResult On(const char *topic, mqtt_handler_callback callback, uint8_t qos = 0);
+    // any task. runs callback on the mqtt task in any state, false when the event queue is full
+    bool Defer(deferred_callback callback);
+    /*  serializes msg into the outbound queue and returns without waiting for the network.
+        always takes ownership of msg. waits up to options.wait for a free slot when the queue is full.
+        while disconnected, queued messages are spilled to the flash spool (if it has a partition)
+        and replayed in order after connecting.
+        cbor publishes to topic + CBOR_TOPIC_SUFFIX. a message serialized to more than
+        PublishQueue::PAYLOAD_MAX_SIZE (1 KB) is DROPPED.
+        qos 1/2 messages are tracked until acknowledged, then options.onComplete is called */
+    ePublishResult Publish(topic_handle_t topic, cJSON *msg, const publish_options_t &options = {});
+    /*  registers a topic relative to the device prefix, "/relay" publishes to "/<DEVICE_NAME>/relay".
+        meant for setup time, the handle is what Publish takes. INVALID_TOPIC when out of room */
+    topic_handle_t Topic(const char *topic) { return m_topicNames.Intern(topic); }
+    // "" for an unknown handle
+    const char *TopicName(topic_handle_t topic) const { return m_topicNames.Get(topic); }
+    // before Init
+    void ConfigureQos(const qos_config_t &config);
+    // before Init. esp-mqtt auto reconnect is disabled, the policy paces every reconnect
+    void ConfigureReconnect(const reconnect_config_t &config) { m_reconnect.Configure(config); }
+    const ReconnectPolicy::reconnect_stats_t &GetReconnectStats() const { return m_reconnect.Stats(); }
+    /*  candidate brokers, from any task. the client connects to the best scored one and moves to the
+        next while connecting, the same session state is kept across brokers.
+        host is an ip or a host name. SOURCE_DNS names go through the resolver given to SetResolver,
+        other names (and all of them without a resolver) are resolved by esp-mqtt on its own task */
+    eResult AddBroker(const char *host, uint16_t port = MqttBrokers::DEFAULT_PORT,
+                      MqttBrokers::eSource source = MqttBrokers::SOURCE_CONFIG, uint8_t priority = 0);
+    eResult RemoveBroker(const char *host, MqttBrokers::eSource source = MqttBrokers::SOURCE_CONFIG);
+    // before Connect. share the resolver with other lookups so broker names hit its cache
+    void SetResolver(DnsResolver &resolver) { m_resolver = &resolver; }
+    // keeps the mdns brokers as candidates, discovery.OnChange(MdnsDiscovery::broker_change_callback::create<MqttClient, &MqttClient::OnBrokerChange>(mqtt))
+    void OnBrokerChange(const mdns_broker_t &broker, MdnsDiscovery::eChange change);
+    const MqttBrokers &Brokers() const { return m_brokers; }
+    // connects to the best candidate
+    eResult Connect();
+    // adds brokerIp as a configured candidate and connects
     eResult TryConnect(const char* brokerIp);
 
 
@@ -116,19 +219,35 @@ public:
 
     return_state_t on_event(MqttFSM::STATE_DISABLED &, MqttFSM::EVENT_CONNECT &);
     return_state_t on_event(MqttFSM::STATE_DISABLED &, MqttFSM::EVENT_BEFORE_CONNECT &);
+    return_state_t on_event(MqttFSM::STATE_DISABLED &, MqttFSM::EVENT_PUBLISH &);
+    return_state_t on_event(MqttFSM::STATE_DISABLED &, MqttFSM::EVENT_INCOMING_DATA &);
 
     return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_CONNECTED &);
     return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_DISCONNECTED &);
     return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_ERROR &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_RECONNECT &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_PUBLISH &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_INCOMING_DATA &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTING &, MqttFSM::EVENT_BROKERS_CHANGED &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTING &, EVENT_DNS_RESOLVED &);
 
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_SUBSCRIBE &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_SUBSCRIBED &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_PUBLISH &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_SPOOL_REPLAY &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_PUBLISHED &);
+    return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_INFLIGHT_SWEEP &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_ERROR &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_DISCONNECTED &);
     return_state_t on_event(MqttFSM::STATE_CONNECTED &, MqttFSM::EVENT_INCOMING_DATA &);
 
+    // in every state
+    template <typename State>
+    return_state_t on_event(State &, MqttFSM::EVENT_DEFERRED &event) {
+        event.callback();
+        return std::nullopt;
+    }
+
     template <typename State, typename Event> 
     auto on_event(State &state, Event &event) {
         printf("unhandled event!: %s got %s\n", state.NAME, event.NAME);
@@ -138,21 +257,97 @@ public:
 
 private:
     esp_mqtt_client_handle_t m_client{};
+    /*  On appends from any task under m_handlersLock, which also guards the trie.
+        the mqtt task reads entries below m_handlersNum without it, they never change after that */
     handlers_t m_handlers;
-    SemaphoreHandle_t m_dataMutex;
+    TopicTrie m_topics;
+    std::atomic<uint8_t> m_handlersNum{0};
+    portMUX_TYPE m_handlersLock = portMUX_INITIALIZER_UNLOCKED;
+    MqttTopics m_topicNames;
+    // handle of each topic + CBOR_TOPIC_SUFFIX, interned on its first cbor publish
+    std::atomic<topic_handle_t> m_cborTopics[MqttTopics::TOPICS_MAX_NUM];
+
+    // subscribes waiting for their SUBACK, handlers is a mask of m_handlers indices
+    struct pending_subscribe_t
+    {
+        int msgId;
+        uint32_t handlers;
+    };
+    etl::vector<pending_subscribe_t, HANDLERS_MAX_NUM> m_pendingSubscribes;
+    int64_t m_subscribeStartUs = 0;
+
+    struct inbound_message_t
+    {
+        char topic[TOPIC_BUFFER_SIZE];
+        char payload[INBOUND_PAYLOAD_MAX_SIZE + 1];
+        size_t len;
+    };
+
+    inbound_message_t m_inbound[INBOUND_SLOTS_NUM]{};
+    QueueHandle_t m_inboundFree = nullptr;
+    // slot being reassembled, only used from the esp-mqtt task
+    int m_inboundAssembling = -1;
+    uint32_t m_inboundDropped = 0;
+    PublishQueue m_publishQueue;
+    std::atomic<bool> m_publishPending{false};
+    MqttSpool m_spool;
+    TimerHandle_t m_replayTimer = nullptr;
+    TimerHandle_t m_publishRetryTimer = nullptr;
+
+    struct inflight_t
+    {
+        int msgId;
+        uint8_t slot;
+        int64_t sentUs;
+    };
+    qos_config_t m_qosConfig;
+    etl::vector<inflight_t, PublishQueue::SLOTS_NUM> m_inflight;
+    TimerHandle_t m_sweepTimer = nullptr;
+    ReconnectPolicy m_reconnect;
+    TimerHandle_t m_reconnectTimer = nullptr;
+    MqttBrokers m_brokers;
+    // the candidate being connected to or connected, only used from the mqtt task
+    uint8_t m_broker = MqttBrokers::INVALID_BROKER;
+    // the generation m_broker had when picked, health reports for a replaced candidate are dropped
+    uint16_t m_brokerGeneration = 0;
+    int64_t m_attemptStartUs = 0;
+    // every candidate was removed, the next one added reconnects
+    bool m_awaitingBroker = false;
+    DnsResolver *m_resolver = nullptr;
+    // token of the candidate whose name is being resolved, generation << 8 | index, a result for any other is stale
+    uint32_t m_resolving = NOT_RESOLVING;
 
-    const char *constructFullTopic(const char *topic);
-    void handleData();
-    bool connect(const char* brokerIP);
-    bool subscribe(const char *topic);
-    eResult publish(const char *topic, const char *payload);
+    size_t handlersNum() const { return m_handlersNum.load(std::memory_order_acquire); }
+    topic_handle_t cborTopic(topic_handle_t topic);
+    void handleData(uint8_t slot);
+    void receiveData(esp_mqtt_event_handle_t event);
+    bool connect(uint8_t broker);
+    bool createClient(const char *uri);
+    // makes the candidate m_broker, false when it's gone
+    bool selectBroker(uint8_t broker, MqttBrokers::broker_t &candidate);
+    static void brokerUri(const MqttBrokers::broker_t &candidate, char *uri, size_t size);
+    // true when the candidate's name is being resolved, the attempt goes on at EVENT_DNS_RESOLVED
+    bool resolveBroker(const MqttBrokers::broker_t &candidate);
+    void reconnect();
+    void attempt(const char *uri);
+    void subscribePending();
+    bool subscribe(const uint32_t *groups, size_t count);
+    uint8_t groupQos(uint32_t group) const;
+    // msg id of the publish, 0 for qos 0, -1 on failure
+    int publish(const char *topic, const char *payload, size_t len, uint8_t qos);
+    void expireInflight(int64_t olderThanUs);
+    void completeInflight(size_t index, eDelivery delivery);
+    void flushPublishQueue();
+    void spillPublishQueue();
+    void replaySpool();
+    static void replayTimerCB(TimerHandle_t timer);
+    static void publishRetryTimerCB(TimerHandle_t timer);
+    static void sweepTimerCB(TimerHandle_t timer);
+    void scheduleReconnect();
+    static void reconnectTimerCB(TimerHandle_t timer);
     void reSubscribe();
-    mqtt_event_handler_t *findHandler(const char *topic);
 
     static void mqttEventHandler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
-
-    static char m_topic[TOPIC_BUFFER_SIZE];
-    static char m_payload[PAYLOAD_BUFFER_SIZE];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,205 @@
+#include "esparrag_mqtt_brokers.h"
+#include <cstring>
+
+uint8_t MqttBrokers::Add(const char *host, uint16_t port, eSource source, uint8_t priority, const char *name)
+{
+    if (!host || strlen(host) == 0 || strlen(host) > HOST_MAX_LEN)
+        return INVALID_BROKER;
+
+    uint8_t index = INVALID_BROKER;
+    portENTER_CRITICAL(&m_lock);
+    int existing = find(host, port, source, name);
+    if (existing >= 0)
+    {
+        index = existing;
+    }
+    else
+    {
+        for (int i = 0; i < BROKERS_MAX_NUM; i++)
+        {
+            if (!m_brokers[i].inUse)
+            {
+                uint16_t generation = m_brokers[i].generation + 1;
+                m_brokers[i] = broker_t{};
+                m_brokers[i].generation = generation;
+                m_brokers[i].inUse = true;
+                m_brokers[i].source = source;
+                strlcpy(m_brokers[i].name, name ? name : "", sizeof(m_brokers[i].name));
+                index = i;
+                break;
+            }
+        }
+    }
+
+    if (index != INVALID_BROKER)
+    {
+        broker_t &broker = m_brokers[index];
+        // a moved broker is a different server, its history doesn't apply
+        if (strcmp(broker.host, host) != 0 || broker.port != port)
+        {
+            broker.latencyMs = 0;
+            broker.consecutiveFailures = 0;
+            broker.errorScore = 0;
+        }
+        strlcpy(broker.host, host, sizeof(broker.host));
+        broker.port = port;
+        broker.priority = priority;
+    }
+    portEXIT_CRITICAL(&m_lock);
+
+    return index;
+}
+
+bool MqttBrokers::Remove(uint8_t broker)
+{
+    portENTER_CRITICAL(&m_lock);
+    bool removed = valid(broker);
+    if (removed)
+        m_brokers[broker].inUse = false;
+    portEXIT_CRITICAL(&m_lock);
+
+    return removed;
+}
+
+bool MqttBrokers::Remove(const char *name, eSource source)
+{
+    if (!name)
+        return false;
+
+    bool removed = false;
+    portENTER_CRITICAL(&m_lock);
+    for (broker_t &broker : m_brokers)
+    {
+        const char *key = broker.name[0] ? broker.name : broker.host;
+        if (broker.inUse && broker.source == source && strcmp(key, name) == 0)
+        {
+            broker.inUse = false;
+            removed = true;
+        }
+    }
+    portEXIT_CRITICAL(&m_lock);
+
+    return removed;
+}
+
+uint8_t MqttBrokers::Best() const
+{
+    uint8_t best = INVALID_BROKER;
+    uint32_t bestScore = UINT32_MAX;
+    portENTER_CRITICAL(&m_lock);
+    for (int i = 0; i < BROKERS_MAX_NUM; i++)
+    {
+        if (!m_brokers[i].inUse)
+            continue;
+
+        uint32_t candidate = score(m_brokers[i]);
+        if (best == INVALID_BROKER || candidate < bestScore)
+        {
+            best = i;
+            bestScore = candidate;
+        }
+    }
+    portEXIT_CRITICAL(&m_lock);
+
+    return best;
+}
+
+uint32_t MqttBrokers::Score(uint8_t broker) const
+{
+    portENTER_CRITICAL(&m_lock);
+    uint32_t result = valid(broker) ? score(m_brokers[broker]) : UINT32_MAX;
+    portEXIT_CRITICAL(&m_lock);
+
+    return result;
+}
+
+bool MqttBrokers::Get(uint8_t broker, broker_t &out) const
+{
+    portENTER_CRITICAL(&m_lock);
+    bool found = valid(broker);
+    if (found)
+        out = m_brokers[broker];
+    portEXIT_CRITICAL(&m_lock);
+
+    return found;
+}
+
+bool MqttBrokers::IsHealthy(uint8_t broker) const
+{
+    portENTER_CRITICAL(&m_lock);
+    bool healthy = valid(broker) && m_brokers[broker].consecutiveFailures == 0;
+    portEXIT_CRITICAL(&m_lock);
+
+    return healthy;
+}
+
+size_t MqttBrokers::Size() const
+{
+    size_t size = 0;
+    portENTER_CRITICAL(&m_lock);
+    for (const broker_t &broker : m_brokers)
+        size += broker.inUse;
+    portEXIT_CRITICAL(&m_lock);
+
+    return size;
+}
+
+void MqttBrokers::OnConnected(uint8_t broker, uint16_t generation, MilliSeconds latency)
+{
+    portENTER_CRITICAL(&m_lock);
+    if (valid(broker, generation))
+    {
+        broker_t &b = m_brokers[broker];
+        // ewma with a quarter weight for the new sample
+        b.latencyMs = b.connects == 0 ? latency.value() : (3 * b.latencyMs + latency.value()) / 4;
+        b.connects++;
+        b.consecutiveFailures = 0;
+        b.errorScore /= 2;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void MqttBrokers::OnFailure(uint8_t broker, uint16_t generation)
+{
+    portENTER_CRITICAL(&m_lock);
+    if (valid(broker, generation))
+    {
+        m_brokers[broker].failures++;
+        m_brokers[broker].consecutiveFailures++;
+        m_brokers[broker].errorScore += FAILURE_PENALTY_MS / 5;
+    }
+    portEXIT_CRITICAL(&m_lock);
+}
+
+void MqttBrokers::OnDrop(uint8_t broker, uint16_t generation)
+{
+    portENTER_CRITICAL(&m_lock);
+    if (valid(broker, generation))
+        m_brokers[broker].errorScore += DROP_PENALTY;
+    portEXIT_CRITICAL(&m_lock);
+}
+
+int MqttBrokers::find(const char *host, uint16_t port, eSource source, const char *name) const
+{
+    for (int i = 0; i < BROKERS_MAX_NUM; i++)
+    {
+        const broker_t &broker = m_brokers[i];
+        if (!broker.inUse || broker.source != source)
+            continue;
+
+        if (name && name[0] ? strcmp(broker.name, name) == 0
+                            : broker.name[0] == '\0' && broker.port == port && strcmp(broker.host, host) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+uint32_t MqttBrokers::score(const broker_t &broker) const
+{
+    uint32_t latency = broker.connects == 0 ? UNKNOWN_LATENCY_MS : broker.latencyMs;
+    uint64_t total = static_cast<uint64_t>(broker.priority) * PRIORITY_STEP + latency +
+                     static_cast<uint64_t>(broker.consecutiveFailures) * FAILURE_PENALTY_MS + broker.errorScore;
+
+    return total < UINT32_MAX ? total : UINT32_MAX - 1;
+}
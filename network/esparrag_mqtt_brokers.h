@@ -0,0 +1,89 @@
+#ifndef ESPARRAG_MQTT_BROKERS_H__
+#define ESPARRAG_MQTT_BROKERS_H__
+
+#include "esparrag_common.h"
+#include "esparrag_time_units.h"
+#include "freertos/FreeRTOS.h"
+#include <stdint.h>
+
+/*
+    Candidate brokers of MqttClient, ranked by a health score, lower is better:
+        priority * PRIORITY_STEP + connect latency (ewma) + failures in a row * FAILURE_PENALTY_MS + error history
+    Priority dominates while brokers are healthy, two failed connects in a row rank a broker behind
+    a healthy one a priority step lower. The error history is halved on every successful connect.
+    Slots keep their index until removed, any task may add or remove candidates. A slot taking a new
+    candidate gets a new generation, health reports for the previous one are ignored.
+*/
+class MqttBrokers
+{
+public:
+    static constexpr int BROKERS_MAX_NUM = 6;
+    static constexpr int HOST_MAX_LEN = 63;
+    static constexpr int NAME_MAX_LEN = 63;
+    static constexpr uint8_t INVALID_BROKER = 0xff;
+    static constexpr uint16_t DEFAULT_PORT = 1883;
+
+    static constexpr uint32_t PRIORITY_STEP = 10000;
+    static constexpr uint32_t FAILURE_PENALTY_MS = 5000;
+    // a broker never connected to ranks behind a known fast one
+    static constexpr uint32_t UNKNOWN_LATENCY_MS = 500;
+    // a connection dropped by the broker
+    static constexpr uint32_t DROP_PENALTY = 1000;
+
+    enum eSource : uint8_t
+    {
+        // stored configuration (nvs) or TryConnect
+        SOURCE_CONFIG,
+        SOURCE_MDNS,
+        // a host name, resolved through MqttClient's DnsResolver when it has one
+        SOURCE_DNS,
+    };
+
+    struct broker_t
+    {
+        char host[HOST_MAX_LEN + 1];
+        // identifies the candidate within its source, the mdns instance name. empty uses host and port
+        char name[NAME_MAX_LEN + 1];
+        uint16_t port;
+        eSource source;
+        uint8_t priority;
+        bool inUse;
+        uint32_t latencyMs;
+        uint32_t connects;
+        uint32_t failures;
+        uint32_t consecutiveFailures;
+        uint32_t errorScore;
+        uint16_t generation;
+    };
+
+    // adds or updates a candidate, keeping its health. INVALID_BROKER when full
+    uint8_t Add(const char *host, uint16_t port, eSource source, uint8_t priority = 0, const char *name = nullptr);
+    bool Remove(uint8_t broker);
+    // by name, or host when name is empty
+    bool Remove(const char *name, eSource source);
+
+    // lowest score, INVALID_BROKER when there are no candidates
+    uint8_t Best() const;
+    uint32_t Score(uint8_t broker) const;
+    bool Get(uint8_t broker, broker_t &out) const;
+    bool IsHealthy(uint8_t broker) const;
+    size_t Size() const;
+
+    // by the broker's generation when it was picked, a report for a replaced candidate is ignored
+    void OnConnected(uint8_t broker, uint16_t generation, MilliSeconds latency);
+    // a connect attempt that failed
+    void OnFailure(uint8_t broker, uint16_t generation);
+    // an established connection that dropped
+    void OnDrop(uint8_t broker, uint16_t generation);
+
+private:
+    broker_t m_brokers[BROKERS_MAX_NUM]{};
+    mutable portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    int find(const char *host, uint16_t port, eSource source, const char *name) const;
+    uint32_t score(const broker_t &broker) const;
+    bool valid(uint8_t broker) const { return broker < BROKERS_MAX_NUM && m_brokers[broker].inUse; }
+    bool valid(uint8_t broker, uint16_t generation) const { return valid(broker) && m_brokers[broker].generation == generation; }
+};
+
+#endif
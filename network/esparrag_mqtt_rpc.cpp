@@ -0,0 +1,264 @@
+#include "esparrag_mqtt_rpc.h"
+#include "esparrag_log.h"
+#include "esp_timer.h"
+#include <cstring>
+
+static constexpr char REQUEST_PREFIX[] = "/rpc/req";
+static constexpr char REQUEST_TOPIC[] = "/rpc/req/#";
+static constexpr char RESULT_TOPIC[] = "/rpc/result";
+
+eResult MqttRpc::On(const char *uri, eMethod method, request_handler_t callback)
+{
+    if (!uri)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    if (m_sweepTimer)
+        return eResult::ERROR_INVALID_STATE;
+
+    return m_router->On(uri, method, callback);
+}
+
+eResult MqttRpc::On(Router &router)
+{
+    if (m_sweepTimer || m_routes.Size() > 0)
+        return eResult::ERROR_INVALID_STATE;
+
+    m_router = &router;
+    return eResult::SUCCESS;
+}
+
+eResult MqttRpc::Init()
+{
+    m_replyTopic = m_client.Topic("/rpc/reply");
+    m_callTopic = m_client.Topic("/rpc/call");
+    if (m_replyTopic == MqttTopics::INVALID_TOPIC || m_callTopic == MqttTopics::INVALID_TOPIC)
+        return eResult::ERROR_NOT_INITIALIZED;
+
+    // our own replies and calls are published outside these, they don't come back
+    eResult res = m_client.On(REQUEST_TOPIC, MqttClient::mqtt_handler_callback::create<MqttRpc, &MqttRpc::onRequest>(*this), 1);
+    if (res == eResult::SUCCESS)
+        res = m_client.On(RESULT_TOPIC, MqttClient::mqtt_handler_callback::create<MqttRpc, &MqttRpc::onResult>(*this), 1);
+    if (res != eResult::SUCCESS)
+        return res;
+
+    // armed by the first pending call
+    m_sweepTimer = xTimerCreate("mqtt_rpc", pdMS_TO_TICKS(SWEEP_PERIOD_MS), pdFALSE, this, sweepTimerCB);
+    ESPARRAG_ASSERT(m_sweepTimer);
+    return eResult::SUCCESS;
+}
+
+eResult MqttRpc::Call(const char *uri, cJSON *body, rpc_reply_callback callback, MilliSeconds timeout)
+{
+    if (!m_sweepTimer || !uri || uri[0] != '/' || !callback.is_valid())
+    {
+        cJSON_Delete(body);
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
+
+    cJSON *request = cJSON_CreateObject();
+    if (!request)
+    {
+        cJSON_Delete(body);
+        return eResult::ERROR_MEMORY;
+    }
+
+    bool added = false;
+    bool first = false;
+    pending_t pending{.id = 0, .deadlineUs = esp_timer_get_time() + static_cast<int64_t>(timeout.value()) * 1000, .callback = callback};
+    portENTER_CRITICAL(&m_pendingLock);
+    if (!m_pending.full())
+    {
+        // 0 is never an id, skipped when the counter wraps
+        pending.id = m_nextId++;
+        if (m_nextId == 0)
+            m_nextId = 1;
+        first = m_pending.empty();
+        m_pending.push_back(pending);
+        added = true;
+    }
+    portEXIT_CRITICAL(&m_pendingLock);
+
+    if (first)
+        armSweep();
+
+    if (!added)
+    {
+        ESPARRAG_LOG_WARNING("mqtt rpc has %d calls pending, %s not sent", PENDING_MAX_NUM, uri);
+        cJSON_Delete(body);
+        cJSON_Delete(request);
+        return eResult::ERROR_MEMORY;
+    }
+
+    cJSON_AddNumberToObject(request, "id", pending.id);
+    cJSON_AddStringToObject(request, "uri", uri);
+    if (body)
+        cJSON_AddItemToObject(request, "body", body);
+
+    // a dropped publish is reported by the timeout, the callback runs exactly once either way
+    m_client.Publish(m_callTopic, request, {.qos = 1});
+    return eResult::SUCCESS;
+}
+
+// runs on the mqtt task
+void MqttRpc::onRequest(const char *topic, cJSON *payload)
+{
+    // "/<device>/rpc/req" then the uri
+    static constexpr size_t URI_OFFSET = sizeof(MqttTopics::PREFIX) - 1 + sizeof(REQUEST_PREFIX) - 1;
+    if (strlen(topic) <= URI_OFFSET || !cJSON_IsObject(payload))
+        return;
+
+    const char *uri = topic + URI_OFFSET;
+    cJSON *id = cJSON_GetObjectItem(payload, "id");
+    // the body moves into the request, which deletes it
+    cJSON *body = cJSON_DetachItemFromObject(payload, "body");
+    eMethod method = parseMethod(cJSON_GetObjectItem(payload, "method"), body != nullptr);
+
+    Request request(body, uri, method);
+    Response response;
+    m_router->Dispatch(request, response);
+
+    cJSON *reply = cJSON_CreateObject();
+    if (!reply)
+        return;
+
+    cJSON_AddItemToObject(reply, "id", id ? cJSON_Duplicate(id, true) : cJSON_CreateNull());
+    cJSON_AddStringToObject(reply, "uri", uri);
+    cJSON_AddNumberToObject(reply, "code", response.m_code.get_value());
+    if (response.m_string)
+    {
+        cJSON_AddStringToObject(reply, "body", response.m_string);
+    }
+    else if (response.m_json)
+    {
+        cJSON_AddItemToObject(reply, "body", response.m_json);
+        response.m_json = nullptr;
+    }
+
+    m_client.Publish(m_replyTopic, reply, {.qos = 1});
+}
+
+// ids come from the broker, anything but an integer a call could have been given is rejected
+static bool parseId(const cJSON *id, uint32_t &result)
+{
+    if (!cJSON_IsNumber(id))
+        return false;
+
+    // false for nan too
+    double value = id->valuedouble;
+    if (!(value >= 1 && value <= UINT32_MAX))
+        return false;
+
+    result = static_cast<uint32_t>(value);
+    return result == value;
+}
+
+// runs on the mqtt task
+void MqttRpc::onResult(const char *topic, cJSON *payload)
+{
+    if (!cJSON_IsObject(payload))
+        return;
+
+    uint32_t id = 0;
+    rpc_reply_callback callback;
+    if (!parseId(cJSON_GetObjectItem(payload, "id"), id) || !takePending(id, callback))
+    {
+        ESPARRAG_LOG_WARNING("mqtt rpc result for an unknown or expired call");
+        return;
+    }
+
+    cJSON *code = cJSON_GetObjectItem(payload, "code");
+    cJSON *body = cJSON_DetachItemFromObject(payload, "body");
+    Response response;
+    response.m_code = Response::CODE(cJSON_IsNumber(code) ? code->valueint : Response::CODE::HTTP_CODE_OK);
+    if (body)
+    {
+        cJSON_Delete(response.m_json);
+        response.m_json = body;
+    }
+
+    callback(response);
+}
+
+bool MqttRpc::takePending(uint32_t id, rpc_reply_callback &callback)
+{
+    bool found = false;
+    portENTER_CRITICAL(&m_pendingLock);
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        if (m_pending[i].id == id)
+        {
+            callback = m_pending[i].callback;
+            m_pending.erase(m_pending.begin() + i);
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&m_pendingLock);
+
+    return found;
+}
+
+// deferred into the mqtt task by the sweep timer, callbacks are called outside the lock
+void MqttRpc::expire()
+{
+    int64_t now = esp_timer_get_time();
+    for (;;)
+    {
+        rpc_reply_callback callback;
+        bool expired = false;
+        portENTER_CRITICAL(&m_pendingLock);
+        for (size_t i = 0; i < m_pending.size(); i++)
+        {
+            if (m_pending[i].deadlineUs <= now)
+            {
+                callback = m_pending[i].callback;
+                m_pending.erase(m_pending.begin() + i);
+                expired = true;
+                break;
+            }
+        }
+        bool pending = !m_pending.empty();
+        portEXIT_CRITICAL(&m_pendingLock);
+
+        if (!expired)
+        {
+            // a call added after this check arms the timer itself
+            if (pending)
+                armSweep();
+            return;
+        }
+
+        Response response;
+        response.m_code = Response::CODE::HTTP_CODE_GATEWAY_TIMEOUT;
+        callback(response);
+    }
+}
+
+void MqttRpc::armSweep()
+{
+    xTimerStart(m_sweepTimer, 0);
+}
+
+// runs on the timer task, the pending table is only swept on the mqtt task
+void MqttRpc::sweepTimerCB(TimerHandle_t timer)
+{
+    MqttRpc *rpc = reinterpret_cast<MqttRpc *>(pvTimerGetTimerID(timer));
+    if (!rpc->m_client.Defer(MqttClient::deferred_callback::create<MqttRpc, &MqttRpc::expire>(*rpc)))
+        xTimerReset(timer, 0);
+}
+
+eMethod MqttRpc::parseMethod(const cJSON *method, bool hasBody)
+{
+    if (!cJSON_IsString(method))
+        return hasBody ? eMethod::POST : eMethod::GET;
+
+    const char *name = method->valuestring;
+    if (strcmp(name, "GET") == 0)
+        return eMethod::GET;
+    if (strcmp(name, "PUT") == 0)
+        return eMethod::PUT;
+    if (strcmp(name, "DELETE") == 0)
+        return eMethod::DELETE;
+
+    return eMethod::POST;
+}
@@ -0,0 +1,81 @@
+#ifndef ESPARRAG_MQTT_RPC_H__
+#define ESPARRAG_MQTT_RPC_H__
+
+#include "esparrag_mqtt.h"
+#include "esparrag_router.h"
+#include "esparrag_request.h"
+#include "esparrag_response.h"
+#include "esparrag_time_units.h"
+#include "etl/delegate.h"
+#include "etl/vector.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+
+// called once on the mqtt task with the reply, or with HTTP_CODE_GATEWAY_TIMEOUT when none came in time
+using rpc_reply_callback = etl::delegate<void(Response &)>;
+
+/*
+    Request/response over mqtt, requests are dispatched into a Router like HttpServer's.
+    All topics are under the device prefix, the device subscribes only to req/# and result:
+        /<device>/rpc/req/<uri>  request  {"id": 7, "method": "POST", "body": {...}}, method defaults to POST with a body, else GET
+        /<device>/rpc/reply      response {"id": 7, "uri": "/relay", "code": 200, "body": {...}}
+        /<device>/rpc/call       request from the device {"id": 3, "uri": "/config", "body": {...}}
+        /<device>/rpc/result     response to a call {"id": 3, "code": 200, "body": {...}}
+    Calls wait for their result in a fixed pending table, matched by id. While any is pending a one shot
+    timer defers a sweep into the mqtt task every SWEEP_PERIOD_MS, which expires them.
+
+    MqttRpc rpc(mqtt);
+    rpc.On(router); // the router HttpServer serves
+    rpc.Init();
+    rpc.Call("/config", nullptr, rpc_reply_callback::create<Device, &Device::onConfig>(device));
+*/
+class MqttRpc
+{
+public:
+    static constexpr int PENDING_MAX_NUM = 8;
+    static constexpr int SWEEP_PERIOD_MS = 200;
+    static constexpr uint32_t DEFAULT_TIMEOUT_MS = 5000;
+
+    MqttRpc(MqttClient &client) : m_client(client) {}
+
+    // before Init
+    eResult On(const char *uri, eMethod method, request_handler_t callback);
+    // serve a router shared with other transports instead of an own table, before any On(uri, ...)
+    eResult On(Router &router);
+    eResult Init();
+
+    // any task, takes ownership of body (may be nullptr)
+    eResult Call(const char *uri, cJSON *body, rpc_reply_callback callback, MilliSeconds timeout = DEFAULT_TIMEOUT_MS);
+    size_t PendingNum() const { return m_pending.size(); }
+
+private:
+    struct pending_t
+    {
+        uint32_t id;
+        int64_t deadlineUs;
+        rpc_reply_callback callback;
+    };
+
+    MqttClient &m_client;
+    Router m_routes;
+    Router *m_router = &m_routes;
+    etl::vector<pending_t, PENDING_MAX_NUM> m_pending;
+    portMUX_TYPE m_pendingLock = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t m_nextId = 1;
+    TimerHandle_t m_sweepTimer = nullptr;
+    topic_handle_t m_replyTopic = MqttTopics::INVALID_TOPIC;
+    topic_handle_t m_callTopic = MqttTopics::INVALID_TOPIC;
+
+    void onRequest(const char *topic, cJSON *payload);
+    void onResult(const char *topic, cJSON *payload);
+    bool takePending(uint32_t id, rpc_reply_callback &callback);
+    void expire();
+    void armSweep();
+    static void sweepTimerCB(TimerHandle_t timer);
+    static eMethod parseMethod(const cJSON *method, bool hasBody);
+
+    MqttRpc(const MqttRpc &) = delete;
+    MqttRpc &operator=(const MqttRpc &) = delete;
+};
+
+#endif
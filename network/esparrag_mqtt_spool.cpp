@@ -0,0 +1,334 @@
+#include "esparrag_mqtt_spool.h"
+#include "esparrag_log.h"
+#include "esp_rom_crc.h"
+#include "etl/algorithm.h"
+#include <cstring>
+#include <cstddef>
+
+uint32_t MqttSpool::recordSize(const record_header_t &header)
+{
+    uint32_t size = sizeof(record_header_t) + header.topicLen + header.payloadLen;
+    return (size + 3) & ~3u;
+}
+
+eResult MqttSpool::Init(const char *partitionLabel)
+{
+    if (IsInitialized())
+    {
+        ESPARRAG_LOG_WARNING("mqtt spool already initialized");
+        return eResult::ERROR_INVALID_STATE;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY,
+                                                                partitionLabel);
+    if (partition == nullptr)
+    {
+        ESPARRAG_LOG_ERROR("partition %s not found", partitionLabel);
+        return eResult::ERROR_FLASH_NOT_FOUND;
+    }
+
+    if (partition->size / SECTOR_SIZE < 2)
+    {
+        ESPARRAG_LOG_ERROR("partition %s needs at least two sectors", partitionLabel);
+        return eResult::ERROR_CONFIG_LIMITS;
+    }
+
+    m_partition = partition;
+    m_sectorsNum = partition->size / SECTOR_SIZE;
+
+    // newest sector is written next, oldest is read first
+    bool found = false;
+    uint16_t newest = 0;
+    uint16_t oldest = 0;
+    uint32_t newestSeq = 0;
+    uint32_t oldestSeq = 0;
+    for (uint16_t sector = 0; sector < m_sectorsNum; sector++)
+    {
+        sector_header_t header;
+        if (!readSectorHeader(sector, header))
+            continue;
+
+        if (!found || header.seq > newestSeq)
+        {
+            newest = sector;
+            newestSeq = header.seq;
+        }
+
+        if (!found || header.seq < oldestSeq)
+        {
+            oldest = sector;
+            oldestSeq = header.seq;
+        }
+
+        found = true;
+    }
+
+    if (!found)
+    {
+        // the first append opens sector 0
+        m_writeSector = m_sectorsNum - 1;
+        m_writeOffset = SECTOR_SIZE;
+        resetReadCursor();
+        ESPARRAG_LOG_INFO("mqtt spool is empty, %d sectors", m_sectorsNum);
+        return eResult::SUCCESS;
+    }
+
+    m_writeSector = newest;
+    m_writeOffset = endOfRecords(newest);
+    m_nextSectorSeq = newestSeq + 1;
+
+    for (uint16_t sector = oldest;; sector = nextSector(sector))
+    {
+        sector_header_t header;
+        if (readSectorHeader(sector, header))
+            m_pending += countUnread(sector, FIRST_RECORD, sector == m_writeSector ? m_writeOffset : SECTOR_SIZE);
+
+        if (sector == m_writeSector)
+            break;
+    }
+
+    m_readSector = oldest;
+    m_readOffset = FIRST_RECORD;
+    if (m_pending == 0)
+        resetReadCursor();
+
+    ESPARRAG_LOG_INFO("mqtt spool has %d pending messages", m_pending);
+    return eResult::SUCCESS;
+}
+
+eResult MqttSpool::Append(const char *topic, const PublishQueue::message_t &message)
+{
+    if (!IsInitialized())
+        return eResult::ERROR_NOT_INITIALIZED;
+
+    size_t topicLen = strnlen(topic, MqttTopics::TOPIC_MAX_LEN + 1);
+    record_header_t header{};
+    header.magic = RECORD_MAGIC;
+    header.payloadLen = message.len;
+    header.topicLen = topicLen;
+    header.qos = message.qos;
+    header.unread = RECORD_UNREAD;
+    header.crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(topic), topicLen);
+    header.crc = esp_rom_crc32_le(header.crc, message.payload, message.len);
+
+    if (topicLen > MqttTopics::TOPIC_MAX_LEN || message.len > sizeof(message.payload) || FIRST_RECORD + recordSize(header) > SECTOR_SIZE)
+        return eResult::ERROR_INVALID_PARAMETER;
+
+    if (m_writeOffset + recordSize(header) > SECTOR_SIZE)
+    {
+        eResult res = openNextSector();
+        if (res != eResult::SUCCESS)
+            return res;
+    }
+
+    // header first, a write torn by power loss leaves a record that fails its crc and is skipped
+    size_t address = this->address(m_writeSector, m_writeOffset);
+    esp_err_t err = esp_partition_write(m_partition, address, &header, sizeof(header));
+    if (err == ESP_OK)
+        err = esp_partition_write(m_partition, address + sizeof(header), topic, topicLen);
+    if (err == ESP_OK && message.len > 0)
+        err = esp_partition_write(m_partition, address + sizeof(header) + topicLen, message.payload, message.len);
+
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("mqtt spool write failed, err %d", err);
+        // don't append after a record of unknown state
+        m_writeOffset = SECTOR_SIZE;
+        return eResult::ERROR_FLASH;
+    }
+
+    if (m_pending == 0)
+    {
+        m_readSector = m_writeSector;
+        m_readOffset = m_writeOffset;
+    }
+
+    m_writeOffset += recordSize(header);
+    m_pending++;
+    return eResult::SUCCESS;
+}
+
+eResult MqttSpool::Peek(spooled_message_t &message)
+{
+    while (m_pending > 0)
+    {
+        record_header_t header;
+        if (!readHeader(m_readSector, m_readOffset, header))
+        {
+            if (m_readSector == m_writeSector)
+                break;
+
+            m_readSector = nextSector(m_readSector);
+            m_readOffset = FIRST_RECORD;
+            continue;
+        }
+
+        if (header.unread != RECORD_UNREAD)
+        {
+            m_readOffset += recordSize(header);
+            continue;
+        }
+
+        size_t address = this->address(m_readSector, m_readOffset) + sizeof(header);
+        esp_err_t err = esp_partition_read(m_partition, address, message.topic, header.topicLen);
+        if (err == ESP_OK)
+            err = esp_partition_read(m_partition, address + header.topicLen, message.payload, header.payloadLen);
+
+        uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(message.topic), header.topicLen);
+        crc = esp_rom_crc32_le(crc, message.payload, header.payloadLen);
+        if (err != ESP_OK || crc != header.crc)
+        {
+            ESPARRAG_LOG_WARNING("mqtt spool record at %d:%d is corrupted", m_readSector, m_readOffset);
+            m_lost++;
+            markRead(m_readSector, m_readOffset);
+            m_readOffset += recordSize(header);
+            if (--m_pending == 0)
+                resetReadCursor();
+
+            continue;
+        }
+
+        message.topic[header.topicLen] = '\0';
+        message.len = header.payloadLen;
+        message.qos = header.qos;
+        return eResult::SUCCESS;
+    }
+
+    // counters out of sync with flash, start over from the write position
+    if (m_pending > 0)
+    {
+        ESPARRAG_LOG_ERROR("mqtt spool lost track of %d messages", m_pending);
+        m_lost += m_pending;
+        m_pending = 0;
+        resetReadCursor();
+    }
+
+    return eResult::ERROR_NOT_FOUND;
+}
+
+eResult MqttSpool::Pop()
+{
+    if (m_pending == 0)
+        return eResult::ERROR_INVALID_STATE;
+
+    record_header_t header;
+    if (!readHeader(m_readSector, m_readOffset, header))
+        return eResult::ERROR_INVALID_STATE;
+
+    // moves on even if the mark failed, the record is then sent again after a reboot
+    eResult res = markRead(m_readSector, m_readOffset);
+    m_readOffset += recordSize(header);
+    if (--m_pending == 0)
+        resetReadCursor();
+
+    return res;
+}
+
+bool MqttSpool::readSectorHeader(uint16_t sector, sector_header_t &header) const
+{
+    esp_err_t err = esp_partition_read(m_partition, address(sector, 0), &header, sizeof(header));
+    return err == ESP_OK && header.magic == SECTOR_MAGIC;
+}
+
+bool MqttSpool::readHeader(uint16_t sector, uint32_t offset, record_header_t &header) const
+{
+    if (offset + sizeof(header) > SECTOR_SIZE)
+        return false;
+
+    if (esp_partition_read(m_partition, address(sector, offset), &header, sizeof(header)) != ESP_OK)
+        return false;
+
+    return header.magic == RECORD_MAGIC &&
+           header.topicLen <= MqttTopics::TOPIC_MAX_LEN &&
+           header.payloadLen <= PublishQueue::PAYLOAD_MAX_SIZE &&
+           offset + recordSize(header) <= SECTOR_SIZE;
+}
+
+uint32_t MqttSpool::endOfRecords(uint16_t sector) const
+{
+    record_header_t header;
+    uint32_t offset = FIRST_RECORD;
+    while (readHeader(sector, offset, header))
+        offset += recordSize(header);
+
+    if (offset + sizeof(header) > SECTOR_SIZE)
+        return SECTOR_SIZE;
+
+    // anything but erased flash after the last record means a torn header, the sector is closed
+    uint16_t magic = 0;
+    esp_partition_read(m_partition, address(sector, offset), &magic, sizeof(magic));
+    return magic == 0xFFFF ? offset : SECTOR_SIZE;
+}
+
+size_t MqttSpool::countUnread(uint16_t sector, uint32_t from, uint32_t end) const
+{
+    size_t count = 0;
+    record_header_t header;
+    for (uint32_t offset = from; offset < end && readHeader(sector, offset, header); offset += recordSize(header))
+    {
+        if (header.unread == RECORD_UNREAD)
+            count++;
+    }
+
+    return count;
+}
+
+eResult MqttSpool::openNextSector()
+{
+    uint16_t next = nextSector(m_writeSector);
+
+    // wrapped onto unread data, give up the oldest sector
+    if (m_pending > 0 && next == m_readSector)
+    {
+        size_t dropped = countUnread(m_readSector, m_readOffset, SECTOR_SIZE);
+        m_pending -= etl::min(dropped, m_pending);
+        m_lost += dropped;
+        m_readSector = nextSector(next);
+        m_readOffset = FIRST_RECORD;
+        if (dropped > 0)
+            ESPARRAG_LOG_WARNING("mqtt spool full, dropped %d messages", dropped);
+    }
+
+    esp_err_t err = esp_partition_erase_range(m_partition, address(next, 0), SECTOR_SIZE);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("mqtt spool erase failed, err %d", err);
+        return eResult::ERROR_FLASH;
+    }
+
+    sector_header_t header{.magic = SECTOR_MAGIC, .seq = m_nextSectorSeq++};
+    err = esp_partition_write(m_partition, address(next, 0), &header, sizeof(header));
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("mqtt spool write failed, err %d", err);
+        return eResult::ERROR_FLASH;
+    }
+
+    m_writeSector = next;
+    m_writeOffset = FIRST_RECORD;
+    if (m_pending == 0)
+        resetReadCursor();
+
+    return eResult::SUCCESS;
+}
+
+eResult MqttSpool::markRead(uint16_t sector, uint32_t offset)
+{
+    // clearing bits needs no erase
+    uint32_t read = 0;
+    esp_err_t err = esp_partition_write(m_partition, address(sector, offset) + offsetof(record_header_t, unread), &read, sizeof(read));
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("mqtt spool write failed, err %d", err);
+        return eResult::ERROR_FLASH;
+    }
+
+    return eResult::SUCCESS;
+}
+
+void MqttSpool::resetReadCursor()
+{
+    m_readSector = m_writeSector;
+    m_readOffset = m_writeOffset;
+}
@@ -0,0 +1,95 @@
+#ifndef ESPARRAG_MQTT_SPOOL_H__
+#define ESPARRAG_MQTT_SPOOL_H__
+
+#include "esparrag_result.h"
+#include "esparrag_publish_queue.h"
+#include "esp_partition.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Store-and-forward log of outbound mqtt messages in a dedicated flash partition.
+    Records are appended to one sector at a time and sectors are taken in a circle,
+    so every sector is erased once per pass over the partition.
+    A replayed record is marked by clearing a word in its header, no erase is needed.
+    When the log wraps onto unread data, the oldest sector is dropped.
+
+    Only the mqtt task uses it, there is no locking.
+*/
+class MqttSpool
+{
+public:
+    static constexpr const char *PARTITION_LABEL = "mqtt_spool";
+    static constexpr uint32_t SECTOR_SIZE = 4096;
+
+    eResult Init(const char *partitionLabel = PARTITION_LABEL);
+    bool IsInitialized() const { return m_partition != nullptr; }
+
+    struct spooled_message_t
+    {
+        char topic[MqttTopics::TOPIC_MAX_LEN + 1];
+        uint8_t payload[PublishQueue::PAYLOAD_MAX_SIZE];
+        size_t len;
+        uint8_t qos;
+    };
+
+    // topic is the full topic, handles don't outlive a boot
+    eResult Append(const char *topic, const PublishQueue::message_t &message);
+    // oldest unread message, ERROR_NOT_FOUND when empty
+    eResult Peek(spooled_message_t &message);
+    // marks the message returned by Peek as sent
+    eResult Pop();
+
+    size_t Pending() const { return m_pending; }
+    // unread records dropped on wrap around or found corrupted
+    uint32_t Lost() const { return m_lost; }
+
+private:
+    static constexpr uint32_t SECTOR_MAGIC = 0x53504F4C;
+    // records of the previous layout held topics without the device prefix, they are not replayed
+    static constexpr uint16_t RECORD_MAGIC = 0x5353;
+    static constexpr uint32_t RECORD_UNREAD = 0xFFFFFFFF;
+
+    struct sector_header_t
+    {
+        uint32_t magic;
+        uint32_t seq;
+    };
+
+    struct record_header_t
+    {
+        uint16_t magic;
+        uint16_t payloadLen;
+        uint8_t topicLen;
+        uint8_t qos;
+        uint8_t reserved[2];
+        uint32_t crc;
+        uint32_t unread;
+    };
+
+    static constexpr uint32_t FIRST_RECORD = sizeof(sector_header_t);
+
+    const esp_partition_t *m_partition = nullptr;
+    uint16_t m_sectorsNum = 0;
+    uint16_t m_writeSector = 0;
+    uint32_t m_writeOffset = 0;
+    uint16_t m_readSector = 0;
+    uint32_t m_readOffset = 0;
+    uint32_t m_nextSectorSeq = 1;
+    size_t m_pending = 0;
+    uint32_t m_lost = 0;
+
+    uint16_t nextSector(uint16_t sector) const { return (sector + 1) % m_sectorsNum; }
+    size_t address(uint16_t sector, uint32_t offset) const { return sector * SECTOR_SIZE + offset; }
+    static uint32_t recordSize(const record_header_t &header);
+
+    bool readSectorHeader(uint16_t sector, sector_header_t &header) const;
+    bool readHeader(uint16_t sector, uint32_t offset, record_header_t &header) const;
+    uint32_t endOfRecords(uint16_t sector) const;
+    size_t countUnread(uint16_t sector, uint32_t from, uint32_t end) const;
+    eResult openNextSector();
+    eResult markRead(uint16_t sector, uint32_t offset);
+    void resetReadCursor();
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include "esparrag_mqtt_topics.h"
+#include "esparrag_log.h"
+#include <cstring>
+
+topic_handle_t MqttTopics::Intern(const char *topic, const char *suffix)
+{
+    if (!topic || topic[0] != '/' || !suffix)
+        return INVALID_TOPIC;
+
+    size_t prefixLen = sizeof(PREFIX) - 1;
+    size_t topicLen = strlen(topic);
+    size_t suffixLen = strlen(suffix);
+    size_t len = prefixLen + topicLen + suffixLen;
+    if (len > TOPIC_MAX_LEN)
+    {
+        ESPARRAG_LOG_ERROR("mqtt topic %s is too long", topic);
+        return INVALID_TOPIC;
+    }
+
+    topic_handle_t handle = INVALID_TOPIC;
+    portENTER_CRITICAL(&m_spinlock);
+    uint8_t count = m_count.load(std::memory_order_relaxed);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const char *interned = &m_pool[m_entries[i].offset];
+        if (m_entries[i].len == len &&
+            memcmp(interned + prefixLen, topic, topicLen) == 0 &&
+            memcmp(interned + prefixLen + topicLen, suffix, suffixLen) == 0)
+        {
+            handle = i;
+            break;
+        }
+    }
+
+    if (handle == INVALID_TOPIC && count < TOPICS_MAX_NUM && m_poolUsed + len + 1 <= POOL_SIZE)
+    {
+        char *entry = &m_pool[m_poolUsed];
+        memcpy(entry, PREFIX, prefixLen);
+        memcpy(entry + prefixLen, topic, topicLen);
+        memcpy(entry + prefixLen + topicLen, suffix, suffixLen);
+        entry[len] = '\0';
+        m_entries[count] = {.offset = static_cast<uint16_t>(m_poolUsed), .len = static_cast<uint8_t>(len)};
+        m_poolUsed += len + 1;
+        handle = count;
+        // readers only look at entries below the count
+        m_count.store(count + 1, std::memory_order_release);
+    }
+    portEXIT_CRITICAL(&m_spinlock);
+
+    if (handle == INVALID_TOPIC)
+        ESPARRAG_LOG_ERROR("no room to register mqtt topic %s", topic);
+
+    return handle;
+}
@@ -0,0 +1,51 @@
+#ifndef ESPARRAG_MQTT_TOPICS_H__
+#define ESPARRAG_MQTT_TOPICS_H__
+
+#include "freertos/FreeRTOS.h"
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+using topic_handle_t = uint8_t;
+
+/*
+    Interned mqtt topics of this device.
+    A topic is formatted once, with the device prefix, into a fixed pool when it is registered.
+    After that it is passed around as a one byte handle and read back without copies or locks.
+    Topics are never removed, registering the same topic again returns the same handle.
+
+    topic_handle_t relay = topics.Intern("/relay");
+    topics.Get(relay); // "/MORAN_1/relay"
+*/
+class MqttTopics
+{
+public:
+    static constexpr char PREFIX[] = "/" DEVICE_NAME;
+    static constexpr int TOPICS_MAX_NUM = 48;
+    static constexpr int POOL_SIZE = 1536;
+    static constexpr int TOPIC_MAX_LEN = 99;
+    static constexpr topic_handle_t INVALID_TOPIC = UINT8_MAX;
+    static_assert(TOPICS_MAX_NUM < INVALID_TOPIC, "handles must fit a byte");
+
+    // any task. topic starts with '/' and is relative to the device prefix. INVALID_TOPIC when full
+    topic_handle_t Intern(const char *topic, const char *suffix = "");
+    bool IsValid(topic_handle_t topic) const { return topic < m_count.load(std::memory_order_acquire); }
+    // "" and 0 for a handle that was never interned
+    const char *Get(topic_handle_t topic) const { return IsValid(topic) ? &m_pool[m_entries[topic].offset] : ""; }
+    size_t Len(topic_handle_t topic) const { return IsValid(topic) ? m_entries[topic].len : 0; }
+
+private:
+    struct entry_t
+    {
+        uint16_t offset;
+        uint8_t len;
+    };
+
+    entry_t m_entries[TOPICS_MAX_NUM]{};
+    char m_pool[POOL_SIZE]{};
+    size_t m_poolUsed = 0;
+    std::atomic<uint8_t> m_count{0};
+    portMUX_TYPE m_spinlock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif
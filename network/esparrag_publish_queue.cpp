@@ -0,0 +1,90 @@
+#include "esparrag_publish_queue.h"
+#include "esparrag_cbor.h"
+#include "esparrag_log.h"
+#include "esparrag_common.h"
+#include <cstring>
+
+void PublishQueue::Init(const MqttTopics &topics)
+{
+    m_topics = &topics;
+    m_free = xQueueCreate(SLOTS_NUM, sizeof(uint8_t));
+    m_ready = xQueueCreate(SLOTS_NUM, sizeof(uint8_t));
+    ESPARRAG_ASSERT(m_free && m_ready);
+
+    for (uint8_t i = 0; i < SLOTS_NUM; i++)
+        xQueueSend(m_free, &i, 0);
+}
+
+ePublishResult PublishQueue::Push(topic_handle_t topic, cJSON *msg, const publish_options_t &options)
+{
+    if (!m_free || topic == MqttTopics::INVALID_TOPIC || !msg || options.qos > 2)
+    {
+        cJSON_Delete(msg);
+        return ePublishResult::DROPPED;
+    }
+
+    uint8_t index = 0;
+    if (xQueueReceive(m_free, &index, options.wait.toTicks()) != pdTRUE)
+    {
+        ESPARRAG_LOG_WARNING("mqtt publish queue full, message to %s dropped", m_topics->Get(topic));
+        cJSON_Delete(msg);
+        return ePublishResult::BLOCKED;
+    }
+
+    message_t &slot = m_slots[index];
+    bool serialized = false;
+    if (options.cbor)
+    {
+        CborWriter writer(slot.payload, sizeof(slot.payload));
+        serialized = writer.Write(msg);
+        slot.len = writer.Size();
+    }
+    else
+    {
+        char *text = reinterpret_cast<char *>(slot.payload);
+        serialized = cJSON_PrintPreallocated(msg, text, sizeof(slot.payload), false);
+        slot.len = serialized ? strlen(text) : 0;
+    }
+
+    cJSON_Delete(msg);
+    if (!serialized)
+    {
+        ESPARRAG_LOG_ERROR("mqtt message to %s doesn't fit a publish slot", m_topics->Get(topic));
+        xQueueSend(m_free, &index, 0);
+        return ePublishResult::DROPPED;
+    }
+
+    slot.topic = topic;
+    slot.qos = options.qos;
+    slot.onComplete = options.qos > 0 ? options.onComplete : publish_callback_t();
+    xQueueSend(m_ready, &index, 0);
+    return ePublishResult::QUEUED;
+}
+
+PublishQueue::message_t *PublishQueue::Front()
+{
+    uint8_t index = 0;
+    if (xQueuePeek(m_ready, &index, 0) != pdTRUE)
+        return nullptr;
+
+    return &m_slots[index];
+}
+
+void PublishQueue::Pop()
+{
+    Release(Detach());
+}
+
+uint8_t PublishQueue::Detach()
+{
+    uint8_t index = 0;
+    bool taken = xQueueReceive(m_ready, &index, 0) == pdTRUE;
+    ESPARRAG_ASSERT(taken);
+    return index;
+}
+
+void PublishQueue::Release(uint8_t index)
+{
+    m_slots[index].onComplete = publish_callback_t();
+    xQueueSend(m_free, &index, 0);
+}
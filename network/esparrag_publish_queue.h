@@ -0,0 +1,103 @@
+#ifndef ESPARRAG_PUBLISH_QUEUE_H__
+#define ESPARRAG_PUBLISH_QUEUE_H__
+
+#include "esparrag_common.h"
+#include "esparrag_time_units.h"
+#include "esparrag_mqtt_topics.h"
+#include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "etl/delegate.h"
+
+struct ePublishResult
+{
+    enum enum_type
+    {
+        QUEUED,  // serialized into a slot, will be sent when connected
+        DROPPED, // can never be sent (invalid or larger than a slot)
+        BLOCKED, // no slot freed within the wait, the caller should back off
+    };
+
+    ETL_DECLARE_ENUM_TYPE(ePublishResult, uint8_t)
+    ETL_ENUM_DEFAULT(QUEUED)
+    ETL_ENUM_DEFAULT(DROPPED)
+    ETL_ENUM_DEFAULT(BLOCKED)
+    ETL_END_ENUM_TYPE
+};
+
+struct eDelivery
+{
+    enum enum_type
+    {
+        DELIVERED, // acknowledged by the broker
+        TIMEOUT,   // no ack within the configured timeout
+        SPOOLED,   // moved to the flash spool while offline, it is replayed without tracking
+    };
+
+    ETL_DECLARE_ENUM_TYPE(eDelivery, uint8_t)
+    ETL_ENUM_DEFAULT(DELIVERED)
+    ETL_ENUM_DEFAULT(TIMEOUT)
+    ETL_ENUM_DEFAULT(SPOOLED)
+    ETL_END_ENUM_TYPE
+};
+
+// called on the mqtt task once a qos 1/2 message is acknowledged or given up on
+using publish_callback_t = etl::delegate<void(const char *topic, eDelivery delivery)>;
+
+struct publish_options_t
+{
+    uint8_t qos = 0;
+    bool cbor = false;
+    // how long Publish waits for a free slot when the queue is full
+    MilliSeconds wait = 0;
+    publish_callback_t onComplete;
+};
+
+/*
+    Bounded outbound queue of MqttClient.
+    Messages are serialized by the publishing task straight into one of a fixed number of slots,
+    so nothing but slot indices crosses tasks and memory use doesn't grow with a burst.
+    Any number of tasks can Push, only the mqtt task takes messages out (Front/Pop).
+    A qos 1/2 message keeps its slot while in flight (Detach), until it is acknowledged or times out.
+    A serialized message is limited to PAYLOAD_MAX_SIZE, a quarter of the 4 KB buffer the client used to
+    publish from. 8 slots of 4 KB would take 32 KB of ram, and a spooled record has to fit a 4 KB flash sector
+    anyway. Larger messages are DROPPED.
+*/
+class PublishQueue
+{
+public:
+    static constexpr int SLOTS_NUM = 8;
+    static constexpr int PAYLOAD_MAX_SIZE = 1024;
+
+    struct message_t
+    {
+        topic_handle_t topic;
+        uint8_t payload[PAYLOAD_MAX_SIZE];
+        size_t len;
+        uint8_t qos;
+        publish_callback_t onComplete;
+    };
+
+    // topics only names the messages in logs
+    void Init(const MqttTopics &topics);
+    // always takes ownership of msg. topic is an interned handle, only the handle is stored
+    ePublishResult Push(topic_handle_t topic, cJSON *msg, const publish_options_t &options);
+    // oldest message, stays queued until Pop so a failed send can be retried
+    message_t *Front();
+    void Pop();
+    // takes the oldest message out of the queue but keeps its slot until Release
+    uint8_t Detach();
+    message_t &Slot(uint8_t index) { return m_slots[index]; }
+    void Release(uint8_t index);
+    size_t Size() const { return m_ready ? uxQueueMessagesWaiting(m_ready) : 0; }
+
+private:
+    message_t m_slots[SLOTS_NUM]{};
+    const MqttTopics *m_topics = nullptr;
+    QueueHandle_t m_free = nullptr;
+    QueueHandle_t m_ready = nullptr;
+};
+
+#endif
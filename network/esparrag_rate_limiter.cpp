@@ -0,0 +1,47 @@
+#include "esparrag_rate_limiter.h"
+
+void RateLimiter::Configure(uint32_t requestsPerSecond, uint32_t burst)
+{
+    portENTER_CRITICAL(&m_lock);
+    m_rate = requestsPerSecond;
+    m_burst = burst;
+    m_clients.fill(client_t{});
+    portEXIT_CRITICAL(&m_lock);
+}
+
+bool RateLimiter::Allow(uint32_t clientAddress, MicroSeconds now)
+{
+    portENTER_CRITICAL(&m_lock);
+    bool allowed = allow(clientAddress, now);
+    portEXIT_CRITICAL(&m_lock);
+
+    return allowed;
+}
+
+bool RateLimiter::allow(uint32_t clientAddress, MicroSeconds now)
+{
+    if (!IsEnabled())
+        return true;
+
+    client_t *oldest = &m_clients[0];
+    for (client_t &client : m_clients)
+    {
+        if (client.inUse && client.address == clientAddress)
+        {
+            client.lastSeen = now;
+            return client.bucket.TryConsume(now);
+        }
+
+        if (!client.inUse)
+            oldest = &client;
+        else if (oldest->inUse && client.lastSeen < oldest->lastSeen)
+            oldest = &client;
+    }
+
+    oldest->inUse = true;
+    oldest->address = clientAddress;
+    oldest->lastSeen = now;
+    oldest->bucket = TokenBucket(m_rate, m_burst);
+    oldest->bucket.Reset(now);
+    return oldest->bucket.TryConsume(now);
+}
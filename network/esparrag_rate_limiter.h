@@ -0,0 +1,43 @@
+#ifndef ESPARRAG_RATE_LIMITER_H__
+#define ESPARRAG_RATE_LIMITER_H__
+
+#include "esparrag_common.h"
+#include "esparrag_time_units.h"
+#include "token_bucket.h"
+#include "etl/array.h"
+#include "freertos/FreeRTOS.h"
+
+/*
+    Per client token bucket limiter over a fixed table.
+    When the table is full the least recently seen client is evicted,
+    so a burst of new addresses costs no allocations, only fresh buckets.
+    Configure may be called while another task is in Allow, e.g. to change the limit at runtime.
+*/
+class RateLimiter
+{
+public:
+    static constexpr int CLIENTS_TABLE_SIZE = 8;
+
+    // rate == 0 disables limiting
+    void Configure(uint32_t requestsPerSecond, uint32_t burst);
+    bool Allow(uint32_t clientAddress, MicroSeconds now);
+    bool IsEnabled() const { return m_rate != 0; }
+
+private:
+    struct client_t
+    {
+        uint32_t address;
+        MicroSeconds lastSeen;
+        TokenBucket bucket;
+        bool inUse;
+    };
+
+    uint32_t m_rate = 0;
+    uint32_t m_burst = 0;
+    etl::array<client_t, CLIENTS_TABLE_SIZE> m_clients{};
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    bool allow(uint32_t clientAddress, MicroSeconds now);
+};
+
+#endif
@@ -13,12 +13,14 @@ struct Response
         enum enum_type
         {
             JSON,
-            HTML
+            HTML,
+            CBOR
         };
 
         ETL_DECLARE_ENUM_TYPE(FORMAT, uint8_t)
         ETL_ENUM_TYPE(JSON, "application/json")
         ETL_ENUM_TYPE(HTML, "text/html")
+        ETL_ENUM_TYPE(CBOR, "application/cbor")
         ETL_END_ENUM_TYPE
     };
 
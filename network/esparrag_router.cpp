@@ -0,0 +1,64 @@
+#include "esparrag_router.h"
+#include "esparrag_log.h"
+#include <cstring>
+
+static bool methodMatch(eMethod route, eMethod method)
+{
+    return route == method || route == eMethod::GENERAL || method == eMethod::GENERAL;
+}
+
+eResult Router::On(const char *uri, eMethod method, request_handler_t handler)
+{
+    if (!uri || uri[0] != '/' || !handler.is_valid() || strlen(uri) > URI_MAX_LEN)
+    {
+        ESPARRAG_LOG_ERROR("invalid route %s", uri ? uri : "");
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
+
+    if (m_routes.full())
+    {
+        ESPARRAG_LOG_ERROR("maximum amount of routes have been registered");
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
+
+    for (const route_t &route : m_routes)
+    {
+        if (route.uri == uri && methodMatch(route.method, method))
+        {
+            ESPARRAG_LOG_ERROR("route for %s already exists", uri);
+            return eResult::ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    m_routes.push_back({.cb = handler, .uri = uri, .method = method});
+    return eResult::SUCCESS;
+}
+
+const Router::route_t *Router::Find(const char *uri, eMethod method) const
+{
+    for (const route_t &route : m_routes)
+    {
+        if (route.uri == uri && (route.method == method || route.method == eMethod::GENERAL))
+            return &route;
+    }
+
+    return nullptr;
+}
+
+bool Router::Dispatch(Request &request, Response &response) const
+{
+    const route_t *route = Find(request.m_uri, request.m_method);
+    if (route)
+    {
+        route->cb(request, response);
+        return true;
+    }
+
+    bool uriFound = false;
+    for (const route_t &route : m_routes)
+        uriFound |= route.uri == request.m_uri;
+
+    ESPARRAG_LOG_ERROR("no route for %s, method %d", request.m_uri, request.m_method.get_value());
+    response.m_code = uriFound ? Response::CODE::HTTP_CODE_METHOD_NOT_ALLOWED : Response::CODE::HTTP_CODE_NOT_FOUND;
+    return false;
+}
@@ -0,0 +1,46 @@
+#ifndef ESPARRAG_ROUTER_H__
+#define ESPARRAG_ROUTER_H__
+
+#include "esparrag_common.h"
+#include "esparrag_request.h"
+#include "esparrag_response.h"
+#include "etl/delegate.h"
+#include "etl/string.h"
+#include "etl/vector.h"
+
+using request_handler_t = etl::delegate<void(Request &, Response &)>;
+
+/*
+    Transport agnostic handler table, a uri and method map to a single handler.
+    HttpServer, MqttRpc and EspNow all dispatch into a router, so a handler registered once serves every transport.
+    Routes are added during setup and only read afterwards, transports on different tasks share it without locks.
+
+    Router router;
+    router.On("/relay", eMethod::POST, request_handler_t::create<Relay, &Relay::OnSet>(relay));
+    server.On(router);
+    rpc.On(router);
+*/
+class Router
+{
+public:
+    static constexpr int ROUTES_MAX_NUM = 20;
+    static constexpr int URI_MAX_LEN = 15;
+
+    struct route_t
+    {
+        request_handler_t cb;
+        etl::string<URI_MAX_LEN> uri;
+        eMethod method;
+    };
+
+    eResult On(const char *uri, eMethod method, request_handler_t handler);
+    const route_t *Find(const char *uri, eMethod method) const;
+    // runs the matching handler, otherwise sets 404 or 405 on the response and returns false
+    bool Dispatch(Request &request, Response &response) const;
+    size_t Size() const { return m_routes.size(); }
+
+private:
+    etl::vector<route_t, ROUTES_MAX_NUM> m_routes;
+};
+
+#endif
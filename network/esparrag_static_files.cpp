@@ -0,0 +1,109 @@
+#include "esparrag_static_files.h"
+#include "esparrag_log.h"
+#include <cstring>
+
+eResult StaticFiles::Init(const char *partitionLabel)
+{
+    if (IsInitialized())
+    {
+        ESPARRAG_LOG_WARNING("static files already initialized");
+        return eResult::ERROR_INVALID_STATE;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY,
+                                                                partitionLabel);
+    if (partition == nullptr)
+    {
+        ESPARRAG_LOG_ERROR("partition %s not found", partitionLabel);
+        return eResult::ERROR_FLASH_NOT_FOUND;
+    }
+
+    const void *mapped = nullptr;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &m_mmapHandle);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("partition mmap failed, err %d", err);
+        return eResult::ERROR_FLASH;
+    }
+
+    eResult res = Init(reinterpret_cast<const uint8_t *>(mapped), partition->size);
+    if (res != eResult::SUCCESS)
+    {
+        spi_flash_munmap(m_mmapHandle);
+        m_mmapHandle = {};
+    }
+
+    return res;
+}
+
+eResult StaticFiles::Init(const uint8_t *image, size_t size)
+{
+    if (!image || size < sizeof(image_header_t))
+    {
+        ESPARRAG_LOG_ERROR("invalid static files image");
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
+
+    const image_header_t *header = reinterpret_cast<const image_header_t *>(image);
+    if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION)
+    {
+        ESPARRAG_LOG_ERROR("static files image not found (magic %x, version %d)", header->magic, header->version);
+        return eResult::ERROR_NOT_FOUND;
+    }
+
+    size_t indexEnd = sizeof(image_header_t) + header->count * sizeof(image_entry_t);
+    if (header->size > size || indexEnd > header->size)
+    {
+        ESPARRAG_LOG_ERROR("static files image is corrupted");
+        return eResult::ERROR_FLASH;
+    }
+
+    const image_entry_t *entries = reinterpret_cast<const image_entry_t *>(image + sizeof(image_header_t));
+    for (size_t i = 0; i < header->count; i++)
+    {
+        if (entries[i].offset < indexEnd || entries[i].offset + entries[i].size > header->size)
+        {
+            ESPARRAG_LOG_ERROR("static file %.*s is out of bounds", PATH_MAX_LEN, entries[i].path);
+            return eResult::ERROR_FLASH;
+        }
+    }
+
+    m_image = image;
+    m_imageSize = header->size;
+    m_entries = entries;
+    m_count = header->count;
+
+    ESPARRAG_LOG_INFO("static files ready, %d files, %d bytes", m_count, m_imageSize);
+    return eResult::SUCCESS;
+}
+
+bool StaticFiles::Find(const char *uri, file_t &file) const
+{
+    if (!IsInitialized() || !uri)
+        return false;
+
+    // ignore the query string
+    size_t uriLen = strcspn(uri, "?");
+    if (uriLen == 1 && uri[0] == '/')
+    {
+        uri = "/index.html";
+        uriLen = strlen(uri);
+    }
+
+    for (size_t i = 0; i < m_count; i++)
+    {
+        const image_entry_t &entry = m_entries[i];
+        if (strnlen(entry.path, PATH_MAX_LEN) == uriLen && strncmp(entry.path, uri, uriLen) == 0)
+        {
+            file.path = entry.path;
+            file.mime = entry.mime;
+            file.data = m_image + entry.offset;
+            file.size = entry.size;
+            file.etag = entry.etag;
+            return true;
+        }
+    }
+
+    return false;
+}
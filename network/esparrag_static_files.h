@@ -0,0 +1,66 @@
+#ifndef ESPARRAG_STATIC_FILES_H__
+#define ESPARRAG_STATIC_FILES_H__
+
+#include "esparrag_common.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+/*
+    Read only web assets, packed at build time by tools/pack_www.py.
+    Every file is stored gzipped and served as is, straight out of memory mapped flash.
+
+    Image layout (little endian):
+    image_header_t | image_entry_t[count] | gzipped file data...
+*/
+class StaticFiles
+{
+public:
+    static constexpr const char *PARTITION_LABEL = "www";
+    static constexpr uint32_t IMAGE_MAGIC = 0x57575745; // "EWWW"
+    static constexpr uint16_t IMAGE_VERSION = 1;
+    static constexpr int PATH_MAX_LEN = 48;
+    static constexpr int MIME_MAX_LEN = 32;
+
+    struct file_t
+    {
+        const char *path;
+        const char *mime;
+        const uint8_t *data;
+        size_t size;
+        uint32_t etag;
+    };
+
+    // map the packed image from a flash partition
+    eResult Init(const char *partitionLabel = PARTITION_LABEL);
+    // use a packed image that is already addressable (e.g. EMBED_FILES)
+    eResult Init(const uint8_t *image, size_t size);
+
+    bool Find(const char *uri, file_t &file) const;
+    bool IsInitialized() const { return m_entries != nullptr; }
+
+private:
+    struct image_header_t
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t count;
+        uint32_t size;
+    } __attribute__((packed));
+
+    struct image_entry_t
+    {
+        char path[PATH_MAX_LEN];
+        char mime[MIME_MAX_LEN];
+        uint32_t offset;
+        uint32_t size;
+        uint32_t etag;
+    } __attribute__((packed));
+
+    const uint8_t *m_image = nullptr;
+    size_t m_imageSize = 0;
+    const image_entry_t *m_entries = nullptr;
+    uint16_t m_count = 0;
+    spi_flash_mmap_handle_t m_mmapHandle{};
+};
+
+#endif
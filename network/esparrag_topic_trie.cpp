@@ -0,0 +1,118 @@
+#include "esparrag_topic_trie.h"
+#include <cstring>
+
+static size_t levelLen(const char *topic)
+{
+    const char *end = strchr(topic, '/');
+    return end ? end - topic : strlen(topic);
+}
+
+static bool levelIs(const char *level, const char *topic, size_t len)
+{
+    return strncmp(level, topic, len) == 0 && level[len] == '\0';
+}
+
+bool TopicTrie::Insert(const char *filter, uint8_t id)
+{
+    if (!filter || id >= IDS_MAX_NUM)
+        return false;
+
+    int16_t parent = NONE;
+    int16_t node = NONE;
+    for (const char *level = filter;; level += levelLen(level) + 1)
+    {
+        size_t len = levelLen(level);
+        bool last = level[len] == '\0';
+
+        // wildcards must fill a whole level, '#' only as the last one
+        bool wildcard = memchr(level, '+', len) || memchr(level, '#', len);
+        if (len > LEVEL_MAX_LEN || (wildcard && len != 1) || (level[0] == '#' && !last))
+            return false;
+
+        node = findChild(parent == NONE ? m_root : m_nodes[parent].child, level, len);
+        if (node == NONE)
+            node = addChild(parent, level, len);
+        if (node == NONE)
+            return false;
+
+        if (last)
+            break;
+
+        parent = node;
+    }
+
+    m_nodes[node].ids |= 1u << id;
+    return true;
+}
+
+uint32_t TopicTrie::Match(const char *topic) const
+{
+    if (!topic)
+        return 0;
+
+    return match(m_root, topic);
+}
+
+uint32_t TopicTrie::match(int16_t first, const char *topic) const
+{
+    size_t len = levelLen(topic);
+    bool last = topic[len] == '\0';
+    uint32_t ids = 0;
+
+    for (int16_t i = first; i != NONE; i = m_nodes[i].sibling)
+    {
+        const node_t &node = m_nodes[i];
+
+        // '#' also matches the parent level itself, "a/#" matches "a"
+        if (levelIs(node.level, "#", 1))
+        {
+            ids |= node.ids;
+            continue;
+        }
+
+        if (!levelIs(node.level, "+", 1) && !levelIs(node.level, topic, len))
+            continue;
+
+        if (!last)
+        {
+            ids |= match(node.child, topic + len + 1);
+            continue;
+        }
+
+        ids |= node.ids;
+        for (int16_t child = node.child; child != NONE; child = m_nodes[child].sibling)
+        {
+            if (levelIs(m_nodes[child].level, "#", 1))
+                ids |= m_nodes[child].ids;
+        }
+    }
+
+    return ids;
+}
+
+int16_t TopicTrie::findChild(int16_t first, const char *level, size_t len) const
+{
+    for (int16_t i = first; i != NONE; i = m_nodes[i].sibling)
+    {
+        if (levelIs(m_nodes[i].level, level, len))
+            return i;
+    }
+
+    return NONE;
+}
+
+int16_t TopicTrie::addChild(int16_t parent, const char *level, size_t len)
+{
+    if (m_nodes.full())
+        return NONE;
+
+    node_t node{};
+    memcpy(node.level, level, len);
+    node.child = NONE;
+    node.sibling = parent == NONE ? m_root : m_nodes[parent].child;
+    m_nodes.push_back(node);
+
+    int16_t index = m_nodes.size() - 1;
+    (parent == NONE ? m_root : m_nodes[parent].child) = index;
+    return index;
+}
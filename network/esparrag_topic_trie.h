@@ -0,0 +1,55 @@
+#ifndef ESPARRAG_TOPIC_TRIE_H__
+#define ESPARRAG_TOPIC_TRIE_H__
+
+#include "etl/vector.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Mqtt topic filters stored level by level in a fixed node pool.
+    Each filter marks up to 32 handler ids on its last node,
+    a lookup walks the topic levels once and returns the ids of every matching filter as a bit mask.
+    Supports the mqtt wildcards, '+' for a single level and a trailing '#' for any number of levels.
+
+    TopicTrie trie;
+    trie.Insert("/dev/+/set", 0);
+    trie.Insert("/dev/#", 1);
+    uint32_t ids = trie.Match("/dev/relay/set"); // 0b11
+*/
+class TopicTrie
+{
+public:
+    static constexpr int NODES_MAX_NUM = 64;
+    static constexpr int LEVEL_MAX_LEN = 23;
+    static constexpr int IDS_MAX_NUM = 32;
+
+    // false if the filter is invalid or the pool is exhausted
+    bool Insert(const char *filter, uint8_t id);
+    uint32_t Match(const char *topic) const;
+    void Clear()
+    {
+        m_nodes.clear();
+        m_root = NONE;
+    }
+
+private:
+    static constexpr int16_t NONE = -1;
+
+    struct node_t
+    {
+        char level[LEVEL_MAX_LEN + 1];
+        int16_t child;
+        int16_t sibling;
+        uint32_t ids;
+    };
+
+    // the root is implicit, its children start at m_root
+    etl::vector<node_t, NODES_MAX_NUM> m_nodes;
+    int16_t m_root = NONE;
+
+    int16_t findChild(int16_t first, const char *level, size_t len) const;
+    int16_t addChild(int16_t parent, const char *level, size_t len);
+    uint32_t match(int16_t first, const char *topic) const;
+};
+
+#endif
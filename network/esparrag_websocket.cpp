@@ -0,0 +1,164 @@
+#include "esparrag_websocket.h"
+#include "esparrag_log.h"
+#include "etl/algorithm.h"
+#include <cstring>
+
+WebSocket::WebSocket(const char *uri) : m_uri(uri)
+{
+    ESPARRAG_ASSERT(uri && uri[0] == '/');
+
+    m_freeSlots = xQueueCreate(SEND_QUEUE_LENGTH, sizeof(uint8_t));
+    ESPARRAG_ASSERT(m_freeSlots != nullptr);
+    for (uint8_t i = 0; i < SEND_QUEUE_LENGTH; i++)
+    {
+        m_slots[i].owner = this;
+        xQueueSend(m_freeSlots, &i, 0);
+    }
+}
+
+eResult WebSocket::Broadcast(const char *frame, size_t len, httpd_ws_type_t type)
+{
+    if (!frame || len > FRAME_MAX_SIZE)
+    {
+        ESPARRAG_LOG_ERROR("invalid websocket frame, len %d", len);
+        return eResult::ERROR_INVALID_PARAMETER;
+    }
+
+    if (!m_server)
+        return eResult::ERROR_INVALID_STATE;
+
+    if (m_clients.empty())
+        return eResult::SUCCESS;
+
+    uint8_t index = 0;
+    if (xQueueReceive(m_freeSlots, &index, 0) != pdTRUE)
+    {
+        ESPARRAG_LOG_WARNING("websocket %s send queue full, frame dropped", m_uri.c_str());
+        return eResult::ERROR_MEMORY;
+    }
+
+    frame_slot_t &slot = m_slots[index];
+    slot.type = type;
+    slot.len = len;
+    memcpy(slot.data, frame, len);
+
+    esp_err_t err = httpd_queue_work(m_server, sendWork, &slot);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("websocket queue work failed, err %d", err);
+        releaseSlot(&slot);
+        return eResult::ERROR_GENERAL;
+    }
+
+    return eResult::SUCCESS;
+}
+
+// runs on the http server task
+void WebSocket::sendWork(void *arg)
+{
+    frame_slot_t *slot = reinterpret_cast<frame_slot_t *>(arg);
+    WebSocket *ws = slot->owner;
+
+    httpd_ws_frame_t frame{};
+    frame.final = true;
+    frame.type = slot->type;
+    frame.payload = slot->data;
+    frame.len = slot->len;
+
+    for (size_t i = 0; i < ws->m_clients.size();)
+    {
+        int fd = ws->m_clients[i];
+        bool connected = httpd_ws_get_fd_info(ws->m_server, fd) == HTTPD_WS_CLIENT_WEBSOCKET;
+        if (!connected || httpd_ws_send_frame_async(ws->m_server, fd, &frame) != ESP_OK)
+        {
+            ESPARRAG_LOG_INFO("websocket client %d removed", fd);
+            ws->removeClient(fd);
+            continue;
+        }
+
+        i++;
+    }
+
+    ws->releaseSlot(slot);
+}
+
+esp_err_t WebSocket::handler(httpd_req_t *esp_request)
+{
+    WebSocket *ws = reinterpret_cast<WebSocket *>(esp_request->user_ctx);
+
+    //the handshake is the only GET request, everything after are frames
+    if (esp_request->method == HTTP_GET)
+    {
+        return ws->addClient(httpd_req_to_sockfd(esp_request)) ? ESP_OK : ESP_FAIL;
+    }
+
+    return ws->receive(esp_request);
+}
+
+esp_err_t WebSocket::receive(httpd_req_t *esp_request)
+{
+    static uint8_t buffer[FRAME_MAX_SIZE + 1];
+
+    httpd_ws_frame_t frame{};
+    esp_err_t err = httpd_ws_recv_frame(esp_request, &frame, 0);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("websocket frame length read failed, err %d", err);
+        return err;
+    }
+
+    if (frame.len > FRAME_MAX_SIZE)
+    {
+        ESPARRAG_LOG_ERROR("websocket frame too big, len %d", frame.len);
+        return ESP_FAIL;
+    }
+
+    memset(buffer, 0, sizeof(buffer));
+    frame.payload = buffer;
+    err = httpd_ws_recv_frame(esp_request, &frame, frame.len);
+    if (err != ESP_OK)
+    {
+        ESPARRAG_LOG_ERROR("websocket frame read failed, err %d", err);
+        return err;
+    }
+
+    if (frame.type == HTTPD_WS_TYPE_CLOSE)
+    {
+        removeClient(httpd_req_to_sockfd(esp_request));
+        return ESP_OK;
+    }
+
+    if (m_receiveCallback.is_valid() && (frame.type == HTTPD_WS_TYPE_TEXT || frame.type == HTTPD_WS_TYPE_BINARY))
+        m_receiveCallback(httpd_req_to_sockfd(esp_request), frame.payload, frame.len);
+
+    return ESP_OK;
+}
+
+bool WebSocket::addClient(int fd)
+{
+    if (etl::find(m_clients.begin(), m_clients.end(), fd) != m_clients.end())
+        return true;
+
+    if (m_clients.full())
+    {
+        ESPARRAG_LOG_WARNING("websocket %s has maximum clients", m_uri.c_str());
+        return false;
+    }
+
+    m_clients.push_back(fd);
+    ESPARRAG_LOG_INFO("websocket %s client %d connected", m_uri.c_str(), fd);
+    return true;
+}
+
+void WebSocket::removeClient(int fd)
+{
+    auto it = etl::find(m_clients.begin(), m_clients.end(), fd);
+    if (it != m_clients.end())
+        m_clients.erase(it);
+}
+
+void WebSocket::releaseSlot(frame_slot_t *slot)
+{
+    uint8_t index = slot - m_slots;
+    ESPARRAG_ASSERT(xQueueSend(m_freeSlots, &index, 0) == pdTRUE);
+}
@@ -0,0 +1,75 @@
+#ifndef ESPARRAG_WEBSOCKET_H__
+#define ESPARRAG_WEBSOCKET_H__
+
+#include "esparrag_common.h"
+#include "esp_http_server.h"
+#include "etl/delegate.h"
+#include "etl/string.h"
+#include "etl/vector.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#if !CONFIG_HTTPD_WS_SUPPORT
+#error "WebSocket requires CONFIG_HTTPD_WS_SUPPORT"
+#endif
+
+/*
+    A websocket route of HttpServer.
+    Broadcast copies a serialized frame into one of a few preallocated slots,
+    the fan out to all connected clients happens later on the http server task.
+    When all slots are taken the frame is dropped, so a slow client never blocks the caller.
+
+    WebSocket ws("/ws");
+    server.On(ws);
+    ...
+    ws.Broadcast(json, strlen(json));
+*/
+class WebSocket
+{
+public:
+    static constexpr int URI_MAX_LEN = 15;
+    static constexpr int CLIENTS_MAX_NUM = 4;
+    static constexpr int FRAME_MAX_SIZE = 512;
+    static constexpr int SEND_QUEUE_LENGTH = 4;
+
+    using ws_receive_callback = etl::delegate<void(int fd, const uint8_t *data, size_t len)>;
+
+    WebSocket(const char *uri);
+
+    void OnReceive(ws_receive_callback callback) { m_receiveCallback = callback; }
+    eResult Broadcast(const char *frame, size_t len, httpd_ws_type_t type = HTTPD_WS_TYPE_TEXT);
+    size_t ClientsNum() const { return m_clients.size(); }
+    const char *Uri() const { return m_uri.c_str(); }
+
+private:
+    friend class HttpServer;
+
+    struct frame_slot_t
+    {
+        WebSocket *owner;
+        httpd_ws_type_t type;
+        size_t len;
+        uint8_t data[FRAME_MAX_SIZE];
+    };
+
+    etl::string<URI_MAX_LEN> m_uri;
+    ws_receive_callback m_receiveCallback;
+    httpd_handle_t m_server = nullptr;
+    etl::vector<int, CLIENTS_MAX_NUM> m_clients;
+    frame_slot_t m_slots[SEND_QUEUE_LENGTH]{};
+    QueueHandle_t m_freeSlots = nullptr;
+
+    void attach(httpd_handle_t server) { m_server = server; }
+    bool addClient(int fd);
+    void removeClient(int fd);
+    void releaseSlot(frame_slot_t *slot);
+    esp_err_t receive(httpd_req_t *esp_request);
+
+    static esp_err_t handler(httpd_req_t *esp_request);
+    static void sendWork(void *arg);
+
+    WebSocket(const WebSocket &) = delete;
+    WebSocket &operator=(const WebSocket &) = delete;
+};
+
+#endif
@@ -2,9 +2,12 @@
 #include <cstring>
 #include <cstdlib>
 #include "esparrag_log.h"
+#include "etl/algorithm.h"
 
 using namespace WifiFSM;
 
+// posted by the retry timer, so the retry runs on the event loop like every other wifi event
+ESP_EVENT_DEFINE_BASE(WIFI_RETRY_EVENT);
 
 void Wifi::eventHandler(void *event_handler_arg,
                         esp_event_base_t event_base,
@@ -53,6 +56,8 @@ void Wifi::eventHandler(void *event_handler_arg,
         }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         wifi->Dispatch(EVENT_GotIP{});
+    } else if (event_base == WIFI_RETRY_EVENT) {
+        wifi->Dispatch(EVENT_Retry{});
     }
 }
 
@@ -102,6 +107,9 @@ void Wifi::Init()
         return;
     }
 
+    m_retryTimer = xTimerCreate("wifi_retry", 1, pdFALSE, this, retryTimerCB);
+    configASSERT(m_retryTimer != nullptr);
+
     Start();
     return;
 }
@@ -147,10 +155,12 @@ bool Wifi::Disconnect() {
 // ENTRY FUNCTIONS
 void Wifi::on_entry(STATE_Offline&) {
     ESPARRAG_LOG_INFO("wifi Offline\n");
+    cancelRetry();
 }
 
 void Wifi::on_entry(STATE_AP&) {
     ESPARRAG_LOG_INFO("wifi is ap\n");
+    cancelRetry();
 }
 
 void Wifi::on_entry(STATE_Connecting& state) {
@@ -160,8 +170,8 @@ void Wifi::on_entry(STATE_Connecting& state) {
 
 void Wifi::on_entry(STATE_Connected&) {
     ESPARRAG_LOG_INFO("wifi connected\n");
-
-    m_retry_count = 0;
+    cancelRetry();
+    m_reconnect.OnSuccess();
 }
 
 
@@ -204,18 +214,13 @@ return_state_t Wifi::on_event(STATE_AP &, EVENT_UserConnected &) {
 //Connecting
 return_state_t Wifi::on_event(STATE_Connecting &, EVENT_LoseConnection &) {
     ESPARRAG_LOG_INFO("state Connecting got LoseConnection event\n");
-    m_retry_count++;
-
-    if (m_retry_count > MAX_RETRIES) {
-        ESPARRAG_LOG_ERROR("WIFI RETRT COUNT EXCEEDED %d. RESETTING", MAX_RETRIES);
-        esp_restart();
-    }
-
+    scheduleRetry();
     return std::nullopt;
 }
 
 return_state_t Wifi::on_event(STATE_Connecting &, EVENT_StaStart&) {
     ESPARRAG_LOG_INFO("state Connecting got StaStart event\n");
+    m_reconnect.OnAttempt();
     sta_connect();
     return std::nullopt;
 }
@@ -230,6 +235,13 @@ return_state_t Wifi::on_event(STATE_Connecting &, EVENT_GotIP &) {
     return STATE_Connected{};
 }
 
+return_state_t Wifi::on_event(STATE_Connecting &, EVENT_Retry &) {
+    ESPARRAG_LOG_INFO("state Connecting got Retry event\n");
+    m_reconnect.OnAttempt();
+    sta_connect();
+    return std::nullopt;
+}
+
 //Connected
 return_state_t Wifi::on_event(STATE_Connected &, EVENT_LoseConnection &event) {
     ESPARRAG_LOG_INFO("state Connected got LoseConnection event\n");
@@ -238,7 +250,8 @@ return_state_t Wifi::on_event(STATE_Connected &, EVENT_LoseConnection &event) {
         return STATE_Offline{};
     }
 
-
+    // the station is already started, entering Connecting won't bring a StaStart event
+    scheduleRetry();
     return STATE_Connecting{};
 }
 
@@ -301,6 +314,32 @@ bool Wifi::sta_connect()
     return true;
 }
 
+void Wifi::scheduleRetry()
+{
+    MilliSeconds delay = m_reconnect.OnFailure();
+    const ReconnectPolicy::reconnect_stats_t &stats = m_reconnect.Stats();
+    ESPARRAG_LOG_INFO("wifi retry in %u ms, %u failures in a row, breaker %s\n",
+                      delay.value(), stats.consecutiveFailures, ReconnectPolicy::StateName(stats.state));
+
+    xTimerChangePeriod(m_retryTimer, etl::max<TickType_t>(delay.toTicks(), 1), 0);
+}
+
+void Wifi::cancelRetry()
+{
+    if (m_retryTimer)
+        xTimerStop(m_retryTimer, 0);
+}
+
+// runs on the timer task, the fsm isn't touched here. a retry that finds the state changed is ignored
+void Wifi::retryTimerCB(TimerHandle_t timer)
+{
+    if (esp_event_post(WIFI_RETRY_EVENT, 0, nullptr, 0, 0) != ESP_OK)
+    {
+        ESPARRAG_LOG_WARNING("wifi event loop full, retry postponed\n");
+        xTimerReset(timer, 0);
+    }
+}
+
 void Wifi::disconnect()
 {
     esp_wifi_disconnect();
@@ -6,6 +6,8 @@
 #include "fsm_taskless.h"
 #include "etl/string.h"
 #include "esp_wifi.h"
+#include "reconnect_policy.h"
+#include "freertos/timers.h"
 #include <variant>
 
 
@@ -32,20 +34,21 @@ struct EVENT_LoseConnection{
 };
 struct EVENT_UserConnected{};
 struct EVENT_GotIP{};
-using Events = std::variant<EVENT_APStart, EVENT_APStop, EVENT_Disconnect, EVENT_StaConnect, EVENT_StaStart, EVENT_StaConnected, EVENT_LoseConnection, EVENT_UserConnected, EVENT_GotIP>;
+struct EVENT_Retry{};
+using Events = std::variant<EVENT_APStart, EVENT_APStop, EVENT_Disconnect, EVENT_StaConnect, EVENT_StaStart, EVENT_StaConnected, EVENT_LoseConnection, EVENT_UserConnected, EVENT_GotIP, EVENT_Retry>;
 
 } // namespace WifiFSM
 
 class Wifi : public FsmTaskless<Wifi, WifiFSM::States, WifiFSM::Events>
 {
-    static constexpr int MAX_RETRIES = 15;
-
 public:
     Wifi();
     void Init();
     bool Connect(const SSID_T& ssid, const PASSWORD_T& password);
     bool SwitchToAP();
     bool Disconnect();
+    void ConfigureReconnect(const reconnect_config_t &config) { m_reconnect.Configure(config); }
+    const ReconnectPolicy::reconnect_stats_t &GetReconnectStats() const { return m_reconnect.Stats(); }
 
     void on_entry(WifiFSM::STATE_Offline&);
     void on_entry(WifiFSM::STATE_AP&);
@@ -67,6 +70,7 @@ public:
     return_state_t on_event(WifiFSM::STATE_Connecting &, WifiFSM::EVENT_StaStart &);
     return_state_t on_event(WifiFSM::STATE_Connecting &, WifiFSM::EVENT_StaConnected &);
     return_state_t on_event(WifiFSM::STATE_Connecting &, WifiFSM::EVENT_GotIP &);
+    return_state_t on_event(WifiFSM::STATE_Connecting &, WifiFSM::EVENT_Retry &);
     // Connected
     return_state_t on_event(WifiFSM::STATE_Connected &, WifiFSM::EVENT_LoseConnection &);
     return_state_t on_event(WifiFSM::STATE_Connected &, WifiFSM::EVENT_GotIP &);
@@ -85,14 +89,18 @@ private:
     void disconnect();
     bool sta_start();
     bool sta_connect();
-
+    void scheduleRetry();
+    void cancelRetry();
 
     static constexpr char AP_SSID[] = DEVICE_NAME;
     static constexpr char AP_PASSWORD[] = "heihei22";
 
     SSID_T m_ssid{};
     PASSWORD_T m_password{};
-    int m_retry_count = 0;
+    ReconnectPolicy m_reconnect;
+    TimerHandle_t m_retryTimer = nullptr;
+
+    static void retryTimerCB(TimerHandle_t timer);
 
     static void eventHandler(void *event_handler_arg,
                              esp_event_base_t event_base,
@@ -0,0 +1,556 @@
+#!/usr/bin/env python3
+"""Host-side radio simulator for the ESP-NOW transport (network/esparrag_espnow.h).
+
+Simulates N nodes sharing one 2.4GHz channel and running the EspNow protocol:
+a fixed send queue with one frame on air at a time, radio level retries with
+CSMA/CA backoff and acks, application attempts on a failed send callback,
+duplicate suppression by the last seq of each peer, a fixed number of inbound
+slots in front of a single espnow task, and Call requests answered by a
+handler with a reply frame.
+
+The medium models airtime at the chosen PHY rate, carrier sense, collisions of
+overlapping frames at a receiver and random per link loss. Every node issues
+Calls at --rate per second (poisson) to a target picked by --pattern, and the
+run reports call latency (queued to reply handled), loss, goodput and airtime.
+Several node counts can be given to compare, "--nodes 2,4,8,16".
+
+--mesh runs the EspNowMesh relay (network/esparrag_espnow_mesh.h) instead:
+every node floods messages at --rate, relayed with a ttl, a seen ring for
+duplicates and a token bucket on rebroadcasts. It reports the share of nodes
+reached, delivery latency, hops and the frames (airtime) each message costs.
+--topology line or grid places nodes --range apart in radio range units, so
+floods have to travel several hops.
+
+Exits with 1 when --max-loss or --max-p99 is exceeded, so it can gate changes to
+the protocol constants. Results are reproducible for a given --seed.
+
+usage: espnow_sim.py [--nodes 2,8] [--pattern pairs|star|random] [--rate 20] [--payload 32]
+                     [--loss 0.02] [--duration 10] [--phy 1] [--topology full|line|grid] [--range 1]
+       espnow_sim.py --mesh [--ttl 4] [--relay-rate 20] [--relay-burst 8] --topology line --nodes 8
+"""
+import argparse
+import collections
+import heapq
+import math
+import random
+import sys
+
+# EspNow constants
+SEND_QUEUE_SIZE = 8
+INBOUND_SLOTS_NUM = 4
+PENDING_MAX_NUM = 4
+MAX_ATTEMPTS = 3
+REPLY_TIMEOUT_US = 100_000
+SWEEP_PERIOD_US = 10_000
+HEADER_SIZE = 4
+FRAME_MAX_SIZE = 250
+FRAME_DATA, FRAME_REQUEST, FRAME_REPLY, FRAME_MESH = 1, 2, 3, 4
+BROADCAST = -1
+
+# EspNowMesh constants
+MESH_HEADER_SIZE = 10
+SEEN_NUM = 32
+
+# 802.11b/g timing, esp-now frames are vendor specific action frames
+SLOT_US = 20
+SIFS_US = 10
+DIFS_US = SIFS_US + 2 * SLOT_US
+CW_MIN = 31
+CW_MAX = 1023
+MAC_RETRIES = 7
+MAC_OVERHEAD = 43  # mac header, action category, vendor element and fcs
+ACK_SIZE = 14
+
+
+class Radio:
+    def __init__(self, rate_mbps):
+        self.rate = rate_mbps
+        # dsss long preamble at 1 and 2 Mbps, ofdm above 11
+        self.preamble = 192 if rate_mbps <= 11 else 20
+
+    def airtime(self, size):
+        return self.preamble + int((size * 8) / self.rate + 0.999)
+
+    @property
+    def ack_time(self):
+        return self.airtime(ACK_SIZE)
+
+
+class Transmission:
+    __slots__ = ("sender", "start", "end")
+
+    def __init__(self, sender, start, end):
+        self.sender = sender
+        self.start = start
+        self.end = end
+
+
+def topology(kind, nodes, spacing):
+    """Nodes each node hears, placed `spacing` radio ranges apart."""
+    if kind == "full":
+        return {n: set(range(nodes)) - {n} for n in range(nodes)}
+
+    columns = nodes if kind == "line" else math.ceil(math.sqrt(nodes))
+    position = [(n % columns * spacing, n // columns * spacing) for n in range(nodes)]
+    return {n: {m for m in range(nodes) if m != n and math.dist(position[n], position[m]) <= 1.0 + 1e-9}
+            for n in range(nodes)}
+
+
+class Medium:
+    """One channel, every node hears the nodes in its `links`."""
+
+    def __init__(self, sim, links, loss):
+        self.sim = sim
+        self.links = links
+        self.loss = loss
+        self.active = []
+        self.busy_us = 0
+        self.collisions = 0
+
+    def audible(self, node):
+        """End of the latest transmission node hears right now, 0 when the channel is idle."""
+        now = self.sim.now
+        ends = [tx.end for tx in self.active if tx.end > now and (tx.sender == node or tx.sender in self.links[node])]
+        return max(ends, default=0)
+
+    def transmit(self, sender, duration):
+        now = self.sim.now
+        self.active = [tx for tx in self.active if tx.end > now - 2 * FRAME_MAX_SIZE * 8]
+        tx = Transmission(sender, now, now + duration)
+        self.active.append(tx)
+        self.busy_us += duration
+        return tx
+
+    def received(self, tx, receiver):
+        """Whether receiver decoded tx, checked once tx ended."""
+        if tx.sender not in self.links[receiver]:
+            return False
+
+        for other in self.active:
+            if other is tx or other.end <= tx.start or other.start >= tx.end:
+                continue
+            # half duplex, or another frame overlapping at the receiver
+            if other.sender == receiver or other.sender in self.links[receiver]:
+                self.collisions += 1
+                return False
+
+        return self.sim.rng.random() >= self.loss
+
+
+class Frame:
+    __slots__ = ("dest", "type", "seq", "size", "queued", "call", "attempts", "request_seq", "mesh")
+
+    def __init__(self, dest, kind, seq, size, queued, call=False, request_seq=None, mesh=None):
+        self.dest = dest
+        self.type = kind
+        self.seq = seq
+        self.size = size
+        self.queued = queued
+        self.call = call
+        self.attempts = 1
+        self.request_seq = request_seq
+        # origin, id, ttl, hops
+        self.mesh = mesh
+
+
+class Node:
+    def __init__(self, sim, index):
+        self.sim = sim
+        self.index = index
+        self.queue = []
+        self.sending = False
+        self.mac_attempt = 0
+        self.cw = CW_MIN
+        self.next_seq = sim.rng.randrange(1 << 16)
+        self.last_seq = {}
+        self.pending = {}
+        self.inbound = 0
+        self.cpu_free = 0
+        self.seen = collections.deque(maxlen=SEEN_NUM)
+        self.next_id = 0
+        self.tokens = sim.relay_burst
+        self.refilled = 0
+
+    # ------------------------------------------------------------------ sending
+
+    def push(self, dest, kind, size, call=False, request_seq=None, mesh=None):
+        if len(self.queue) >= SEND_QUEUE_SIZE:
+            return False
+
+        frame = Frame(dest, kind, self.next_seq, HEADER_SIZE + size, self.sim.now, call, request_seq, mesh)
+        self.next_seq = (self.next_seq + 1) & 0xFFFF
+        self.queue.append(frame)
+        if not self.sending:
+            self.send_next()
+        return True
+
+    def send_next(self):
+        if not self.queue:
+            self.sending = False
+            return
+
+        self.sending = True
+        self.mac_attempt = 0
+        self.cw = CW_MIN
+        self.access(self.sim.now)
+
+    def access(self, at):
+        backoff = DIFS_US + self.sim.rng.randint(0, self.cw) * SLOT_US
+        self.sim.at(at + backoff, self.try_transmit)
+
+    def try_transmit(self):
+        busy_until = self.sim.medium.audible(self.index)
+        if busy_until:
+            # deferred, backoff counted again once the channel is idle
+            self.access(busy_until)
+            return
+
+        frame = self.queue[0]
+        radio = self.sim.radio
+        tx = self.sim.medium.transmit(self.index, radio.airtime(MAC_OVERHEAD + frame.size))
+        self.sim.stats["frames"] += 1
+        self.sim.at(tx.end, lambda: self.transmitted(tx, frame))
+
+    def transmitted(self, tx, frame):
+        sim = self.sim
+        medium = sim.medium
+        if frame.dest == BROADCAST:
+            for receiver in medium.links[self.index]:
+                if medium.received(tx, receiver):
+                    sim.nodes[receiver].deliver(self.index, frame)
+            # never acked, the send callback always reports success
+            sim.at(tx.end, lambda: self.send_done(True))
+            return
+
+        ack_end = tx.end + SIFS_US + sim.radio.ack_time
+        if medium.received(tx, frame.dest):
+            sim.nodes[frame.dest].deliver(self.index, frame)
+            # the ack keeps the channel busy for everyone hearing the receiver
+            sim.at(tx.end + SIFS_US, lambda: medium.transmit(frame.dest, sim.radio.ack_time))
+            if sim.rng.random() >= medium.loss:
+                sim.at(ack_end, lambda: self.send_done(True))
+                return
+
+        self.mac_attempt += 1
+        if self.mac_attempt <= MAC_RETRIES:
+            sim.stats["mac_retries"] += 1
+            self.cw = min(2 * self.cw + 1, CW_MAX)
+            self.access(ack_end)
+            return
+
+        sim.at(ack_end, lambda: self.send_done(False))
+
+    def send_done(self, success):
+        """EVENT_SENT on the espnow task."""
+        frame = self.queue[0]
+        if not success and frame.attempts < MAX_ATTEMPTS:
+            frame.attempts += 1
+            self.sim.stats["retries"] += 1
+            self.mac_attempt = 0
+            self.cw = CW_MIN
+            self.access(self.sim.now)
+            return
+
+        self.queue.pop(0)
+        self.sim.stats["sent" if success else "failed"] += 1
+        if frame.call:
+            if not success or len(self.pending) >= PENDING_MAX_NUM:
+                self.sim.finish(frame.queued, 503)
+            else:
+                self.pending[(frame.dest, frame.seq)] = frame.queued
+                # expired by the sweep timer, up to a period late
+                deadline = self.sim.now + REPLY_TIMEOUT_US
+                deadline += SWEEP_PERIOD_US - deadline % SWEEP_PERIOD_US
+                key = (frame.dest, frame.seq)
+                self.sim.at(deadline, lambda: self.expire(key))
+
+        self.send_next()
+
+    def expire(self, key):
+        queued = self.pending.pop(key, None)
+        if queued is not None:
+            self.sim.finish(queued, 504)
+
+    # ---------------------------------------------------------------- receiving
+
+    def deliver(self, source, frame):
+        """receive() on the wifi task, then EVENT_RECEIVED on the espnow task."""
+        if self.inbound >= INBOUND_SLOTS_NUM:
+            self.sim.stats["dropped"] += 1
+            return
+
+        self.inbound += 1
+        start = max(self.sim.now, self.cpu_free)
+        self.cpu_free = start + self.sim.proc_us
+        self.sim.at(self.cpu_free, lambda: self.handle(source, frame))
+
+    def handle(self, source, frame):
+        self.inbound -= 1
+        if self.last_seq.get(source) == frame.seq:
+            self.sim.stats["duplicates"] += 1
+            return
+
+        self.last_seq[source] = frame.seq
+        self.sim.stats["received"] += 1
+        if frame.type == FRAME_REQUEST:
+            # the reply carries the request seq, code and a body the size of the request's
+            if not self.push(source, FRAME_REPLY, frame.size, request_seq=frame.seq):
+                self.sim.stats["replies_dropped"] += 1
+        elif frame.type == FRAME_REPLY:
+            queued = self.pending.pop((source, frame.request_seq), None)
+            if queued is not None:
+                self.sim.finish(queued, 200)
+        elif frame.type == FRAME_MESH:
+            self.relay(frame)
+
+    # --------------------------------------------------------------------- mesh
+
+    def remember(self, key):
+        if key in self.seen:
+            return False
+        self.seen.append(key)
+        return True
+
+    def relay(self, frame):
+        """EspNowMesh::onFrame."""
+        sim = self.sim
+        origin, msg_id, ttl, hops = frame.mesh
+        if origin == self.index or not self.remember((origin, msg_id)):
+            sim.stats["mesh_duplicates"] += 1
+            return
+
+        sim.mesh_delivered(origin, msg_id, hops)
+        if ttl <= 1:
+            return
+
+        now = sim.now
+        self.tokens = min(sim.relay_burst, self.tokens + (now - self.refilled) * sim.relay_rate / 1e6)
+        self.refilled = now
+        if self.tokens < 1:
+            sim.stats["limited"] += 1
+            return
+
+        self.tokens -= 1
+        if self.push(BROADCAST, FRAME_MESH, frame.size - HEADER_SIZE, mesh=(origin, msg_id, ttl - 1, hops + 1)):
+            sim.stats["relayed"] += 1
+        else:
+            sim.stats["rejected"] += 1
+
+    def publish(self, payload):
+        """EspNowMesh::Publish."""
+        msg_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xFFFF
+        self.remember((self.index, msg_id))
+        self.sim.stats["published"] += 1
+        if self.push(BROADCAST, FRAME_MESH, MESH_HEADER_SIZE + payload, mesh=(self.index, msg_id, self.sim.ttl, 0)):
+            self.sim.mesh_published[(self.index, msg_id)] = self.sim.now
+        else:
+            self.sim.stats["rejected"] += 1
+
+    # ------------------------------------------------------------------ workload
+
+    def call(self, dest, payload):
+        self.sim.stats["calls"] += 1
+        if not self.push(dest, FRAME_REQUEST, payload, call=True):
+            self.sim.stats["rejected"] += 1
+
+
+class Sim:
+    def __init__(self, args, nodes, seed):
+        self.rng = random.Random(seed)
+        self.now = 0
+        self.events = []
+        self.counter = 0
+        self.radio = Radio(args.phy)
+        self.medium = Medium(self, topology(args.topology, nodes, args.range), args.loss)
+        self.ttl = args.ttl
+        self.relay_rate = args.relay_rate
+        self.relay_burst = args.relay_burst
+        self.mesh_published = {}
+        self.mesh_latencies = []
+        self.mesh_hops = []
+        self.nodes = [Node(self, i) for i in range(nodes)]
+        self.proc_us = args.proc_us
+        self.latencies = []
+        self.codes = {200: 0, 503: 0, 504: 0}
+        self.stats = dict.fromkeys(("calls", "rejected", "frames", "sent", "failed", "retries", "mac_retries",
+                                    "received", "duplicates", "dropped", "replies_dropped", "published",
+                                    "relayed", "limited", "mesh_duplicates"), 0)
+
+    def at(self, time, action):
+        self.counter += 1
+        heapq.heappush(self.events, (time, self.counter, action))
+
+    def finish(self, queued, code):
+        self.codes[code] += 1
+        if code == 200:
+            self.latencies.append(self.now - queued)
+
+    def mesh_delivered(self, origin, msg_id, hops):
+        published = self.mesh_published.get((origin, msg_id))
+        if published is not None:
+            self.mesh_latencies.append(self.now - published)
+            self.mesh_hops.append(hops)
+
+    def run(self, duration_us):
+        while self.events and self.events[0][0] <= duration_us:
+            self.now, _, action = heapq.heappop(self.events)
+            action()
+
+
+def target(pattern, node, nodes, rng):
+    if pattern == "pairs":
+        peer = node ^ 1
+        return peer if peer < nodes else 0
+    if pattern == "star":
+        return 0 if node else rng.randrange(1, nodes)
+    return rng.choice([n for n in range(nodes) if n != node])
+
+
+def schedule_calls(sim, args, duration_us):
+    for node in sim.nodes:
+        time = 0.0
+        while True:
+            time += sim.rng.expovariate(args.rate) * 1e6
+            if time > duration_us:
+                break
+            if args.mesh:
+                sim.at(int(time), lambda n=node: n.publish(args.payload))
+            else:
+                dest = target(args.pattern, node.index, len(sim.nodes), sim.rng)
+                sim.at(int(time), lambda n=node, d=dest: n.call(d, args.payload))
+
+
+def percentile(values, percent):
+    if not values:
+        return 0
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * percent / 100))]
+
+
+def simulate(args, nodes):
+    duration_us = int(args.duration * 1e6)
+    sim = Sim(args, nodes, args.seed)
+    schedule_calls(sim, args, duration_us)
+    # calls still pending at the end get their reply or timeout
+    sim.run(duration_us + REPLY_TIMEOUT_US + 2 * SWEEP_PERIOD_US + 100_000)
+
+    stats = sim.stats
+    if args.mesh:
+        published = len(sim.mesh_published)
+        reach = 100.0 * len(sim.mesh_latencies) / (published * (nodes - 1)) if published else 0.0
+        return {
+            "nodes": nodes,
+            "published": published,
+            "reach": reach,
+            "loss": 100.0 - reach,
+            "p50": percentile(sim.mesh_latencies, 50) / 1000,
+            "p99": percentile(sim.mesh_latencies, 99) / 1000,
+            "max": max(sim.mesh_latencies, default=0) / 1000,
+            "hops": max(sim.mesh_hops, default=0) + 1,
+            "frames_per_msg": stats["frames"] / published if published else 0.0,
+            "airtime": 100.0 * sim.medium.busy_us / duration_us,
+            "collisions": sim.medium.collisions,
+            **stats,
+        }
+
+    calls = stats["calls"]
+    ok = sim.codes[200]
+    return {
+        "nodes": nodes,
+        "calls": calls,
+        "ok": ok,
+        "loss": 100.0 * (calls - ok) / calls if calls else 0.0,
+        "p50": percentile(sim.latencies, 50) / 1000,
+        "p99": percentile(sim.latencies, 99) / 1000,
+        "max": max(sim.latencies, default=0) / 1000,
+        "goodput": ok / args.duration,
+        "airtime": 100.0 * sim.medium.busy_us / duration_us,
+        "collisions": sim.medium.collisions,
+        "503": sim.codes[503],
+        "504": sim.codes[504],
+        **stats,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--nodes", default="2,4,8", help="comma separated node counts, one run each")
+    parser.add_argument("--pattern", choices=("pairs", "star", "random"), default="pairs")
+    parser.add_argument("--rate", type=float, default=20, help="calls per second per node")
+    parser.add_argument("--payload", type=int, default=32, help="request body bytes")
+    parser.add_argument("--loss", type=float, default=0.02, help="frame loss probability per link")
+    parser.add_argument("--duration", type=float, default=10, help="simulated seconds")
+    parser.add_argument("--phy", type=float, default=1, help="phy rate in Mbps, esp-now defaults to 1")
+    parser.add_argument("--proc-us", type=int, default=300, help="espnow task time per received frame")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--topology", choices=("full", "line", "grid"), default="full")
+    parser.add_argument("--range", type=float, default=1.0,
+                        help="node spacing for line and grid, in radio ranges (1 reaches direct neighbours)")
+    parser.add_argument("--mesh", action="store_true", help="flood messages through the relay layer")
+    parser.add_argument("--ttl", type=int, default=4)
+    parser.add_argument("--relay-rate", type=float, default=20, help="rebroadcasts per second per node")
+    parser.add_argument("--relay-burst", type=float, default=8)
+    parser.add_argument("--max-loss", type=float, help="fail when more than this percent of calls fail")
+    parser.add_argument("--max-p99", type=float, help="fail when the p99 call latency exceeds this many ms")
+    args = parser.parse_args()
+
+    if args.payload + HEADER_SIZE + 2 + 16 > FRAME_MAX_SIZE:
+        parser.error("payload doesn't fit an esp-now frame")
+
+    if args.mesh:
+        return run_mesh(parser, args)
+
+    print(f"pattern {args.pattern}, {args.rate:g} calls/s per node, {args.payload} byte bodies, "
+          f"{args.loss * 100:g}% link loss, {args.phy:g} Mbps, {args.topology}, {args.duration:g}s")
+    print(f"{'nodes':>5} {'calls':>6} {'ok':>6} {'loss%':>6} {'p50ms':>6} {'p99ms':>6} {'maxms':>7} "
+          f"{'calls/s':>8} {'air%':>5} {'coll':>5} {'macrt':>6} {'retry':>5} {'dup':>4} {'drop':>4} "
+          f"{'rej':>4} {'503':>4} {'504':>4}")
+
+    failed = False
+    for nodes in (int(n) for n in args.nodes.split(",")):
+        if nodes < 2:
+            parser.error("at least 2 nodes")
+        r = simulate(args, nodes)
+        print(f"{r['nodes']:>5} {r['calls']:>6} {r['ok']:>6} {r['loss']:>6.2f} {r['p50']:>6.2f} {r['p99']:>6.2f} "
+              f"{r['max']:>7.2f} {r['goodput']:>8.1f} {r['airtime']:>5.1f} {r['collisions']:>5} "
+              f"{r['mac_retries']:>6} {r['retries']:>5} {r['duplicates']:>4} {r['dropped']:>4} "
+              f"{r['rejected']:>4} {r['503']:>4} {r['504']:>4}")
+        if args.max_loss is not None and r["loss"] > args.max_loss:
+            failed = True
+        if args.max_p99 is not None and r["p99"] > args.max_p99:
+            failed = True
+
+    if failed:
+        print("FAILED thresholds")
+    return 1 if failed else 0
+
+
+def run_mesh(parser, args):
+    print(f"mesh flood, {args.rate:g} messages/s per node, {args.payload} byte payloads, ttl {args.ttl}, "
+          f"relay {args.relay_rate:g}/s burst {args.relay_burst:g}, {args.loss * 100:g}% link loss, "
+          f"{args.phy:g} Mbps, {args.topology}, {args.duration:g}s")
+    print(f"{'nodes':>5} {'msgs':>6} {'reach%':>7} {'p50ms':>6} {'p99ms':>6} {'maxms':>7} {'hops':>4} "
+          f"{'frm/msg':>7} {'air%':>5} {'coll':>5} {'relay':>6} {'dup':>6} {'limit':>5} {'drop':>4} {'rej':>4}")
+
+    failed = False
+    for nodes in (int(n) for n in args.nodes.split(",")):
+        if nodes < 2:
+            parser.error("at least 2 nodes")
+        r = simulate(args, nodes)
+        print(f"{r['nodes']:>5} {r['published']:>6} {r['reach']:>7.2f} {r['p50']:>6.2f} {r['p99']:>6.2f} "
+              f"{r['max']:>7.2f} {r['hops']:>4} {r['frames_per_msg']:>7.2f} {r['airtime']:>5.1f} "
+              f"{r['collisions']:>5} {r['relayed']:>6} {r['mesh_duplicates']:>6} {r['limited']:>5} "
+              f"{r['dropped']:>4} {r['rejected']:>4}")
+        if args.max_loss is not None and r["loss"] > args.max_loss:
+            failed = True
+        if args.max_p99 is not None and r["p99"] > args.max_p99:
+            failed = True
+
+    if failed:
+        print("FAILED thresholds")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,258 @@
+#include "esp_http_server.h"
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+static constexpr int HANDLERS_MAX_NUM = 16;
+
+struct host_server_t
+{
+    httpd_config_t config;
+    httpd_uri_t handlers[HANDLERS_MAX_NUM];
+    size_t handlersNum;
+    bool running;
+};
+
+static host_server_t s_server{};
+
+static httpd_host_req_t *hostReq(httpd_req_t *r)
+{
+    return static_cast<httpd_host_req_t *>(r->aux);
+}
+
+// what httpd_send_all does with each part, without the socket
+static void sendAll(httpd_host_req_t *req, const char *data, size_t len)
+{
+    size_t room = sizeof(req->resp) - req->respLen;
+    size_t copied = len < room ? len : room;
+    memcpy(req->resp + req->respLen, data, copied);
+    req->respLen += copied;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    if (s_server.running)
+        return ESP_FAIL;
+
+    s_server = host_server_t{};
+    s_server.config = *config;
+    s_server.running = true;
+    *handle = &s_server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    if (server->config.global_user_ctx_free_fn)
+        server->config.global_user_ctx_free_fn(server->config.global_user_ctx);
+
+    *server = host_server_t{};
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    if (server->handlersNum >= server->config.max_uri_handlers || server->handlersNum >= HANDLERS_MAX_NUM)
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+
+    server->handlers[server->handlersNum++] = *uri_handler;
+    return ESP_OK;
+}
+
+esp_err_t httpd_unregister_uri(httpd_handle_t handle, const char *uri)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    size_t kept = 0;
+    for (size_t i = 0; i < server->handlersNum; i++)
+    {
+        if (strcmp(server->handlers[i].uri, uri) != 0)
+            server->handlers[kept++] = server->handlers[i];
+    }
+
+    bool removed = kept != server->handlersNum;
+    server->handlersNum = kept;
+    return removed ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+// "/path/*" matches the path and everything under it, "/path?" the path with or without its last character
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    size_t templateLen = strlen(uri_template);
+    bool wildcard = templateLen > 0 && uri_template[templateLen - 1] == '*';
+    if (wildcard)
+        templateLen--;
+
+    bool optional = templateLen > 0 && uri_template[templateLen - 1] == '?';
+    if (optional)
+        templateLen--;
+
+    if (wildcard)
+        return match_upto >= templateLen && strncmp(uri_template, uri_to_match, templateLen) == 0;
+
+    if (optional && match_upto + 1 == templateLen)
+        return strncmp(uri_template, uri_to_match, match_upto) == 0;
+
+    return match_upto == templateLen && strncmp(uri_template, uri_to_match, templateLen) == 0;
+}
+
+void *httpd_get_global_user_ctx(httpd_handle_t handle)
+{
+    return static_cast<host_server_t *>(handle)->config.global_user_ctx;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    (void)handle;
+    (void)sockfd;
+    return ESP_OK;
+}
+
+esp_err_t httpd_host_open(httpd_handle_t handle, int sockfd)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    return server->config.open_fn ? server->config.open_fn(handle, sockfd) : ESP_OK;
+}
+
+void httpd_host_close(httpd_handle_t handle, int sockfd)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    if (server->config.close_fn)
+        server->config.close_fn(handle, sockfd);
+}
+
+esp_err_t httpd_host_dispatch(httpd_handle_t handle, httpd_req_t *r)
+{
+    host_server_t *server = static_cast<host_server_t *>(handle);
+    httpd_host_req_t *req = hostReq(r);
+    req->bodyRead = 0;
+    req->status = HTTPD_200;
+    req->type = HTTPD_TYPE_TEXT;
+    req->respHeadersNum = 0;
+    req->respLen = 0;
+
+    const char *query = strchr(r->uri, '?');
+    size_t uriLen = query ? query - r->uri : strlen(r->uri);
+    httpd_uri_match_func_t match = server->config.uri_match_fn;
+    for (size_t i = 0; i < server->handlersNum; i++)
+    {
+        const httpd_uri_t &handler = server->handlers[i];
+        if (handler.method != r->method)
+            continue;
+
+        bool matched = match ? match(handler.uri, r->uri, uriLen)
+                             : strlen(handler.uri) == uriLen && strncmp(handler.uri, r->uri, uriLen) == 0;
+        if (!matched)
+            continue;
+
+        r->handle = handle;
+        r->user_ctx = handler.user_ctx;
+        // a handler's failure closes the session, as the server task does
+        if (handler.handler(r) != ESP_OK)
+            req->closed = true;
+        return ESP_OK;
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return hostReq(r)->sockfd;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    httpd_host_req_t *req = hostReq(r);
+    size_t left = r->content_len - req->bodyRead;
+    size_t len = buf_len < left ? buf_len : left;
+    memcpy(buf, req->body + req->bodyRead, len);
+    req->bodyRead += len;
+    return len;
+}
+
+static const httpd_host_hdr_t *findHeader(httpd_req_t *r, const char *field)
+{
+    httpd_host_req_t *req = hostReq(r);
+    for (size_t i = 0; i < req->headersNum; i++)
+    {
+        if (strcasecmp(req->headers[i].field, field) == 0)
+            return &req->headers[i];
+    }
+
+    return nullptr;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    const httpd_host_hdr_t *header = findHeader(r, field);
+    return header ? strlen(header->value) : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    const httpd_host_hdr_t *header = findHeader(r, field);
+    if (!header)
+        return ESP_ERR_NOT_FOUND;
+
+    size_t len = strlen(header->value);
+    size_t copied = len < val_size ? len : val_size - 1;
+    memcpy(val, header->value, copied);
+    val[copied] = '\0';
+    return copied < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    hostReq(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    hostReq(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    httpd_host_req_t *req = hostReq(r);
+    size_t max = static_cast<host_server_t *>(r->handle)->config.max_resp_headers;
+    if (req->respHeadersNum >= max || req->respHeadersNum >= sizeof(req->respHeaders) / sizeof(req->respHeaders[0]))
+        return ESP_ERR_HTTPD_RESP_HDR;
+
+    req->respHeaders[req->respHeadersNum++] = {field, value};
+    return ESP_OK;
+}
+
+// formats the status line and headers the way httpd_resp_send does, then the body
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    httpd_host_req_t *req = hostReq(r);
+    size_t len = buf_len == HTTPD_RESP_USE_STRLEN ? (buf ? strlen(buf) : 0) : buf_len;
+
+    char line[128];
+    int lineLen = snprintf(line, sizeof(line), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n",
+                           req->status, req->type, len);
+    sendAll(req, line, lineLen);
+    for (size_t i = 0; i < req->respHeadersNum; i++)
+    {
+        const httpd_host_hdr_t &header = req->respHeaders[i];
+        sendAll(req, header.field, strlen(header.field));
+        sendAll(req, ": ", 2);
+        sendAll(req, header.value, strlen(header.value));
+        sendAll(req, "\r\n", 2);
+    }
+
+    sendAll(req, "\r\n", 2);
+    if (len)
+        sendAll(req, buf, len);
+    return ESP_OK;
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len)
+{
+    sendAll(hostReq(r), buf, buf_len);
+    return buf_len;
+}
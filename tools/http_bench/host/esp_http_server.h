@@ -0,0 +1,211 @@
+#ifndef HOST_ESP_HTTP_SERVER_H__
+#define HOST_ESP_HTTP_SERVER_H__
+
+/*
+    A fake esp_http_server for the host benchmark, declarations follow esp-idf 4.x.
+    There are no sockets: httpd_host_dispatch hands a request to the registered handler the way the
+    server task does, the body is read from httpd_host_req_t and the response is formatted into
+    its buffer as httpd_resp_send would write it to the socket.
+*/
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CONFIG_HTTPD_WS_SUPPORT 1
+#define HTTPD_MAX_URI_LEN 512
+
+// the methods and status strings of esp_http_server, values from http_parser
+enum http_method
+{
+    HTTP_DELETE = 0,
+    HTTP_GET = 1,
+    HTTP_HEAD = 2,
+    HTTP_POST = 3,
+    HTTP_PUT = 4,
+    HTTP_OPTIONS = 6,
+};
+
+#define HTTPD_200 "200 OK"
+#define HTTPD_204 "204 No Content"
+#define HTTPD_207 "207 Multi-Status"
+#define HTTPD_400 "400 Bad Request"
+#define HTTPD_404 "404 Not Found"
+#define HTTPD_408 "408 Request Timeout"
+#define HTTPD_500 "500 Internal Server Error"
+
+#define HTTPD_TYPE_JSON "application/json"
+#define HTTPD_TYPE_TEXT "text/html"
+
+#define HTTPD_RESP_USE_STRLEN -1
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_INVALID -2
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+
+#define ESP_ERR_HTTPD_BASE 0xb000
+#define ESP_ERR_HTTPD_HANDLERS_FULL (ESP_ERR_HTTPD_BASE + 1)
+#define ESP_ERR_HTTPD_RESULT_TRUNC (ESP_ERR_HTTPD_BASE + 4)
+#define ESP_ERR_HTTPD_RESP_HDR (ESP_ERR_HTTPD_BASE + 5)
+
+typedef void *httpd_handle_t;
+typedef void (*httpd_free_ctx_fn_t)(void *ctx);
+typedef esp_err_t (*httpd_open_func_t)(httpd_handle_t hd, int sockfd);
+typedef void (*httpd_close_func_t)(httpd_handle_t hd, int sockfd);
+typedef bool (*httpd_uri_match_func_t)(const char *reference_uri, const char *uri_to_match, size_t match_upto);
+
+typedef enum
+{
+    HTTPD_WS_TYPE_CONTINUE = 0x0,
+    HTTPD_WS_TYPE_TEXT = 0x1,
+    HTTPD_WS_TYPE_BINARY = 0x2,
+    HTTPD_WS_TYPE_CLOSE = 0x8,
+    HTTPD_WS_TYPE_PING = 0x9,
+    HTTPD_WS_TYPE_PONG = 0xA,
+} httpd_ws_type_t;
+
+typedef struct httpd_config
+{
+    unsigned task_priority;
+    size_t stack_size;
+    BaseType_t core_id;
+    uint16_t server_port;
+    uint16_t ctrl_port;
+    uint16_t max_open_sockets;
+    uint16_t max_uri_handlers;
+    uint16_t max_resp_headers;
+    uint16_t backlog_conn;
+    bool lru_purge_enable;
+    uint16_t recv_wait_timeout;
+    uint16_t send_wait_timeout;
+    void *global_user_ctx;
+    httpd_free_ctx_fn_t global_user_ctx_free_fn;
+    void *global_transport_ctx;
+    httpd_free_ctx_fn_t global_transport_ctx_free_fn;
+    httpd_open_func_t open_fn;
+    httpd_close_func_t close_fn;
+    httpd_uri_match_func_t uri_match_fn;
+} httpd_config_t;
+
+#define HTTPD_DEFAULT_CONFIG() httpd_config_t{            \
+    .task_priority = tskIDLE_PRIORITY + 5,                \
+    .stack_size = 4096,                                   \
+    .core_id = tskNO_AFFINITY,                            \
+    .server_port = 80,                                    \
+    .ctrl_port = 32768,                                   \
+    .max_open_sockets = 7,                                \
+    .max_uri_handlers = 8,                                \
+    .max_resp_headers = 8,                                \
+    .backlog_conn = 5,                                    \
+    .lru_purge_enable = false,                            \
+    .recv_wait_timeout = 5,                               \
+    .send_wait_timeout = 5,                               \
+    .global_user_ctx = NULL,                              \
+    .global_user_ctx_free_fn = NULL,                      \
+    .global_transport_ctx = NULL,                         \
+    .global_transport_ctx_free_fn = NULL,                 \
+    .open_fn = NULL,                                      \
+    .close_fn = NULL,                                     \
+    .uri_match_fn = NULL}
+
+typedef struct httpd_req
+{
+    httpd_handle_t handle;
+    int method;
+    // const in esp-idf, the bench fills it in
+    char uri[HTTPD_MAX_URI_LEN + 1];
+    size_t content_len;
+    // the fake's httpd_host_req_t
+    void *aux;
+    void *user_ctx;
+    void *sess_ctx;
+    httpd_free_ctx_fn_t free_ctx;
+    bool ignore_sess_ctx_changes;
+} httpd_req_t;
+
+typedef struct httpd_uri
+{
+    const char *uri;
+    enum http_method method;
+    esp_err_t (*handler)(httpd_req_t *r);
+    void *user_ctx;
+    bool is_websocket;
+    bool handle_ws_control_frames;
+    const char *supported_subprotocol;
+} httpd_uri_t;
+
+//================================ HOST ONLY ====================================================
+
+static constexpr int HTTPD_HOST_REQ_HDRS_MAX = 4;
+static constexpr int HTTPD_HOST_RESP_MAX_SIZE = 2048;
+
+typedef struct
+{
+    const char *field;
+    const char *value;
+} httpd_host_hdr_t;
+
+// one request of a session, and what the handler answered to it
+typedef struct
+{
+    int sockfd;
+    const char *body;
+    httpd_host_hdr_t headers[HTTPD_HOST_REQ_HDRS_MAX];
+    size_t headersNum;
+
+    size_t bodyRead;
+    const char *status;
+    const char *type;
+    httpd_host_hdr_t respHeaders[16];
+    size_t respHeadersNum;
+    // the bytes that went out on the socket, status line included
+    char resp[HTTPD_HOST_RESP_MAX_SIZE];
+    size_t respLen;
+    bool closed;
+} httpd_host_req_t;
+
+// a client connects or goes away, the server's open_fn and close_fn are called as on accept and close
+esp_err_t httpd_host_open(httpd_handle_t handle, int sockfd);
+void httpd_host_close(httpd_handle_t handle, int sockfd);
+
+/*  clears the answer of the previous request on the session and runs the handler registered for
+    the request's method and uri, as the server task does. ESP_ERR_NOT_FOUND without a handler */
+esp_err_t httpd_host_dispatch(httpd_handle_t handle, httpd_req_t *r);
+
+//================================ ESP-IDF API ==================================================
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config);
+esp_err_t httpd_stop(httpd_handle_t handle);
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler);
+esp_err_t httpd_unregister_uri(httpd_handle_t handle, const char *uri);
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto);
+void *httpd_get_global_user_ctx(httpd_handle_t handle);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd);
+
+int httpd_req_to_sockfd(httpd_req_t *r);
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len);
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size);
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status);
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type);
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value);
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len);
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len);
+
+inline esp_err_t httpd_resp_send_404(httpd_req_t *r)
+{
+    httpd_resp_set_status(r, HTTPD_404);
+    httpd_resp_set_type(r, HTTPD_TYPE_TEXT);
+    return httpd_resp_send(r, "This URI does not exist", HTTPD_RESP_USE_STRLEN);
+}
+
+inline esp_err_t httpd_resp_send_408(httpd_req_t *r)
+{
+    httpd_resp_set_status(r, HTTPD_408);
+    httpd_resp_set_type(r, HTTPD_TYPE_TEXT);
+    return httpd_resp_send(r, "Server closed this connection", HTTPD_RESP_USE_STRLEN);
+}
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_ESP_PARTITION_H__
+#define HOST_ESP_PARTITION_H__
+
+// esparrag_static_files.h includes it, the bench serves no static files
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_ESP_SPI_FLASH_H__
+#define HOST_ESP_SPI_FLASH_H__
+
+#include <stdint.h>
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+#endif
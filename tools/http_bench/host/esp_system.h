@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_SYSTEM_H__
+#define HOST_ESP_SYSTEM_H__
+
+#include <stdint.h>
+
+// defined by the bench, a fixed heap size less what its counting allocator holds
+uint32_t esp_get_free_heap_size(void);
+
+#endif
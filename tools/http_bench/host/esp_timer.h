@@ -0,0 +1,13 @@
+#ifndef HOST_ESP_TIMER_H__
+#define HOST_ESP_TIMER_H__
+
+#include <chrono>
+#include <stdint.h>
+
+// microseconds of a monotonic clock, like esp_timer counts since boot
+inline int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
@@ -0,0 +1,27 @@
+// the bench registers no websockets, event streams or static files, these only satisfy the linker
+#include "esparrag_websocket.h"
+#include "esparrag_event_stream.h"
+#include "esparrag_static_files.h"
+
+esp_err_t WebSocket::handler(httpd_req_t *esp_request)
+{
+    return ESP_FAIL;
+}
+
+void WebSocket::removeClient(int fd)
+{
+}
+
+esp_err_t EventStream::handler(httpd_req_t *esp_request)
+{
+    return ESP_FAIL;
+}
+
+void EventStream::removeClient(int fd)
+{
+}
+
+bool StaticFiles::Find(const char *uri, file_t &file) const
+{
+    return false;
+}
@@ -0,0 +1,26 @@
+#ifndef HOST_FREERTOS_H__
+#define HOST_FREERTOS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdTRUE 1
+#define pdFALSE 0
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY 0x7fffffff
+
+// the bench runs on one thread, critical sections have nothing to exclude
+typedef struct
+{
+    uint32_t owner;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portYIELD_FROM_ISR() ((void)0)
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef HOST_FREERTOS_QUEUE_H__
+#define HOST_FREERTOS_QUEUE_H__
+
+// esparrag_websocket.h keeps a queue handle, the bench registers no websockets
+typedef void *QueueHandle_t;
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef HOST_FREERTOS_TIMERS_H__
+#define HOST_FREERTOS_TIMERS_H__
+
+// esparrag_event_stream.h keeps a timer handle, the bench registers no event streams
+typedef void *TimerHandle_t;
+
+#endif
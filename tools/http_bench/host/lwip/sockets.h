@@ -0,0 +1,9 @@
+#ifndef HOST_LWIP_SOCKETS_H__
+#define HOST_LWIP_SOCKETS_H__
+
+// the bench's sockets are fake fds, getpeername fails on them and every client is address 0
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_MQTT_CLIENT_H__
+#define HOST_MQTT_CLIENT_H__
+
+// esparrag_request.h includes it, nothing from it is used on the request path
+
+#endif
@@ -0,0 +1,391 @@
+/*
+    Host benchmark of the HttpServer request path.
+    The parts of requestHandler (route lookup, body parsing, response serialization) run several rounds
+    each and report the fastest one in ns per operation, which is the stablest number on a busy machine.
+    The http_ cases send whole requests through requestHandler over the fake esp_http_server in host/:
+    admission and rate limiting, reading the body, the handler, the header block and the formatted
+    response. They report requests per second on one core, p50/p99 latency and what cJSON and
+    operator new allocated per request.
+    Relative changes carry over to the device, absolute numbers don't.
+
+    usage: http_bench [--iterations 20000] [--max <case>=<ns> ...] [--max-alloc <case>=<bytes> ...]
+    --max is ns/op, or the p50 latency of an http_ case. exits with 1 when a case goes over a limit,
+    or an http_ case gets an unexpected status, so it can gate a change
+*/
+#include "esparrag_router.h"
+#include "esparrag_http.h"
+#include "esparrag_http_body.h"
+#include "esparrag_cbor.h"
+#include "esp_system.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+static constexpr int ROUNDS = 5;
+// what esp_get_free_heap_size starts from, more than the bench ever holds
+static constexpr size_t HOST_HEAP_SIZE = 1u << 30;
+// an fd that is never open, getpeername fails on it like on a client without an address
+static constexpr int CLIENT_SOCKFD = 1000;
+
+static const char JSON_BODY[] = "{\"relay\":true,\"level\":42,\"name\":\"kitchen\",\"values\":[1,2,3,4]}";
+static const char FORM_BODY[] = "relay=on&level=42&name=kitchen";
+
+struct Handlers
+{
+    void onRelay(Request &request, Response &response)
+    {
+        cJSON *level = cJSON_GetObjectItem(request.m_content, "level");
+        cJSON_AddBoolToObject(response.m_json, "relay", true);
+        cJSON_AddNumberToObject(response.m_json, "level", level ? level->valuedouble : 0);
+    }
+};
+
+//================================ COUNTING ALLOCATOR ============================================
+
+struct alloc_stats_t
+{
+    uint64_t count;
+    uint64_t bytes;
+    size_t live;
+};
+
+static alloc_stats_t s_alloc{};
+
+// the size is kept in front of the block, free has to give it back to live
+static void *countingMalloc(size_t size)
+{
+    max_align_t *block = static_cast<max_align_t *>(malloc(sizeof(max_align_t) + size));
+    if (!block)
+        return nullptr;
+
+    *reinterpret_cast<size_t *>(block) = size;
+    s_alloc.count++;
+    s_alloc.bytes += size;
+    s_alloc.live += size;
+    return block + 1;
+}
+
+static void countingFree(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    max_align_t *block = static_cast<max_align_t *>(ptr) - 1;
+    s_alloc.live -= *reinterpret_cast<size_t *>(block);
+    free(block);
+}
+
+void *operator new(size_t size)
+{
+    void *ptr = countingMalloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept { countingFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { countingFree(ptr); }
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return HOST_HEAP_SIZE - s_alloc.live;
+}
+
+//================================ HTTP REQUESTS =================================================
+
+class HttpBench
+{
+public:
+    static eResult Start(HttpServer &server) { return server.RunServer(); }
+    static httpd_handle_t Handle(HttpServer &server) { return server.m_handle; }
+};
+
+struct request_stats_t
+{
+    double perSecond;
+    double p50Ns;
+    double p99Ns;
+    double allocBytes;
+    double allocs;
+    // responses whose status wasn't the expected one
+    int unexpected;
+};
+
+// one keep alive session, the same request sent over and over
+struct session_t
+{
+    httpd_req_t req;
+    httpd_host_req_t host;
+};
+
+static void initSession(session_t &session, int method, const char *uri, const char *body, size_t bodyLen,
+                        std::initializer_list<httpd_host_hdr_t> headers)
+{
+    session = session_t{};
+    session.req.method = method;
+    snprintf(session.req.uri, sizeof(session.req.uri), "%s", uri);
+    session.req.content_len = bodyLen;
+    session.req.aux = &session.host;
+    session.host.sockfd = CLIENT_SOCKFD;
+    session.host.body = body;
+    for (const httpd_host_hdr_t &header : headers)
+        session.host.headers[session.host.headersNum++] = header;
+}
+
+/*  every request is timed on its own, prepare runs between them untimed.
+    per second is the inverse of the mean latency, one core serving back to back */
+template <typename F>
+static request_stats_t measureRequests(httpd_handle_t handle, session_t &session, const char *status,
+                                       int iterations, std::vector<double> &latencies, F &&prepare)
+{
+    request_stats_t stats{};
+    auto send = [&] {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        esp_err_t err = httpd_host_dispatch(handle, &session.req);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        bool expected = err == ESP_OK && session.host.respLen > 12 && strncmp(session.host.resp + 9, status, 3) == 0;
+        stats.unexpected += !expected;
+        return elapsed.count();
+    };
+
+    for (int i = 0; i < iterations / 10; i++)
+        send();
+    stats.unexpected = 0;
+
+    latencies.clear();
+    alloc_stats_t before = s_alloc;
+    double total = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        latencies.push_back(send());
+        total += latencies.back();
+    }
+    alloc_stats_t after = s_alloc;
+
+    std::sort(latencies.begin(), latencies.end());
+    stats.perSecond = total > 0 ? iterations * 1e9 / total : 0;
+    stats.p50Ns = latencies[(iterations - 1) * 50 / 100];
+    stats.p99Ns = latencies[(iterations - 1) * 99 / 100];
+    stats.allocBytes = static_cast<double>(after.bytes - before.bytes) / iterations;
+    stats.allocs = static_cast<double>(after.count - before.count) / iterations;
+    return stats;
+}
+
+template <typename F>
+static double measure(int iterations, F &&operation)
+{
+    for (int i = 0; i < iterations / 10; i++)
+        operation();
+
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            operation();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        double perOp = elapsed.count() / iterations;
+        if (round == 0 || perOp < best)
+            best = perOp;
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 20000;
+    std::map<std::string, double> limits;
+    std::map<std::string, double> allocLimits;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+            iterations = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--max") == 0 || strcmp(argv[i], "--max-alloc") == 0) && i + 1 < argc)
+        {
+            bool alloc = strcmp(argv[i], "--max-alloc") == 0;
+            const char *limit = argv[++i];
+            const char *eq = strchr(limit, '=');
+            if (!eq)
+            {
+                fprintf(stderr, "%s takes <case>=<%s>\n", argv[i - 1], alloc ? "bytes" : "ns");
+                return 2;
+            }
+            (alloc ? allocLimits : limits)[std::string(limit, eq)] = atof(eq + 1);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--iterations N] [--max <case>=<ns> ...] [--max-alloc <case>=<bytes> ...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (iterations < 10)
+    {
+        fprintf(stderr, "--iterations takes at least 10\n");
+        return 2;
+    }
+
+    // with hooks cJSON_Print copies its buffer instead of realloc, the counted bytes include both
+    cJSON_Hooks hooks{countingMalloc, countingFree};
+    cJSON_InitHooks(&hooks);
+
+    // a full table, the route looked up last is the worst case of the linear search
+    Handlers handlers;
+    Router router;
+    static char uris[Router::ROUTES_MAX_NUM][Router::URI_MAX_LEN + 1];
+    for (int i = 0; i < Router::ROUTES_MAX_NUM; i++)
+    {
+        snprintf(uris[i], sizeof(uris[i]), "/route%d", i);
+        router.On(uris[i], eMethod::POST, request_handler_t::create<Handlers, &Handlers::onRelay>(handlers));
+    }
+    const char *firstUri = uris[0];
+    const char *lastUri = uris[Router::ROUTES_MAX_NUM - 1];
+
+    uint8_t cborBody[128];
+    size_t cborBodyLen = 0;
+    {
+        cJSON *json = cJSON_Parse(JSON_BODY);
+        CborWriter writer(cborBody, sizeof(cborBody));
+        writer.Write(json);
+        cborBodyLen = writer.Size();
+        cJSON_Delete(json);
+    }
+
+    cJSON *response = cJSON_Parse(JSON_BODY);
+    static uint8_t cborBuffer[1024];
+    volatile uintptr_t sink = 0;
+
+    std::map<std::string, double> results;
+    results["route_find_first"] = measure(iterations, [&] { sink = sink + (uintptr_t)router.Find(firstUri, eMethod::POST); });
+    results["route_find_last"] = measure(iterations, [&] { sink = sink + (uintptr_t)router.Find(lastUri, eMethod::POST); });
+    results["route_find_miss"] = measure(iterations, [&] { sink = sink + (uintptr_t)router.Find("/missing", eMethod::POST); });
+
+    results["parse_json"] = measure(iterations, [&] { cJSON_Delete(HttpBody::Parse(JSON_BODY, sizeof(JSON_BODY) - 1, false)); });
+    results["parse_form"] = measure(iterations, [&] { cJSON_Delete(HttpBody::Parse(FORM_BODY, sizeof(FORM_BODY) - 1, false)); });
+    results["parse_cbor"] = measure(iterations, [&] { cJSON_Delete(HttpBody::Parse(reinterpret_cast<const char *>(cborBody), cborBodyLen, true)); });
+
+    results["serialize_json"] = measure(iterations, [&] { cJSON_free(cJSON_Print(response)); });
+    results["serialize_cbor"] = measure(iterations, [&] {
+        CborWriter writer(cborBuffer, sizeof(cborBuffer));
+        writer.Write(response);
+        sink = sink + writer.Size();
+    });
+
+    // what requestHandler does between reading the body and httpd_resp_send
+    results["request_cycle"] = measure(iterations, [&] {
+        Request request(HttpBody::Parse(JSON_BODY, sizeof(JSON_BODY) - 1, false), lastUri, eMethod::POST);
+        Response reply;
+        router.Dispatch(request, reply);
+        cJSON_free(cJSON_Print(reply.m_json));
+    });
+    cJSON_Delete(response);
+
+    // the server serves the same table, its default headers go out as the header block
+    HttpServer server;
+    server.On(router);
+    server.Init();
+    if (HttpBench::Start(server) != eResult::SUCCESS)
+    {
+        fprintf(stderr, "http server didn't start\n");
+        return 2;
+    }
+    httpd_handle_t handle = HttpBench::Handle(server);
+
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    std::map<std::string, request_stats_t> requests;
+    session_t session;
+    auto none = [] {};
+
+    initSession(session, HTTP_POST, lastUri, JSON_BODY, sizeof(JSON_BODY) - 1, {{"Content-Type", "application/json"}});
+    requests["http_json"] = measureRequests(handle, session, "200", iterations, latencies, none);
+
+    initSession(session, HTTP_POST, lastUri, reinterpret_cast<const char *>(cborBody), cborBodyLen,
+                {{"Content-Type", "application/cbor"}, {"Accept", "application/cbor"}});
+    requests["http_cbor"] = measureRequests(handle, session, "200", iterations, latencies, none);
+
+    initSession(session, HTTP_GET, "/missing", nullptr, 0, {});
+    requests["http_not_found"] = measureRequests(handle, session, "404", iterations, latencies, none);
+
+    // admitted by the limiter, the table is reset before the burst runs out
+    static constexpr uint16_t RATE_LIMIT_BURST = UINT16_MAX;
+    int admitted = 0;
+    initSession(session, HTTP_POST, lastUri, JSON_BODY, sizeof(JSON_BODY) - 1, {{"Content-Type", "application/json"}});
+    requests["http_rate_limited"] = measureRequests(handle, session, "200", iterations, latencies, [&] {
+        if (admitted++ % (RATE_LIMIT_BURST / 2) == 0)
+            server.SetRateLimit(RATE_LIMIT_BURST, RATE_LIMIT_BURST);
+    });
+
+    server.SetRateLimit(0, 0);
+
+    // a connection over the limit, answered with 503 before the body is read
+    server.SetMaxConnections(1);
+    httpd_host_open(handle, CLIENT_SOCKFD);
+    httpd_host_open(handle, CLIENT_SOCKFD + 1);
+    initSession(session, HTTP_POST, lastUri, JSON_BODY, sizeof(JSON_BODY) - 1, {{"Content-Type", "application/json"}});
+    requests["http_rejected"] = measureRequests(handle, session, "503", iterations, latencies, none);
+    httpd_host_close(handle, CLIENT_SOCKFD + 1);
+    httpd_host_close(handle, CLIENT_SOCKFD);
+    server.SetMaxConnections(0);
+
+    int failed = 0;
+    printf("%-20s %12s %12s\n", "case", "ns/op", "max");
+    for (const auto &result : results)
+    {
+        auto limit = limits.find(result.first);
+        bool over = limit != limits.end() && result.second > limit->second;
+        if (limit != limits.end())
+            printf("%-20s %12.1f %12.1f%s\n", result.first.c_str(), result.second, limit->second, over ? "  FAIL" : "");
+        else
+            printf("%-20s %12.1f %12s\n", result.first.c_str(), result.second, "-");
+        failed += over;
+    }
+
+    printf("\n%-20s %12s %12s %12s %12s %10s\n", "case", "req/s", "p50 ns", "p99 ns", "alloc B/req", "allocs");
+    for (const auto &request : requests)
+    {
+        const request_stats_t &stats = request.second;
+        auto limit = limits.find(request.first);
+        auto allocLimit = allocLimits.find(request.first);
+        bool over = (limit != limits.end() && stats.p50Ns > limit->second) ||
+                    (allocLimit != allocLimits.end() && stats.allocBytes > allocLimit->second);
+        printf("%-20s %12.0f %12.1f %12.1f %12.1f %10.1f%s\n", request.first.c_str(), stats.perSecond,
+               stats.p50Ns, stats.p99Ns, stats.allocBytes, stats.allocs, over ? "  FAIL" : "");
+        if (stats.unexpected)
+            fprintf(stderr, "%s: %d responses with an unexpected status\n", request.first.c_str(), stats.unexpected);
+        failed += over || stats.unexpected;
+    }
+
+    for (const auto &limit : limits)
+    {
+        if (results.find(limit.first) == results.end() && requests.find(limit.first) == requests.end())
+        {
+            fprintf(stderr, "unknown case %s\n", limit.first.c_str());
+            failed++;
+        }
+    }
+
+    for (const auto &limit : allocLimits)
+    {
+        if (requests.find(limit.first) == requests.end())
+        {
+            fprintf(stderr, "unknown http case %s\n", limit.first.c_str());
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
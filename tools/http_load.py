@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""wrk style load generator for an HttpServer running on a device.
+
+Every connection runs in its own thread and sends requests back to back,
+reusing the connection unless --close is given.
+Reports requests per second, errors and latency percentiles.
+
+usage: http_load.py http://<device ip>/path [-c 4] [-d 10] [-m POST --body '{"a":1}']
+"""
+import argparse
+import http.client
+import threading
+import time
+import urllib.parse
+
+
+class Worker(threading.Thread):
+    def __init__(self, url, args, deadline):
+        super().__init__(daemon=True)
+        self.url = url
+        self.args = args
+        self.deadline = deadline
+        self.latencies = []
+        self.errors = 0
+        self.connections = 0
+
+    def connect(self):
+        self.connections += 1
+        return http.client.HTTPConnection(self.url.hostname, self.url.port or 80, timeout=self.args.timeout)
+
+    def run(self):
+        path = self.url.path or "/"
+        if self.url.query:
+            path += "?" + self.url.query
+        headers = {"Content-Type": self.args.content_type}
+        if self.args.close:
+            headers["Connection"] = "close"
+        body = self.args.body.encode() if self.args.body else None
+
+        conn = self.connect()
+        while time.monotonic() < self.deadline:
+            start = time.perf_counter()
+            try:
+                conn.request(self.args.method, path, body=body, headers=headers)
+                response = conn.getresponse()
+                response.read()
+                if response.status >= 400:
+                    self.errors += 1
+                else:
+                    self.latencies.append(time.perf_counter() - start)
+                if self.args.close or response.will_close:
+                    conn.close()
+                    conn = self.connect()
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                conn.close()
+                conn = self.connect()
+        conn.close()
+
+
+def percentile(values, percent):
+    if not values:
+        return 0.0
+    index = min(len(values) - 1, int(round(len(values) * percent / 100.0 + 0.5)) - 1)
+    return values[max(index, 0)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("url")
+    parser.add_argument("-c", "--connections", type=int, default=4)
+    parser.add_argument("-d", "--duration", type=float, default=10)
+    parser.add_argument("-m", "--method", default="GET")
+    parser.add_argument("--body", default="")
+    parser.add_argument("--content-type", default="application/json")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--close", action="store_true", help="new connection per request")
+    args = parser.parse_args()
+
+    url = urllib.parse.urlparse(args.url)
+    deadline = time.monotonic() + args.duration
+    workers = [Worker(url, args, deadline) for _ in range(args.connections)]
+    start = time.monotonic()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    elapsed = time.monotonic() - start
+
+    latencies = sorted(l for worker in workers for l in worker.latencies)
+    errors = sum(worker.errors for worker in workers)
+    connections = sum(worker.connections for worker in workers)
+    print("%d requests in %.1fs, %d errors, %d connections" % (len(latencies), elapsed, errors, connections))
+    print("requests/sec: %.1f" % (len(latencies) / elapsed))
+    for p in (50, 90, 99):
+        print("latency p%d: %.1f ms" % (p, percentile(latencies, p) * 1000))
+    if latencies:
+        print("latency max: %.1f ms" % (latencies[-1] * 1000))
+
+
+if __name__ == "__main__":
+    main()
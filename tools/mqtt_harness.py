@@ -0,0 +1,420 @@
+#!/usr/bin/env python3
+"""In-process MQTT 3.1.1 broker and integration harness for MqttClient (network/esparrag_mqtt.h).
+
+Runs a small broker on this host and drives a device through it: waits for it to
+connect and subscribe, sends bursts of pings, kicks the connection (optionally
+refusing reconnects for a while) and measures round trip latency, loss and
+reconnect timings. The device only needs an echo handler:
+
+    void echo(const char *, cJSON *payload) { mqtt.Publish(pong, cJSON_Duplicate(payload, true)); }
+    ...
+    pong = mqtt.Topic("/bench/pong");
+    mqtt.On("/bench/ping", MqttClient::mqtt_handler_callback::create<echo>());
+    mqtt.TryConnect("<host ip>");
+
+--advertise publishes the broker over mDNS (needs the zeroconf package) so
+Mdns::FindBroker finds it. --self-test replaces the device with a python echo
+client, to check the harness itself. Exits with 1 when --max-loss or --max-p99
+is exceeded.
+
+usage: mqtt_harness.py [--device MORAN_1] [--rounds 3] [--burst 100] [--rate 50] [--outage 5]
+"""
+import argparse
+import asyncio
+import json
+import socket
+import struct
+import sys
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL, PUBCOMP = 1, 2, 3, 4, 5, 6, 7
+SUBSCRIBE, SUBACK, UNSUBSCRIBE, UNSUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 10, 11, 12, 13, 14
+CONNACK_SERVER_UNAVAILABLE = 3
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        out.append(byte | 0x80 if length else byte)
+        if not length:
+            return bytes(out)
+
+
+def packet(kind, flags, body=b""):
+    return bytes([kind << 4 | flags]) + encode_length(len(body)) + body
+
+
+def string(value):
+    data = value.encode() if isinstance(value, str) else value
+    return struct.pack(">H", len(data)) + data
+
+
+async def read_packet(reader):
+    first = (await reader.readexactly(1))[0]
+    length, shift = 0, 0
+    while True:
+        byte = (await reader.readexactly(1))[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    body = await reader.readexactly(length) if length else b""
+    return first >> 4, first & 0x0F, body
+
+
+def read_string(body, pos):
+    (length,) = struct.unpack_from(">H", body, pos)
+    return body[pos + 2:pos + 2 + length], pos + 2 + length
+
+
+def topic_matches(filter_, topic):
+    filter_levels = filter_.split("/")
+    topic_levels = topic.split("/")
+    for i, level in enumerate(filter_levels):
+        if level == "#":
+            return True
+        if i >= len(topic_levels) or (level != "+" and level != topic_levels[i]):
+            return False
+    return len(filter_levels) == len(topic_levels)
+
+
+def publish_packet(topic, payload, qos, packet_id=0, retain=False):
+    body = string(topic) + (struct.pack(">H", packet_id) if qos else b"") + payload
+    return packet(PUBLISH, qos << 1 | int(retain), body)
+
+
+class Session:
+    def __init__(self, broker, reader, writer):
+        self.broker = broker
+        self.reader = reader
+        self.writer = writer
+        self.client_id = ""
+        self.subscriptions = {}
+        self.next_id = 1
+        self.qos2_received = set()
+
+    def send(self, data):
+        if not self.writer.is_closing():
+            self.writer.write(data)
+
+    def deliver(self, topic, payload, qos, retain=False):
+        granted = max((q for f, q in self.subscriptions.items() if topic_matches(f, topic)), default=None)
+        if granted is None:
+            return
+        qos = min(qos, granted)
+        packet_id = 0
+        if qos:
+            packet_id = self.next_id
+            self.next_id = self.next_id % 0xFFFF + 1
+        self.send(publish_packet(topic, payload, qos, packet_id, retain))
+
+    async def run(self):
+        kind, _, body = await read_packet(self.reader)
+        if kind != CONNECT:
+            return
+        # protocol name, level, flags, keepalive, then the client id
+        _, pos = read_string(body, 0)
+        pos += 4
+        client_id, _ = read_string(body, pos)
+        self.client_id = client_id.decode(errors="replace")
+        if time.monotonic() < self.broker.refuse_until:
+            self.broker.record(self.client_id, "refused")
+            self.send(packet(CONNACK, 0, bytes([0, CONNACK_SERVER_UNAVAILABLE])))
+            await self.writer.drain()
+            return
+
+        self.broker.attach(self)
+        self.send(packet(CONNACK, 0, bytes([0, 0])))
+        while True:
+            kind, flags, body = await read_packet(self.reader)
+            if kind == PUBLISH:
+                self.on_publish(flags, body)
+            elif kind == SUBSCRIBE:
+                self.on_subscribe(body)
+            elif kind == UNSUBSCRIBE:
+                self.on_unsubscribe(body)
+            elif kind == PUBREC:
+                self.send(packet(PUBREL, 2, body[:2]))
+            elif kind == PUBREL:
+                self.qos2_received.discard(body[:2])
+                self.send(packet(PUBCOMP, 0, body[:2]))
+            elif kind == PINGREQ:
+                self.send(packet(PINGRESP, 0))
+            elif kind == DISCONNECT:
+                return
+            # PUBACK and PUBCOMP of outbound messages need nothing, sessions are clean
+            await self.writer.drain()
+
+    def on_publish(self, flags, body):
+        qos = (flags >> 1) & 3
+        topic, pos = read_string(body, 0)
+        packet_id = body[pos:pos + 2] if qos else b""
+        payload = body[pos + 2:] if qos else body[pos:]
+        if qos == 1:
+            self.send(packet(PUBACK, 0, packet_id))
+        elif qos == 2:
+            self.send(packet(PUBREC, 0, packet_id))
+            # a resend before PUBREL is the same message
+            if packet_id in self.qos2_received:
+                return
+            self.qos2_received.add(packet_id)
+        self.broker.route(topic.decode(errors="replace"), payload, qos, bool(flags & 1))
+
+    def on_subscribe(self, body):
+        packet_id = body[:2]
+        pos = 2
+        codes = bytearray()
+        topics = []
+        while pos < len(body):
+            topic, pos = read_string(body, pos)
+            qos = body[pos] & 3
+            pos += 1
+            topics.append(topic.decode(errors="replace"))
+            self.subscriptions[topics[-1]] = qos
+            codes.append(qos)
+        self.send(packet(SUBACK, 0, packet_id + bytes(codes)))
+        for topic in topics:
+            self.broker.record(self.client_id, "subscribed", topic)
+            for retained_topic, (payload, qos) in self.broker.retained.items():
+                if topic_matches(topic, retained_topic):
+                    self.deliver(retained_topic, payload, qos, retain=True)
+
+    def on_unsubscribe(self, body):
+        pos = 2
+        while pos < len(body):
+            topic, pos = read_string(body, pos)
+            self.subscriptions.pop(topic.decode(errors="replace"), None)
+        self.send(packet(UNSUBACK, 0, body[:2]))
+
+
+class Broker:
+    """clean sessions only, qos 0/1/2 in both directions, retained messages, fault injection"""
+
+    def __init__(self):
+        self.sessions = {}
+        self.retained = {}
+        self.events = []
+        self.listeners = []
+        self.refuse_until = 0.0
+        self.changed = asyncio.Event()
+
+    def record(self, client_id, what, detail=""):
+        self.events.append((time.monotonic(), client_id, what, detail))
+        self.changed.set()
+
+    def attach(self, session):
+        old = self.sessions.get(session.client_id)
+        if old:
+            old.writer.close()
+        self.sessions[session.client_id] = session
+        self.record(session.client_id, "connected")
+
+    def route(self, topic, payload, qos, retain=False):
+        if retain:
+            if payload:
+                self.retained[topic] = (payload, qos)
+            else:
+                self.retained.pop(topic, None)
+        for listener in self.listeners:
+            listener(topic, payload)
+        for session in list(self.sessions.values()):
+            session.deliver(topic, payload, qos)
+
+    def kick(self, client_id, refuse_for=0.0):
+        self.refuse_until = time.monotonic() + refuse_for
+        session = self.sessions.get(client_id)
+        if session:
+            session.writer.close()
+
+    async def handle(self, reader, writer):
+        session = Session(self, reader, writer)
+        try:
+            await session.run()
+        except (asyncio.IncompleteReadError, asyncio.CancelledError, ConnectionError, struct.error, IndexError):
+            pass
+        finally:
+            if self.sessions.get(session.client_id) is session:
+                del self.sessions[session.client_id]
+                self.record(session.client_id, "disconnected")
+            writer.close()
+
+    async def wait_for(self, predicate, timeout):
+        deadline = time.monotonic() + timeout
+        while not predicate():
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return False
+            self.changed.clear()
+            try:
+                await asyncio.wait_for(self.changed.wait(), remaining)
+            except asyncio.TimeoutError:
+                pass
+        return True
+
+
+async def echo_client(port, device, ping, pong):
+    """stands in for the device in --self-test, reconnects with a short fixed delay"""
+    while True:
+        try:
+            reader, writer = await asyncio.open_connection("127.0.0.1", port)
+            connect = string("MQTT") + bytes([4, 2]) + struct.pack(">H", 60) + string(device)
+            writer.write(packet(CONNECT, 0, connect))
+            kind, _, body = await read_packet(reader)
+            if kind != CONNACK or body[1] != 0:
+                raise ConnectionError("refused")
+            writer.write(packet(SUBSCRIBE, 2, struct.pack(">H", 1) + string(ping) + bytes([0])))
+            while True:
+                kind, flags, body = await read_packet(reader)
+                if kind == PUBLISH:
+                    qos = (flags >> 1) & 3
+                    _, pos = read_string(body, 0)
+                    writer.write(publish_packet(pong, body[pos + (2 if qos else 0):], 0))
+        except (OSError, asyncio.IncompleteReadError, ConnectionError):
+            await asyncio.sleep(0.5)
+
+
+def percentile(values, percent):
+    if not values:
+        return 0.0
+    index = min(len(values) - 1, int(round(len(values) * percent / 100.0 + 0.5)) - 1)
+    return values[max(index, 0)]
+
+
+def advertise(port):
+    try:
+        from zeroconf import ServiceInfo, Zeroconf
+    except ImportError:
+        print("zeroconf is not installed, the broker is not advertised")
+        return None
+    probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    probe.connect(("10.255.255.255", 1))
+    address = probe.getsockname()[0]
+    probe.close()
+    zeroconf = Zeroconf()
+    info = ServiceInfo("_mqtt._tcp.local.", "esparrag harness._mqtt._tcp.local.",
+                       addresses=[socket.inet_aton(address)], port=port)
+    zeroconf.register_service(info)
+    print("advertising _mqtt._tcp on %s:%d" % (address, port))
+    return zeroconf
+
+
+async def run_round(broker, args, number):
+    sent = {}
+    received = {}
+    duplicates = 0
+
+    def on_message(topic, payload):
+        nonlocal duplicates
+        if topic != args.pong:
+            return
+        try:
+            message = json.loads(payload)
+            key = (message["round"], message["seq"])
+        except (ValueError, KeyError, TypeError):
+            return
+        if key in received:
+            duplicates += 1
+        elif key in sent:
+            received[key] = time.perf_counter() - sent[key]
+
+    broker.listeners.append(on_message)
+    interval = 1.0 / args.rate if args.rate else 0
+    start = time.perf_counter()
+    for seq in range(args.burst):
+        payload = json.dumps({"round": number, "seq": seq}).encode()
+        sent[(number, seq)] = time.perf_counter()
+        broker.route(args.ping, payload, args.qos)
+        delay = start + (seq + 1) * interval - time.perf_counter()
+        await asyncio.sleep(max(delay, 0))
+    await broker.wait_for(lambda: len(received) == len(sent), args.settle)
+    broker.listeners.remove(on_message)
+
+    latencies = sorted(received.values())
+    lost = len(sent) - len(received)
+    print("round %d: %d sent, %d received, %d lost (%.1f%%), %d duplicates" %
+          (number, len(sent), len(received), lost, 100.0 * lost / len(sent), duplicates))
+    if latencies:
+        print("  latency p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms" %
+              tuple(v * 1000 for v in (percentile(latencies, 50), percentile(latencies, 90),
+                                       percentile(latencies, 99), latencies[-1])))
+    return len(sent), lost, latencies
+
+
+def subscribed(broker, device, topic, since):
+    return any(t >= since and c == device and what == "subscribed" and topic_matches(d, topic)
+               for t, c, what, d in broker.events)
+
+
+async def main_async(args):
+    broker = Broker()
+    server = await asyncio.start_server(broker.handle, args.bind, args.port)
+    port = server.sockets[0].getsockname()[1]
+    print("broker listening on %s:%d" % (args.bind, port))
+    zeroconf = advertise(port) if args.advertise else None
+    if args.self_test:
+        asyncio.ensure_future(echo_client(port, args.device, args.ping, args.pong))
+
+    print("waiting for %s to subscribe to %s" % (args.device, args.ping))
+    if not await broker.wait_for(lambda: subscribed(broker, args.device, args.ping, 0), args.timeout):
+        print("device did not subscribe within %.0fs" % args.timeout)
+        return 1
+
+    total_sent, total_lost, latencies = 0, 0, []
+    for number in range(args.rounds):
+        if number > 0:
+            # kick the device, refuse it for the outage and time how long it takes to be back
+            kicked = time.monotonic()
+            broker.kick(args.device, args.outage)
+            if not await broker.wait_for(lambda: subscribed(broker, args.device, args.ping, kicked), args.timeout):
+                print("device did not come back within %.0fs" % args.timeout)
+                return 1
+            back = [t for t, c, what, _ in broker.events if t >= kicked and c == args.device]
+            refused = [t for t, c, what, _ in broker.events if t >= kicked and c == args.device and what == "refused"]
+            gaps = ", ".join("%.1f" % (b - a) for a, b in zip([kicked] + refused, refused))
+            print("reconnected after %.2fs (%d refused attempts%s)" %
+                  (back[-1] - kicked, len(refused), ", gaps " + gaps + "s" if gaps else ""))
+        sent, lost, round_latencies = await run_round(broker, args, number)
+        total_sent += sent
+        total_lost += lost
+        latencies += round_latencies
+
+    latencies.sort()
+    loss = 100.0 * total_lost / total_sent if total_sent else 0.0
+    p99 = percentile(latencies, 99) * 1000
+    print("total: %d sent, %.1f%% lost, p99 %.1f ms" % (total_sent, loss, p99))
+
+    server.close()
+    if zeroconf:
+        zeroconf.close()
+    failed = (args.max_loss is not None and loss > args.max_loss) or (args.max_p99 is not None and p99 > args.max_p99)
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--device", default="MORAN_1", help="DEVICE_NAME, the mqtt client id")
+    parser.add_argument("--ping", help="default /<device>/bench/ping")
+    parser.add_argument("--pong", help="default /<device>/bench/pong")
+    parser.add_argument("--qos", type=int, choices=(0, 1, 2), default=0)
+    parser.add_argument("--rounds", type=int, default=3, help="bursts, the device is kicked between them")
+    parser.add_argument("--burst", type=int, default=100)
+    parser.add_argument("--rate", type=float, default=50, help="messages per second, 0 for back to back")
+    parser.add_argument("--outage", type=float, default=0, help="seconds to refuse reconnects after a kick")
+    parser.add_argument("--settle", type=float, default=3, help="seconds to wait for the last echoes")
+    parser.add_argument("--timeout", type=float, default=120)
+    parser.add_argument("--max-loss", type=float, help="percent")
+    parser.add_argument("--max-p99", type=float, help="milliseconds")
+    parser.add_argument("--advertise", action="store_true")
+    parser.add_argument("--self-test", action="store_true")
+    args = parser.parse_args()
+    args.ping = args.ping or "/%s/bench/ping" % args.device
+    args.pong = args.pong or "/%s/bench/pong" % args.device
+    sys.exit(asyncio.run(main_async(args)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Pack a web directory into a static files image for StaticFiles (network/esparrag_static_files.h).
+
+Every file is gzipped and indexed so the device can serve it straight out of
+memory mapped flash with Content-Encoding: gzip.
+
+usage: pack_www.py <web dir> <output image> [--max-size BYTES]
+"""
+import argparse
+import gzip
+import mimetypes
+import os
+import struct
+import sys
+import zlib
+
+IMAGE_MAGIC = 0x57575745  # "EWWW"
+IMAGE_VERSION = 1
+PATH_MAX_LEN = 48
+MIME_MAX_LEN = 32
+HEADER_FORMAT = "<IHHI"
+ENTRY_FORMAT = "<%ds%dsIII" % (PATH_MAX_LEN, MIME_MAX_LEN)
+ALIGNMENT = 4
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".htm": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".txt": "text/plain",
+}
+
+
+def collect(root):
+    files = []
+    for directory, _, names in os.walk(root):
+        for name in sorted(names):
+            full = os.path.join(directory, name)
+            uri = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            files.append((uri, full))
+    return sorted(files)
+
+
+def mime_of(path):
+    ext = os.path.splitext(path)[1].lower()
+    return MIME_TYPES.get(ext) or mimetypes.guess_type(path)[0] or "application/octet-stream"
+
+
+def pack(root, max_size):
+    files = collect(root)
+    data_offset = struct.calcsize(HEADER_FORMAT) + len(files) * struct.calcsize(ENTRY_FORMAT)
+    entries = b""
+    blobs = b""
+
+    for uri, path in files:
+        if len(uri) >= PATH_MAX_LEN:
+            sys.exit("path too long (max %d): %s" % (PATH_MAX_LEN - 1, uri))
+
+        with open(path, "rb") as f:
+            raw = f.read()
+        # mtime=0 keeps the image reproducible
+        compressed = gzip.compress(raw, compresslevel=9, mtime=0)
+        padding = (-len(blobs)) % ALIGNMENT
+        blobs += b"\0" * padding
+
+        offset = data_offset + len(blobs)
+        etag = zlib.crc32(compressed) & 0xFFFFFFFF
+        entries += struct.pack(ENTRY_FORMAT, uri.encode(), mime_of(path).encode()[:MIME_MAX_LEN - 1],
+                               offset, len(compressed), etag)
+        blobs += compressed
+        print("%-40s %7d -> %7d" % (uri, len(raw), len(compressed)))
+
+    size = data_offset + len(blobs)
+    if max_size and size > max_size:
+        sys.exit("image size %d exceeds partition size %d" % (size, max_size))
+
+    header = struct.pack(HEADER_FORMAT, IMAGE_MAGIC, IMAGE_VERSION, len(files), size)
+    return header + entries + blobs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("src")
+    parser.add_argument("output")
+    parser.add_argument("--max-size", type=lambda x: int(x, 0), default=0)
+    args = parser.parse_args()
+
+    image = pack(args.src, args.max_size)
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("static files image: %d bytes" % len(image))
+
+
+if __name__ == "__main__":
+    main()